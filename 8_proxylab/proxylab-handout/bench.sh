@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# bench.sh - run loadgen against the proxy with tiny as the origin
+#
+# usage: ./bench.sh [loadgen options]
+#
+# Starts tiny (with $TINY_ARGS, for example "-m threads") in a scratch
+# docroot and the proxy (with $PROXY_ARGS, for example "--event") on free
+# ports, runs loadgen with the given options and prints its JSON result.
+# Build with "make proxy loadgen" and "make -C tiny tiny" first, or use
+# "make bench".
+#
+cd "$(dirname "$0")"
+DOCROOT=$(mktemp -d)
+ORIGIN_PORT=$((20000 + RANDOM % 10000))
+PROXY_PORT=$((30000 + RANDOM % 10000))
+
+cleanup() {
+    kill $TINY_PID $PROXY_PID 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$DOCROOT"
+}
+trap cleanup EXIT
+
+# wait_port port pid name - wait until the process pid accepts connections
+# on port, or exit if it dies or takes longer than 5 s
+wait_port() {
+    local i
+    for ((i = 0; i < 50; i++)); do
+        if ! kill -0 $2 2>/dev/null; then
+            echo "$3 exited before listening on port $1" >&2
+            exit 1
+        fi
+        if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; then
+            # the port may be another program's that a dying $3 lost
+            sleep 0.1
+            if kill -0 $2 2>/dev/null; then
+                return
+            fi
+        fi
+        sleep 0.1
+    done
+    echo "$3 is not listening on port $1" >&2
+    exit 1
+}
+
+TINY=$(pwd)/tiny/tiny
+(cd "$DOCROOT" && exec "$TINY" $TINY_ARGS $ORIGIN_PORT) >/dev/null 2>&1 &
+TINY_PID=$!
+./proxy $PROXY_ARGS $PROXY_PORT >/dev/null 2>&1 &
+PROXY_PID=$!
+wait_port $ORIGIN_PORT $TINY_PID tiny
+wait_port $PROXY_PORT $PROXY_PID proxy
+
+./loadgen -p $PROXY_PORT -o $ORIGIN_PORT -d "$DOCROOT" "$@"
@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# bench_tiny.sh - compare tiny's concurrency modes under loadgen
+#
+# usage: ./bench_tiny.sh [loadgen options]
+#
+# For each of tiny's modes (iterative, prefork, threads) starts tiny in
+# a scratch docroot on a free port, with a pool of $TINY_WORKERS (8 by
+# default), runs loadgen straight at it with the given options and
+# prints loadgen's JSON result with the mode added. Build with "make
+# loadgen" and "make -C tiny tiny" first, or use "make bench_tiny".
+#
+cd "$(dirname "$0")"
+DOCROOT=$(mktemp -d)
+TINY=$(pwd)/tiny/tiny
+WORKERS=${TINY_WORKERS:-8}
+
+cleanup() {
+    kill $TINY_PID 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$DOCROOT"
+}
+trap cleanup EXIT
+
+# wait_port port pid name - wait until the process pid accepts connections
+# on port, or exit if it dies or takes longer than 5 s
+wait_port() {
+    local i
+    for ((i = 0; i < 50; i++)); do
+        if ! kill -0 $2 2>/dev/null; then
+            echo "$3 exited before listening on port $1" >&2
+            exit 1
+        fi
+        if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; then
+            # the port may be another program's that a dying $3 lost
+            sleep 0.1
+            if kill -0 $2 2>/dev/null; then
+                return
+            fi
+        fi
+        sleep 0.1
+    done
+    echo "$3 is not listening on port $1" >&2
+    exit 1
+}
+
+for MODE in iterative prefork threads; do
+    PORT=$((20000 + RANDOM % 10000))
+    (cd "$DOCROOT" && exec "$TINY" -m $MODE -n $WORKERS $PORT) \
+        >/dev/null 2>&1 &
+    TINY_PID=$!
+    wait_port $PORT $TINY_PID tiny
+    ./loadgen -o $PORT -d "$DOCROOT" "$@" |
+        sed "s/^{/{\"mode\": \"$MODE\", \"workers\": $WORKERS, /"
+    # a prefork pool goes with its parent
+    pkill -P $TINY_PID 2>/dev/null
+    kill $TINY_PID 2>/dev/null
+    wait $TINY_PID 2>/dev/null
+done
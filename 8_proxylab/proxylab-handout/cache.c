@@ -0,0 +1,938 @@
+/*
+ * cache.c - sharded, byte-budgeted cache of web objects with SIEVE eviction
+ *
+ * Each shard is an array of bucket chains that doubles whenever the
+ * shard holds more objects than buckets, protected by a reader/writer
+ * lock: lookups share it and only inserts and evictions take it
+ * exclusively. The shard is chosen by the top bits of the key's hash and
+ * the bucket by the low bits.
+ *
+ * All objects are also on one SIEVE queue, from queue_head (newest) to
+ * queue_tail (oldest). New objects enter at the head. To make room, the
+ * hand walks from the tail towards the head, clearing visited bits, and
+ * evicts the first object that was not visited, wrapping around to the
+ * tail at the head. A hit only stores 1 to the visited bit, and only if
+ * it is clear, so hits write nothing shared. The queue, the hand and the
+ * byte count are protected by queue_mutex, which inserts take before
+ * any shard lock. Evicted objects are handed to the disk tier after the
+ * locks are dropped.
+ *
+ * TinyLFU admission runs under queue_mutex before the evictions: it
+ * walks from the hand the way evict_one would, without clearing any
+ * visited bit, and compares the sketch estimate of each object that
+ * would be evicted with the candidate's. The walk has no side effects,
+ * so a rejected object leaves the queue as it was.
+ *
+ * Variants of one URL share a flight but differ in hash, so they may
+ * land on different shards; each is found with its own encoding.
+ *
+ * Fetches in progress live in a separate small hash table of flights
+ * under their own mutex; waiters sleep on the flight's condition
+ * variable, and the last one to leave a finished flight frees it.
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "disk.h"
+#include "sketch.h"
+#include "gzip.h"
+
+#define INIT_BUCKET_SUM 16
+#define FLIGHT_BUCKET_SUM 64
+#define SKETCH_MIN_WIDTH 1024
+#define SKETCH_BYTES_PER_COUNTER 512   /* sketch width per cache byte */
+
+/* visited bits are set by hits under a shard's read lock and cleared by
+   the hand under queue_mutex only, so every access is a relaxed atomic */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+/* a fetch in progress, led by the first miss on the object */
+struct flight {
+    char *host;                       /* key */
+    int port;
+    char *file;
+    unsigned int hash;
+    int done;                         /* the leader has finished */
+    int waiters;                      /* misses waiting for the leader */
+    pthread_cond_t cond;              /* signalled when done */
+    struct flight *next;              /* next flight in the same bucket */
+};
+
+/* one shard of the index */
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_object_t **buckets;
+    unsigned int bucket_sum;
+    int object_sum;
+    char pad[64];                     /* keep shards off each other's lines */
+} shard_t;
+
+/* cache state */
+static shard_t shards[CACHE_SHARD_SUM];
+static int cache_size;       /* bytes of web objects in the cache */
+static int cache_max_size;
+static cache_object_t *queue_head;
+static cache_object_t *queue_tail;
+static cache_object_t *hand;  /* next eviction candidate, NULL for the tail */
+static pthread_mutex_t queue_mutex;
+
+/* admission */
+static int admission;
+static sketch_t sketch;
+static cache_stats_t stats;  /* counters, under queue_mutex */
+
+/* fetches in progress */
+static flight_t *flights[FLIGHT_BUCKET_SUM];
+static pthread_mutex_t flight_mutex;
+
+/*
+ * hash_key - FNV-1a hash of (host, port, file, encoding)
+ */
+static unsigned int hash_key(const char *host, int port, const char *file,
+                             int encoding) {
+    unsigned int h = 2166136261u;
+    const char *p;
+
+    for (p = host; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    h = (h ^ (unsigned int)port) * 16777619u;
+    for (p = file; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    if (encoding != ENCODING_IDENTITY) {
+        h = (h ^ (unsigned int)encoding) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * shard_of - return the shard an object with this hash lives in
+ */
+static inline shard_t *shard_of(unsigned int hash) {
+    return &shards[hash >> 28 & (CACHE_SHARD_SUM - 1)];
+}
+
+/*
+ * queue_unlink - remove an object from the SIEVE queue, moving the hand
+ *                past it
+ */
+static void queue_unlink(cache_object_t *obj) {
+    if (hand == obj) {
+        hand = obj->newer;
+    }
+    if (obj->newer != NULL) {
+        obj->newer->older = obj->older;
+    } else {
+        queue_head = obj->older;
+    }
+    if (obj->older != NULL) {
+        obj->older->newer = obj->newer;
+    } else {
+        queue_tail = obj->newer;
+    }
+    obj->newer = obj->older = NULL;
+}
+
+/*
+ * queue_push - put a new object at the head of the SIEVE queue
+ */
+static void queue_push(cache_object_t *obj) {
+    obj->newer = NULL;
+    obj->older = queue_head;
+    if (queue_head != NULL) {
+        queue_head->newer = obj;
+    } else {
+        queue_tail = obj;
+    }
+    queue_head = obj;
+}
+
+/*
+ * bucket_of - return the chain an object with this hash lives on
+ */
+static inline cache_object_t **bucket_of(shard_t *sh, unsigned int hash) {
+    return &sh->buckets[hash & (sh->bucket_sum - 1)];
+}
+
+/*
+ * grow_shard - double the number of buckets and rehash every object
+ */
+static void grow_shard(shard_t *sh) {
+    cache_object_t **old = sh->buckets;
+    unsigned int old_sum = sh->bucket_sum;
+    cache_object_t *obj, *next;
+    unsigned int i;
+
+    sh->buckets = calloc(old_sum * 2, sizeof(cache_object_t *));
+    if (sh->buckets == NULL) { /* keep the old table, chains get longer */
+        sh->buckets = old;
+        return;
+    }
+    sh->bucket_sum = old_sum * 2;
+    for (i = 0; i < old_sum; i++) {
+        for (obj = old[i]; obj != NULL; obj = next) {
+            next = obj->hash_next;
+            obj->hash_next = *bucket_of(sh, obj->hash);
+            *bucket_of(sh, obj->hash) = obj;
+        }
+    }
+    free(old);
+}
+
+/*
+ * find_object - return the object with the key, or NULL
+ */
+static cache_object_t *find_object(shard_t *sh, const char *host, int port,
+                                   const char *file, int encoding,
+                                   unsigned int hash) {
+    cache_object_t *obj;
+
+    for (obj = *bucket_of(sh, hash); obj != NULL; obj = obj->hash_next) {
+        if (obj->hash == hash && obj->port == port &&
+            obj->encoding == encoding &&
+            strcmp(obj->host, host) == 0 && strcmp(obj->file, file) == 0) {
+            return obj;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * free_object - release an object's memory
+ */
+static void free_object(cache_object_t *obj) {
+    free(obj->host);
+    free(obj->file);
+    free(obj->header);
+    free(obj->validators);
+    chunk_list_free(&obj->body);
+    free(obj);
+}
+
+/*
+ * remove_object - unlink an object from its shard and the queue, then
+ *                 drop the cache's reference; caller holds queue_mutex and
+ *                 the shard's lock exclusively
+ */
+static void remove_object(shard_t *sh, cache_object_t *obj) {
+    cache_object_t **pp;
+
+    for (pp = bucket_of(sh, obj->hash); *pp != obj; pp = &(*pp)->hash_next)
+        ;
+    *pp = obj->hash_next;
+    sh->object_sum--;
+    queue_unlink(obj);
+    cache_size -= obj->size;
+    stats.objects--;
+    cache_put(obj);
+}
+
+/*
+ * evict_one - move the hand to the first object not visited since it last
+ *             passed and evict it, keeping a reference on the demoted list
+ *             for the disk tier; caller holds queue_mutex
+ */
+static void evict_one(cache_object_t **demoted) {
+    cache_object_t *obj = hand != NULL ? hand : queue_tail;
+    shard_t *sh;
+
+    while (LOAD(obj->visited)) {
+        STORE(obj->visited, 0);
+        obj = obj->newer != NULL ? obj->newer : queue_tail;
+    }
+    hand = obj;
+    sh = shard_of(obj->hash);
+    pthread_rwlock_wrlock(&sh->lock);
+    __sync_fetch_and_add(&obj->refcnt, 1);
+    remove_object(sh, obj);
+    pthread_rwlock_unlock(&sh->lock);
+    obj->hash_next = *demoted;  /* off its chain now, so the link is free */
+    *demoted = obj;
+    stats.evicted++;
+}
+
+/*
+ * admit - decide if an object with this hash and size may evict what it
+ *         needs to fit: it must have been requested more often lately
+ *         than every object evict_one would choose; caller holds
+ *         queue_mutex
+ *         return 1 to admit, 0 to reject
+ */
+static int admit(unsigned int hash, int size) {
+    cache_object_t *start = hand != NULL ? hand : queue_tail, *obj;
+    int need = cache_size + size - cache_max_size, freed = 0, candidate;
+    int lap;
+
+    if (admission == CACHE_ADMIT_ALL || need <= 0 || start == NULL) {
+        return 1;
+    }
+    candidate = sketch_estimate(&sketch, hash);
+    /* the first lap passes visited objects, as evict_one clears their
+       bits; if it frees too little, the second lap takes those too */
+    for (lap = 0; lap < 2; lap++) {
+        obj = start;
+        do {
+            if (LOAD(obj->visited) == lap) {
+                if (sketch_estimate(&sketch, obj->hash) >= candidate) {
+                    return 0;
+                }
+                if ((freed += obj->size) >= need) {
+                    return 1;
+                }
+            }
+            obj = obj->newer != NULL ? obj->newer : queue_tail;
+        } while (obj != start);
+    }
+    return 1;
+}
+
+/*
+ * cache_init - initialize an empty cache holding at most max_size bytes,
+ *              with an admission policy CACHE_ADMIT_*
+ */
+void cache_init(int max_size, int admission_policy) {
+    shard_t *sh;
+    int i;
+
+    for (i = 0; i < CACHE_SHARD_SUM; i++) {
+        sh = &shards[i];
+        sh->bucket_sum = INIT_BUCKET_SUM;
+        sh->buckets = calloc(sh->bucket_sum, sizeof(cache_object_t *));
+        if (sh->buckets == NULL) {
+            app_error("cache_init: cannot allocate hash table");
+        }
+        sh->object_sum = 0;
+        pthread_rwlock_init(&sh->lock, NULL);
+    }
+    cache_size = 0;
+    cache_max_size = max_size;
+    queue_head = queue_tail = hand = NULL;
+    admission = admission_policy;
+    if (admission == CACHE_ADMIT_TINYLFU) {
+        sketch_init(&sketch, max_size / SKETCH_BYTES_PER_COUNTER >
+                    SKETCH_MIN_WIDTH ? max_size / SKETCH_BYTES_PER_COUNTER :
+                    SKETCH_MIN_WIDTH);
+    }
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_init(&queue_mutex, NULL);
+    pthread_mutex_init(&flight_mutex, NULL);
+    gzip_init();
+}
+
+/*
+ * cache_get - look up the variant of an object in this encoding and pin
+ *             it for reading, counting the lookup for admission
+ *             return NULL on a miss; release a hit with cache_put
+ */
+cache_object_t *cache_get(const char *host, int port, const char *file,
+                          int encoding) {
+    unsigned int hash = hash_key(host, port, file, encoding);
+    shard_t *sh = shard_of(hash);
+    cache_object_t *obj;
+
+    if (admission == CACHE_ADMIT_TINYLFU) {
+        sketch_increment(&sketch, hash);
+    }
+
+    pthread_rwlock_rdlock(&sh->lock);
+    obj = find_object(sh, host, port, file, encoding, hash);
+    if (obj != NULL) {
+        __sync_fetch_and_add(&obj->refcnt, 1);
+        if (!LOAD(obj->visited)) {
+            STORE(obj->visited, 1);
+        }
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    return obj;
+}
+
+/*
+ * cache_flags - return the cache_lookup flags for a client's request
+ */
+int cache_flags(const request_t *r) {
+    return (r->no_cache ? CACHE_REVALIDATE : 0) | (r->gzip ? CACHE_GZIP : 0);
+}
+
+/*
+ * cache_lookup - find the variant to answer a client with, CACHE_* flags
+ *                saying what it accepts: the gzip variant if the client
+ *                takes gzip and one is usable, else the identity object,
+ *                which is then queued for compression
+ *                return the pinned object, fresh or not, or NULL
+ */
+cache_object_t *cache_lookup(const char *host, int port, const char *file,
+                             int flags) {
+    cache_object_t *obj;
+
+    if (flags & CACHE_GZIP) {
+        obj = cache_get(host, port, file, ENCODING_GZIP);
+        /* a variant made here cannot be revalidated, only made again */
+        if (obj != NULL && (obj->validators != NULL ||
+                            (!(flags & CACHE_REVALIDATE) &&
+                             cache_fresh(obj)))) {
+            return obj;
+        }
+        if (obj != NULL) {
+            cache_put(obj);
+        }
+    }
+    obj = cache_get(host, port, file, ENCODING_IDENTITY);
+    if (obj != NULL && (flags & CACHE_GZIP) && cache_fresh(obj) &&
+        __sync_bool_compare_and_swap(&obj->gzip_state, GZIP_UNTRIED,
+                                     GZIP_QUEUED)) {
+        __sync_fetch_and_add(&obj->refcnt, 1);
+        if (!gzip_queue(obj)) {
+            __atomic_store_n(&obj->gzip_state, GZIP_UNTRIED, __ATOMIC_RELAXED);
+            cache_put(obj);
+        }
+    }
+    return obj;
+}
+
+/*
+ * cache_put - release a reference to an object, freeing it after the last
+ */
+void cache_put(cache_object_t *obj) {
+    if (__sync_sub_and_fetch(&obj->refcnt, 1) == 0) {
+        free_object(obj);
+    }
+}
+
+/*
+ * cache_fresh - test if an object may be used without revalidation
+ */
+int cache_fresh(cache_object_t *obj) {
+    return __atomic_load_n(&obj->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/*
+ * cache_stale_ok - test if a pinned stale object may be sent when its
+ *                  server cannot be reached, given the client's CACHE_*
+ *                  flags: not if the client asked for revalidation or
+ *                  the stored response forbids using it stale
+ */
+int cache_stale_ok(cache_object_t *obj, int flags) {
+    return !(flags & CACHE_REVALIDATE) && !obj->no_stale;
+}
+
+/*
+ * cache_iov - describe a pinned object as sent to a client: header lines,
+ *             a Warning that it is stale and could not be revalidated if
+ *             stale is set, Connection line, then one iovec per body
+ *             chunk; iov needs CACHE_IOV_MAX entries
+ *             return the number of iovecs
+ */
+int cache_iov(cache_object_t *obj, int persistent, int stale,
+              struct iovec *iov) {
+    static char warning[] = "Warning: 110 - \"Response is Stale\"\r\n"
+                            "Warning: 111 - \"Revalidation Failed\"\r\n";
+    chunk_t *c;
+    int n = 1;
+
+    iov[0].iov_base = obj->header;
+    iov[0].iov_len = obj->header_len;
+    if (stale) {
+        iov[n].iov_base = warning;
+        iov[n].iov_len = sizeof(warning) - 1;
+        n++;
+    }
+    connection_end(&iov[n++], persistent);
+    for (c = obj->body.head; c != NULL; c = c->next) {
+        iov[n].iov_base = c->data;
+        iov[n].iov_len = c->len;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * cache_write - write a pinned object to fd, or the parts of it the
+ *               ranges in rs ask for if rs is not NULL
+ *               return the bytes written, or -1 if the write failed
+ */
+long cache_write(int fd, cache_object_t *obj, const range_set_t *rs,
+                 int persistent) {
+    struct iovec iov[CACHE_IOV_MAX], *range_iovs;
+    char *buf;
+    long rc;
+    int n;
+
+    if (rs != NULL && (n = range_iov(rs, obj->header, obj->header_len,
+                                     &obj->body, persistent, &range_iovs,
+                                     &buf)) > 0) {
+        rc = writev_n(fd, range_iovs, n);
+        free(range_iovs);
+        free(buf);
+        return rc;
+    }
+    return writev_n(fd, iov, cache_iov(obj, persistent, 0, iov));
+}
+
+/*
+ * cache_send - write the cached object to fd if present and fresh in
+ *              memory or on disk, in a variant the CACHE_* flags allow;
+ *              with CACHE_REVALIDATE no cached copy is used without
+ *              asking the server; rs holds the client's ranges, which a
+ *              disk hit ignores
+ *              a stale object in memory is pinned in *stale instead, if
+ *              stale is not NULL, for the caller to revalidate
+ *              return the bytes written on a cache hit, 0 on a miss, -1 if
+ *              the write failed
+ */
+long cache_send(int fd, const char *host, int port, const char *file,
+                int persistent, int flags, const range_set_t *rs,
+                cache_object_t **stale) {
+    int revalidate = flags & CACHE_REVALIDATE;
+    cache_object_t *obj;
+    long rc;
+
+    if ((obj = cache_lookup(host, port, file, flags)) == NULL) {
+        return revalidate ? 0 : disk_send(fd, host, port, file, persistent);
+    }
+    if (revalidate || !cache_fresh(obj)) {
+        if (stale != NULL) {
+            *stale = obj;
+        } else {
+            cache_put(obj);
+        }
+        return 0;
+    }
+    rc = cache_write(fd, obj, rs, persistent);
+    cache_put(obj);
+    return rc;
+}
+
+/*
+ * demote - hand a list of evicted objects to the disk tier and drop
+ *          them; identity suits every client, so only it is kept
+ */
+static void demote(cache_object_t *demoted) {
+    cache_object_t *obj;
+
+    while ((obj = demoted) != NULL) {
+        demoted = obj->hash_next;
+        if (obj->encoding == ENCODING_IDENTITY) {
+            disk_store(obj->host, obj->port, obj->file, obj->header,
+                       obj->header_len, &obj->body, obj->expires);
+        }
+        cache_put(obj);
+    }
+}
+
+/*
+ * link_object - put a built object into the cache, evicting objects until
+ *               it fits, unless it is bigger than the whole cache or the
+ *               admission policy keeps it out; then its body is handed
+ *               back in body and it is freed
+ *               return 1 if it was cached
+ */
+static int link_object(cache_object_t *obj, chunk_list_t *body) {
+    cache_object_t *old, *demoted = NULL;
+    shard_t *sh = shard_of(obj->hash);
+    int fits;
+
+    pthread_mutex_lock(&queue_mutex);
+    /* a concurrent miss may have cached the same object already */
+    pthread_rwlock_wrlock(&sh->lock);
+    if ((old = find_object(sh, obj->host, obj->port, obj->file,
+                           obj->encoding, obj->hash)) != NULL) {
+        remove_object(sh, old);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    /* cache_resize may have shrunk the cache since the caller checked */
+    fits = obj->size <= cache_max_size;
+    /* an object already cached under this key was admitted before */
+    if (!fits || (old == NULL && !admit(obj->hash, obj->size))) {
+        if (fits) {
+            stats.rejected++;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+        *body = obj->body;
+        chunk_list_init(&obj->body);
+        free_object(obj);
+        return 0;
+    }
+    while (cache_size + obj->size > cache_max_size) {
+        evict_one(&demoted);
+    }
+    pthread_rwlock_wrlock(&sh->lock);
+    obj->hash_next = *bucket_of(sh, obj->hash);
+    *bucket_of(sh, obj->hash) = obj;
+    if ((unsigned int)++sh->object_sum > sh->bucket_sum) {
+        grow_shard(sh);
+    }
+    pthread_rwlock_unlock(&sh->lock);
+    queue_push(obj);
+    cache_size += obj->size;
+    stats.objects++;
+    stats.admitted++;
+    pthread_mutex_unlock(&queue_mutex);
+    demote(demoted);
+    return 1;
+}
+
+/*
+ * new_object - allocate an object with its key and a header of
+ *              header_len bytes to be filled in
+ *              return NULL if out of memory
+ */
+static cache_object_t *new_object(const char *host, int port,
+                                  const char *file, int encoding,
+                                  int header_len) {
+    cache_object_t *obj = calloc(1, sizeof(cache_object_t));
+
+    if (obj == NULL) {
+        return NULL;
+    }
+    chunk_list_init(&obj->body);
+    obj->host = strdup(host);
+    obj->file = strdup(file);
+    obj->header = malloc(header_len + 1);
+    if (obj->host == NULL || obj->file == NULL || obj->header == NULL) {
+        free_object(obj);
+        return NULL;
+    }
+    obj->port = port;
+    obj->encoding = encoding;
+    obj->hash = hash_key(host, port, file, encoding);
+    obj->header_len = header_len;
+    obj->refcnt = 1;
+    return obj;
+}
+
+/*
+ * cache_insert - move a response into the cache as the variant in its
+ *                encoding, evicting objects until it fits
+ *                the body chunks are taken over and body is left empty;
+ *                if the object is not cached, because it may not be
+ *                stored, is too big or is not admitted, body is left
+ *                untouched
+ */
+void cache_insert(const char *host, int port, const char *file,
+                  response_t *r, chunk_list_t *body) {
+    cache_object_t *obj;
+    char length[64], *validators;
+    int length_len, size;
+    time_t now = time(NULL);
+    long fresh_for;
+
+    /* a copy that would need a full fetch on every use is not kept */
+    fresh_for = response_fresh_for(r, now);
+    if (!response_storable(r) ||
+        (fresh_for <= 0 && r->etag.len == 0 && r->modified.len == 0)) {
+        return;
+    }
+
+    /* chunked and EOF-delimited bodies get a Content-Length */
+    length_len = 0;
+    if (r->content_length < 0 && response_has_body(r, "GET")) {
+        length_len = sprintf(length, "Content-Length: %d\r\n", body->len);
+    }
+    size = r->header_len + length_len + body->len;
+    if (size >= MAX_OBJECT_SIZE || size > cache_max_size ||
+        body->count > CACHE_IOV_MAX - 3) {
+        return;
+    }
+
+    /* build the object outside the lock */
+    obj = new_object(host, port, file, r->encoding,
+                     r->header_len + length_len);
+    if (obj == NULL) {
+        return;
+    }
+    validators = malloc(r->etag.len + r->modified.len + VALIDATORS_EXTRA);
+    if (validators == NULL) {
+        free_object(obj);
+        return;
+    }
+    if (response_validators(r, validators) > 0) {
+        obj->validators = validators;
+    } else {
+        free(validators);
+    }
+    obj->expires = now + fresh_for;
+    obj->lifetime = fresh_for > 0 ? fresh_for : 0;
+    obj->no_stale = r->no_cache || r->must_revalidate;
+    obj->size = size;
+    memcpy(obj->header, r->header, r->header_len);
+    memcpy(obj->header + r->header_len, length, length_len);
+    obj->body = *body;
+    chunk_list_init(body);
+    link_object(obj, body);
+}
+
+/*
+ * cache_add_variant - cache a body made from a pinned object, such as
+ *                     its compressed form, as its variant in another
+ *                     encoding, fresh as long as the source is; header
+ *                     is the variant's own, without the blank line
+ *                     the body chunks are taken over if it is cached
+ *                     return 1 if it was cached
+ */
+int cache_add_variant(cache_object_t *src, int encoding, const char *header,
+                      int header_len, chunk_list_t *body) {
+    cache_object_t *obj;
+    int size = header_len + body->len;
+
+    if (size >= MAX_OBJECT_SIZE || size > cache_max_size ||
+        body->count > CACHE_IOV_MAX - 3 ||
+        (obj = new_object(src->host, src->port, src->file, encoding,
+                          header_len)) == NULL) {
+        return 0;
+    }
+    obj->expires = __atomic_load_n(&src->expires, __ATOMIC_RELAXED);
+    obj->lifetime = src->lifetime;
+    obj->no_stale = src->no_stale;
+    obj->size = size;
+    memcpy(obj->header, header, header_len);
+    obj->body = *body;
+    chunk_list_init(body);
+    if (!link_object(obj, body)) {
+        return 0;
+    }
+    pthread_mutex_lock(&queue_mutex);
+    stats.compressed++;
+    pthread_mutex_unlock(&queue_mutex);
+    return 1;
+}
+
+/*
+ * cache_refresh - a 304 revalidated a pinned object: cache a copy of it
+ *                 in its place with the header lines the 304 updates,
+ *                 fresh for as long as the 304 says or else as long as
+ *                 before; if no copy can be cached the object itself is
+ *                 only made fresh again
+ *                 return the pinned object to send, releasing obj if it
+ *                 is replaced
+ */
+cache_object_t *cache_refresh(cache_object_t *obj, response_t *r) {
+    time_t now = time(NULL);
+    long fresh_for = response_explicit(r) ? response_fresh_for(r, now)
+                                          : obj->lifetime;
+    cache_object_t *copy = NULL;
+    response_t merged;
+    chunk_list_t rejected;
+    chunk_t *c;
+    char *validators;
+
+    /* readers may be sending obj, so its header is not changed in place */
+    response_init(&merged);
+    if (response_merge(&merged, obj->header, obj->header_len, r) == 0 &&
+        merged.header_len + obj->body.len < MAX_OBJECT_SIZE) {
+        copy = new_object(obj->host, obj->port, obj->file, obj->encoding,
+                          merged.header_len);
+    }
+    for (c = obj->body.head; copy != NULL && c != NULL; c = c->next) {
+        if (chunk_append(&copy->body, c->data, c->len) < 0) {
+            free_object(copy);
+            copy = NULL;
+        }
+    }
+    if (copy != NULL && copy->body.count > CACHE_IOV_MAX - 3) {
+        free_object(copy);
+        copy = NULL;
+    }
+    if (copy != NULL) {
+        validators = malloc(merged.etag.len + merged.modified.len +
+                            VALIDATORS_EXTRA);
+        if (validators != NULL && response_validators(&merged,
+                                                      validators) > 0) {
+            copy->validators = validators;
+        } else {
+            free(validators);
+        }
+        copy->expires = now + fresh_for;
+        copy->lifetime = response_explicit(r) ? (fresh_for > 0 ? fresh_for : 0)
+                                              : obj->lifetime;
+        copy->no_stale = merged.no_cache || merged.must_revalidate;
+        copy->gzip_state = obj->gzip_state == GZIP_USELESS ? GZIP_USELESS
+                                                            : GZIP_UNTRIED;
+        copy->size = merged.header_len + copy->body.len;
+        memcpy(copy->header, merged.header, merged.header_len);
+        copy->refcnt = 2;       /* the cache's and the caller's */
+        chunk_list_init(&rejected);
+        if (!link_object(copy, &rejected)) {
+            chunk_list_free(&rejected);
+            copy = NULL;
+        }
+    }
+    response_free(&merged);
+    if (copy != NULL) {
+        cache_put(obj);
+        return copy;
+    }
+    __atomic_store_n(&obj->expires, now + fresh_for, __ATOMIC_RELAXED);
+    return obj;
+}
+
+/*
+ * cache_plan_fill - choose how to answer a range request from a response
+ *                   fetched whole: only a 200 framed by Content-Length is
+ *                   cut, and several ranges only from a body held whole
+ *                   *range_sum is set to the ranges resolved into out
+ *                   return FILL_*
+ */
+int cache_plan_fill(response_t *r, const range_set_t *rs, byte_range_t *out,
+                    int *range_sum) {
+    if (r->chunked || r->content_length < 0 ||
+        (*range_sum = range_resolve(rs, r->header, r->header_len,
+                                    r->content_length, out)) < 0) {
+        return FILL_WHOLE;
+    }
+    if (response_storable(r) &&
+        r->header_len + r->content_length < MAX_OBJECT_SIZE) {
+        return FILL_HOLD;
+    }
+    return *range_sum <= 1 ? FILL_SLICE : FILL_WHOLE;
+}
+
+/*
+ * free_flight - release a flight nobody refers to any more
+ */
+static void free_flight(flight_t *f) {
+    pthread_cond_destroy(&f->cond);
+    free(f->host);
+    free(f->file);
+    free(f);
+}
+
+/*
+ * cache_flight_begin - called after a cache miss; if no other miss on the
+ *                      object is being fetched, start a flight and return
+ *                      it, otherwise wait up to FLIGHT_TIMEOUT seconds for
+ *                      that fetch to end and return NULL
+ *                      either way the caller looks in the cache again, as
+ *                      the flight waited for, or one that ended after the
+ *                      miss, may have filled it; a leader that still
+ *                      misses fetches the object and calls cache_flight_end,
+ *                      a waiter fetches it itself
+ */
+flight_t *cache_flight_begin(const char *host, int port, const char *file) {
+    unsigned int hash = hash_key(host, port, file, ENCODING_IDENTITY);
+    flight_t **bucket = &flights[hash % FLIGHT_BUCKET_SUM];
+    flight_t *f;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&flight_mutex);
+    for (f = *bucket; f != NULL; f = f->next) {
+        if (f->hash == hash && f->port == port &&
+            strcmp(f->host, host) == 0 && strcmp(f->file, file) == 0) {
+            break;
+        }
+    }
+    if (f == NULL) {  /* lead a new flight */
+        if ((f = calloc(1, sizeof(flight_t))) != NULL) {
+            f->host = strdup(host);
+            f->file = strdup(file);
+            if (f->host == NULL || f->file == NULL) {
+                free(f->host);
+                free(f->file);
+                free(f);
+                f = NULL;
+            }
+        }
+        if (f != NULL) {
+            f->port = port;
+            f->hash = hash;
+            pthread_cond_init(&f->cond, NULL);
+            f->next = *bucket;
+            *bucket = f;
+        }
+        pthread_mutex_unlock(&flight_mutex);
+        return f;
+    }
+
+    /* wait for the leader */
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += FLIGHT_TIMEOUT;
+    f->waiters++;
+    while (!f->done) {
+        if (pthread_cond_timedwait(&f->cond, &flight_mutex, &deadline) ==
+            ETIMEDOUT) {
+            break;
+        }
+    }
+    if (--f->waiters == 0 && f->done) {
+        free_flight(f);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+    return NULL;
+}
+
+/*
+ * cache_flight_end - the leader is done fetching: wake the waiters
+ */
+void cache_flight_end(flight_t *f) {
+    flight_t **pp;
+
+    pthread_mutex_lock(&flight_mutex);
+    for (pp = &flights[f->hash % FLIGHT_BUCKET_SUM]; *pp != f;
+         pp = &(*pp)->next)
+        ;
+    *pp = f->next;
+    f->done = 1;
+    pthread_cond_broadcast(&f->cond);
+    if (f->waiters == 0) {
+        free_flight(f);
+    }
+    pthread_mutex_unlock(&flight_mutex);
+}
+
+/*
+ * cache_resize - change the bytes the cache may hold, evicting objects
+ *                until it fits
+ */
+void cache_resize(int max_size) {
+    cache_object_t *demoted = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    cache_max_size = max_size;
+    while (cache_size > cache_max_size) {
+        evict_one(&demoted);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    demote(demoted);
+}
+
+/*
+ * cache_snapshot - copy every object in memory that the disk tier keeps
+ *                  to it, oldest first so the newest survive a full tier
+ *                  return the number of objects offered
+ */
+int cache_snapshot(void) {
+    cache_object_t *obj, **objs;
+    int n = 0, i;
+
+    pthread_mutex_lock(&queue_mutex);
+    objs = malloc((stats.objects + 1) * sizeof(cache_object_t *));
+    for (obj = queue_tail; objs != NULL && obj != NULL; obj = obj->newer) {
+        if (obj->encoding == ENCODING_IDENTITY) {
+            __sync_fetch_and_add(&obj->refcnt, 1);
+            objs[n++] = obj;
+        }
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    for (i = 0; i < n; i++) {
+        obj = objs[i];
+        disk_store(obj->host, obj->port, obj->file, obj->header,
+                   obj->header_len, &obj->body,
+                   __atomic_load_n(&obj->expires, __ATOMIC_RELAXED));
+        cache_put(obj);
+    }
+    free(objs);
+    return n;
+}
+
+/*
+ * cache_stats - copy the counters
+ */
+void cache_stats(cache_stats_t *st) {
+    pthread_mutex_lock(&queue_mutex);
+    *st = stats;
+    st->bytes = cache_size;
+    st->agings = admission == CACHE_ADMIT_TINYLFU ?
+        __sync_fetch_and_add(&sketch.agings, 0) : 0;
+    pthread_mutex_unlock(&queue_mutex);
+}
@@ -0,0 +1,150 @@
+/*
+ * cache.h - web object cache for the proxy
+ *
+ * Objects are keyed on (host, port, file). The key's hash picks one of
+ * CACHE_SHARD_SUM shards, each a chained hash table with its own lock,
+ * so lookups on different shards never touch the same lock. Eviction
+ * follows SIEVE over one queue of all objects: a hit only sets the
+ * object's visited bit, and the eviction hand skips visited objects
+ * (clearing the bit) until it finds one to drop. Objects are variable
+ * sized; the cache holds as many as fit in its size, MAX_CACHE_SIZE
+ * bytes unless configured otherwise, and cache_resize changes it live.
+ *
+ * Objects are reference counted. A hit pins the object and drops every
+ * lock before the caller writes it to the client, so a slow client
+ * never stalls other hits or inserts. An evicted object is freed when
+ * its last reader releases it.
+ *
+ * An object is a response header without its hop-by-hop lines, always
+ * framed by Content-Length, and the body as the chunk list it was
+ * captured into. The Connection line and the blank line are added when
+ * it is sent, so one object serves both persistent and closing clients.
+ *
+ * Every object carries the time it stops being fresh, from the HTTP
+ * freshness rules, and the conditional header lines that revalidate it.
+ * cache_send only answers with fresh objects; it hands a stale one back
+ * to the caller, which asks the server with the object's validators and
+ * on a 304 calls cache_refresh, which caches a copy with the header lines
+ * the 304 updates, and sends that. If the server cannot be reached, the
+ * caller may send the stale object whole, with a Warning, when
+ * cache_stale_ok allows it.
+ *
+ * A client's byte ranges are answered from the whole object: with a
+ * range set cache_write sends a 206 built from slices of the body
+ * chunks, so a Range request is a hit like any other. A miss whose
+ * ranges may lie in a small object fetches the whole object instead,
+ * and cache_plan_fill tells the caller whether to keep it and cut the
+ * ranges from it or, when it is too big, relay just the one range.
+ *
+ * Objects are variants: the key also holds the content coding of the
+ * body, so one URL may be cached both as identity and as gzip. A client
+ * that takes gzip is answered with the gzip variant when there is one;
+ * when there is only an identity object of a text type, it gets that,
+ * and the object is queued for the compression thread (gzip.c), which
+ * adds the gzip variant for the clients after it. A variant the proxy
+ * made has no validators and lives only as long as its source is fresh.
+ *
+ * An admission policy can keep an object out when it would only push
+ * out more useful ones. With CACHE_ADMIT_TINYLFU every lookup is counted
+ * in a count-min sketch, and an object that needs evictions to fit is
+ * admitted only if it was requested more often lately than each object
+ * SIEVE would evict for it. One-off URLs, as in a scan, then do not
+ * flush the hot set. CACHE_ADMIT_ALL caches everything that fits.
+ *
+ * Concurrent misses on one object are coalesced: the first becomes the
+ * leader of a flight and fetches it, the others wait in
+ * cache_flight_begin until the leader ends the flight and then look in
+ * the cache again. A new leader looks again too, as a flight may have
+ * ended between its miss and its start.
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <sys/uio.h>
+#include "http.h"
+#include "chunk.h"
+#include "range.h"
+
+#define MAX_CACHE_SIZE (1024*1024)
+#define MAX_OBJECT_SIZE (100*1024)
+#define CACHE_IOV_MAX 17    /* header, Warning, Connection line, body chunks */
+#define CACHE_SHARD_SUM 16  /* a power of two */
+#define FLIGHT_TIMEOUT 10   /* seconds to wait for another miss's fetch */
+
+/* how a response fetched whole for a range request is answered */
+#define FILL_WHOLE 0    /* relayed as it is */
+#define FILL_HOLD 1     /* read whole and cached, the ranges cut from it */
+#define FILL_SLICE 2    /* too big to keep: only its one range relayed */
+
+/* cache_lookup flags */
+#define CACHE_REVALIDATE 1  /* no cached copy may be used unasked */
+#define CACHE_GZIP 2        /* the client takes gzip */
+
+/* admission policies */
+#define CACHE_ADMIT_ALL 0
+#define CACHE_ADMIT_TINYLFU 1
+
+typedef struct cache_object {
+    char *host;                       /* key */
+    int port;
+    char *file;
+    int encoding;                     /* ENCODING_* of the body */
+    unsigned int hash;                /* hash of the key */
+    char *header;                     /* header lines */
+    int header_len;
+    chunk_list_t body;
+    int size;                         /* bytes of header and body */
+    time_t expires;                   /* fresh until then */
+    long lifetime;                    /* seconds it was fresh for */
+    char *validators;                 /* conditional lines, NULL if none */
+    int gzip_state;                   /* GZIP_*, of an identity object */
+    int refcnt;                       /* cache reference + readers */
+    int visited;                      /* hit since the hand last passed */
+    int no_stale;                     /* may not be sent stale */
+    struct cache_object *hash_next;   /* next object in the same bucket */
+    struct cache_object *newer;       /* next object in the SIEVE queue */
+    struct cache_object *older;
+} cache_object_t;
+
+typedef struct {
+    int objects;
+    int bytes;
+    long long admitted;
+    long long rejected;         /* kept out by the admission policy */
+    long long evicted;
+    long long compressed;       /* gzip variants the proxy made */
+    long long agings;           /* times the sketch was halved */
+} cache_stats_t;
+
+typedef struct flight flight_t;
+
+void cache_init(int max_size, int admission);
+cache_object_t *cache_get(const char *host, int port, const char *file,
+                          int encoding);
+int cache_flags(const request_t *r);
+cache_object_t *cache_lookup(const char *host, int port, const char *file,
+                             int flags);
+void cache_put(cache_object_t *obj);
+int cache_fresh(cache_object_t *obj);
+int cache_stale_ok(cache_object_t *obj, int flags);
+cache_object_t *cache_refresh(cache_object_t *obj, response_t *r);
+int cache_iov(cache_object_t *obj, int persistent, int stale,
+              struct iovec *iov);
+long cache_write(int fd, cache_object_t *obj, const range_set_t *rs,
+                 int persistent);
+long cache_send(int fd, const char *host, int port, const char *file,
+                int persistent, int flags, const range_set_t *rs,
+                cache_object_t **stale);
+void cache_insert(const char *host, int port, const char *file,
+                  response_t *r, chunk_list_t *body);
+int cache_add_variant(cache_object_t *src, int encoding, const char *header,
+                      int header_len, chunk_list_t *body);
+int cache_plan_fill(response_t *r, const range_set_t *rs, byte_range_t *out,
+                    int *range_sum);
+flight_t *cache_flight_begin(const char *host, int port, const char *file);
+void cache_flight_end(flight_t *f);
+void cache_resize(int max_size);
+int cache_snapshot(void);
+void cache_stats(cache_stats_t *st);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,326 @@
+/*
+ * cache_bench.c - measure cache hit throughput under contention
+ *
+ * usage: cache_bench [-a] [-s seconds] [-n objects]
+ *
+ * Fills the cache with n small objects, then runs 1, 4, 16 and 64
+ * threads that look up random objects and release them, for s seconds
+ * each. The same is done against a model of the previous design, one
+ * table lock shared by every lookup plus an LRU list reordered under a
+ * global mutex on every hit. Prints hits per second for both.
+ *
+ * With -a it instead checks TinyLFU admission: it fills a full cache
+ * with n hot objects, hits every one of them so all are visited, then
+ * scans 4n objects that are each requested once. It prints how many of
+ * each are left and fails if a scan object displaced a hot one.
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define BENCH_FILE_LEN 32
+#define HOT_HITS 4      /* requests for each hot object in -a */
+#define SCAN_FACTOR 4   /* one-hit objects per hot object in -a */
+
+/* the previous design: one lock, LRU bump on every hit */
+typedef struct lru_object {
+    char *host;
+    int port;
+    char file[BENCH_FILE_LEN];
+    int refcnt;
+    struct lru_object *hash_next;
+    struct lru_object *prev;
+    struct lru_object *next;
+} lru_object_t;
+
+static lru_object_t **lru_buckets;
+static unsigned int lru_bucket_sum;
+static lru_object_t *lru_head;
+static pthread_rwlock_t lru_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t lru_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* benchmark state */
+static int object_sum = 1000;
+static int seconds = 2;
+static volatile int running;
+static int use_lru;
+
+typedef struct {
+    unsigned int seed;
+    long long hits;
+    char pad[64];
+} bench_thread_t;
+
+/*
+ * lru_hash - FNV-1a hash of (host, port, file), as the cache does it
+ */
+static unsigned int lru_hash(const char *host, int port, const char *file) {
+    unsigned int h = 2166136261u;
+
+    for (; *host; host++) {
+        h = (h ^ (unsigned char)*host) * 16777619u;
+    }
+    h = (h ^ (unsigned int)port) * 16777619u;
+    for (; *file; file++) {
+        h = (h ^ (unsigned char)*file) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * lru_get - look up an object the way the previous cache did
+ */
+static lru_object_t *lru_get(const char *host, int port, const char *file) {
+    unsigned int hash = lru_hash(host, port, file);
+    lru_object_t *obj;
+
+    pthread_rwlock_rdlock(&lru_table_lock);
+    for (obj = lru_buckets[hash & (lru_bucket_sum - 1)]; obj != NULL;
+         obj = obj->hash_next) {
+        if (obj->port == port && strcmp(obj->host, host) == 0 &&
+            strcmp(obj->file, file) == 0) {
+            break;
+        }
+    }
+    if (obj != NULL) {
+        __sync_fetch_and_add(&obj->refcnt, 1);
+        pthread_mutex_lock(&lru_mutex);
+        if (obj != lru_head) {
+            obj->prev->next = obj->next;
+            if (obj->next != NULL) {
+                obj->next->prev = obj->prev;
+            }
+            obj->prev = NULL;
+            obj->next = lru_head;
+            lru_head->prev = obj;
+            lru_head = obj;
+        }
+        pthread_mutex_unlock(&lru_mutex);
+    }
+    pthread_rwlock_unlock(&lru_table_lock);
+    return obj;
+}
+
+/*
+ * fill - put object_sum objects in both caches
+ */
+static void fill(void) {
+    static char header[] = "HTTP/1.0 200 OK\r\nContent-Length: 512\r\n\r\n";
+    char body[512], file[BENCH_FILE_LEN];
+    lru_object_t *obj;
+    unsigned int h;
+    response_t r;
+    chunk_list_t l;
+    int i;
+
+    memset(body, 'x', sizeof(body));
+    response_init(&r);
+    response_parse(&r, header, strlen(header));
+    lru_bucket_sum = 1;
+    while (lru_bucket_sum < (unsigned int)object_sum) {
+        lru_bucket_sum *= 2;
+    }
+    lru_buckets = Calloc(lru_bucket_sum, sizeof(lru_object_t *));
+    for (i = 0; i < object_sum; i++) {
+        sprintf(file, "/object%d", i);
+        chunk_list_init(&l);
+        chunk_append(&l, body, sizeof(body));
+        cache_insert("localhost", 80, file, &r, &l);
+        chunk_list_free(&l);
+
+        obj = Calloc(1, sizeof(lru_object_t));
+        obj->host = "localhost";
+        obj->port = 80;
+        strcpy(obj->file, file);
+        h = lru_hash(obj->host, obj->port, file) & (lru_bucket_sum - 1);
+        obj->hash_next = lru_buckets[h];
+        lru_buckets[h] = obj;
+        obj->next = lru_head;
+        if (lru_head != NULL) {
+            lru_head->prev = obj;
+        }
+        lru_head = obj;
+    }
+    response_free(&r);
+}
+
+/*
+ * bench_thread - look up random objects until told to stop
+ */
+static void *bench_thread(void *vargp) {
+    bench_thread_t *t = vargp;
+    char file[BENCH_FILE_LEN];
+    cache_object_t *obj;
+    lru_object_t *lobj;
+
+    while (running) {
+        sprintf(file, "/object%d", rand_r(&t->seed) % object_sum);
+        if (use_lru) {
+            if ((lobj = lru_get("localhost", 80, file)) != NULL) {
+                __sync_fetch_and_sub(&lobj->refcnt, 1);
+                t->hits++;
+            }
+        } else if ((obj = cache_get("localhost", 80, file,
+                                   ENCODING_IDENTITY)) != NULL) {
+            cache_put(obj);
+            t->hits++;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * run - return the hits per second of thread_sum threads
+ */
+static double run(int thread_sum) {
+    bench_thread_t *t = Calloc(thread_sum, sizeof(bench_thread_t));
+    pthread_t *tid = Calloc(thread_sum, sizeof(pthread_t));
+    long long hits = 0;
+    int i;
+
+    running = 1;
+    for (i = 0; i < thread_sum; i++) {
+        t[i].seed = i + 1;
+        Pthread_create(&tid[i], NULL, bench_thread, &t[i]);
+    }
+    sleep(seconds);
+    running = 0;
+    for (i = 0; i < thread_sum; i++) {
+        Pthread_join(tid[i], NULL);
+        hits += t[i].hits;
+    }
+    free(t);
+    free(tid);
+    return (double)hits / seconds;
+}
+
+/*
+ * insert - put one page-sized object with this name in the cache; at
+ *          the sketch's width per cache byte, pages this big keep its
+ *          counters apart, as real objects would
+ */
+static void insert(const char *file) {
+    static char header[] = "HTTP/1.0 200 OK\r\nContent-Length: 8192\r\n\r\n";
+    char body[8192];
+    response_t r;
+    chunk_list_t l;
+
+    memset(body, 'x', sizeof(body));
+    response_init(&r);
+    response_parse(&r, header, strlen(header));
+    chunk_list_init(&l);
+    chunk_append(&l, body, sizeof(body));
+    cache_insert("localhost", 80, file, &r, &l);
+    chunk_list_free(&l);
+    response_free(&r);
+}
+
+/*
+ * request - look up an object with this name as a client's request would
+ *           return 1 on a hit
+ */
+static int request(const char *file) {
+    cache_object_t *obj;
+
+    if ((obj = cache_get("localhost", 80, file, ENCODING_IDENTITY)) == NULL) {
+        return 0;
+    }
+    cache_put(obj);
+    return 1;
+}
+
+/*
+ * admission_test - scan one-hit objects past a visited hot set
+ *                  return 0 if the hot set survived
+ */
+static int admission_test(void) {
+    char file[BENCH_FILE_LEN];
+    cache_stats_t st;
+    int i, j, hot = 0, scan = 0;
+
+    /* size the cache to hold exactly the hot set */
+    cache_init(object_sum * 16384, CACHE_ADMIT_TINYLFU);
+    insert("/probe");
+    cache_stats(&st);
+    cache_resize(st.bytes * object_sum);
+    for (i = 0; i < object_sum; i++) {
+        sprintf(file, "/hot%d", i);
+        if (!request(file)) {
+            insert(file);
+        }
+    }
+    for (j = 0; j < HOT_HITS; j++) {
+        for (i = 0; i < object_sum; i++) {
+            sprintf(file, "/hot%d", i);
+            request(file);
+        }
+    }
+
+    for (i = 0; i < SCAN_FACTOR * object_sum; i++) {
+        sprintf(file, "/scan%d", i);
+        if (!request(file)) {
+            insert(file);
+        }
+    }
+
+    for (i = 0; i < object_sum; i++) {
+        sprintf(file, "/hot%d", i);
+        hot += request(file);
+    }
+    for (i = 0; i < SCAN_FACTOR * object_sum; i++) {
+        sprintf(file, "/scan%d", i);
+        scan += request(file);
+    }
+    cache_stats(&st);
+    printf("hot objects kept: %d/%d, scan objects cached: %d/%d, "
+           "rejected: %lld\n", hot, object_sum, scan,
+           SCAN_FACTOR * object_sum, st.rejected);
+    return hot == object_sum ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    static int thread_sums[] = {1, 4, 16, 64};
+    double sharded, lru;
+    int i, opt, check_admission = 0;
+
+    while ((opt = getopt(argc, argv, "as:n:")) != -1) {
+        switch (opt) {
+        case 'a':
+            check_admission = 1;
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'n':
+            object_sum = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a] [-s seconds] [-n objects]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (seconds <= 0 || object_sum <= 0) {
+        fprintf(stderr, "usage: %s [-a] [-s seconds] [-n objects]\n",
+                argv[0]);
+        exit(1);
+    }
+    if (check_admission) {
+        return admission_test();
+    }
+
+    cache_init(object_sum * 1024, CACHE_ADMIT_ALL);
+    fill();
+    printf("%d objects, %d s per run, %d cores\n", object_sum, seconds,
+           (int)sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %16s %16s %8s\n", "threads", "sharded hits/s", "lru hits/s",
+           "speedup");
+    for (i = 0; i < 4; i++) {
+        use_lru = 0;
+        sharded = run(thread_sums[i]);
+        use_lru = 1;
+        lru = run(thread_sums[i]);
+        printf("%8d %16.0f %16.0f %7.2fx\n", thread_sums[i], sharded, lru,
+               sharded / lru);
+    }
+    return 0;
+}
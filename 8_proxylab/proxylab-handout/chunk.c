@@ -0,0 +1,123 @@
+/*
+ * chunk.c - pooled buffer chunks for capturing web objects
+ *
+ * Each size class, CHUNK_MIN << i, has a free list of at most
+ * POOL_MAX_PER_CLASS chunks behind one mutex. Chunks are taken from the
+ * pool when possible and are never zeroed; the bytes past len are never
+ * read.
+ */
+#include "csapp.h"
+#include "chunk.h"
+
+#define CLASS_SUM 5             /* 1K, 2K, 4K, 8K, 16K */
+#define POOL_MAX_PER_CLASS 64
+
+static chunk_t *pool[CLASS_SUM];
+static int pool_count[CLASS_SUM];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * class_of - return the size class of a chunk of size bytes
+ */
+static int class_of(int size) {
+    int i = 0;
+
+    while ((CHUNK_MIN << i) < size) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * chunk_alloc - take a chunk of the given class from the pool, or malloc it
+ *               return NULL if out of memory
+ */
+static chunk_t *chunk_alloc(int class) {
+    chunk_t *c;
+
+    pthread_mutex_lock(&pool_mutex);
+    if ((c = pool[class]) != NULL) {
+        pool[class] = c->next;
+        pool_count[class]--;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    if (c == NULL) {
+        c = malloc(sizeof(chunk_t) + (CHUNK_MIN << class));
+        if (c == NULL) {
+            return NULL;
+        }
+        c->size = CHUNK_MIN << class;
+    }
+    c->next = NULL;
+    c->len = 0;
+    return c;
+}
+
+/*
+ * chunk_list_init - make an empty list
+ */
+void chunk_list_init(chunk_list_t *l) {
+    l->head = l->tail = NULL;
+    l->len = 0;
+    l->count = 0;
+}
+
+/*
+ * chunk_append - copy len bytes to the end of the list, adding chunks twice
+ *                the size of the last one as needed
+ *                return 0 on success, -1 if out of memory
+ */
+int chunk_append(chunk_list_t *l, const char *buf, int len) {
+    chunk_t *c;
+    int class, n;
+
+    while (len > 0) {
+        c = l->tail;
+        if (c == NULL || c->len == c->size) {
+            class = c == NULL ? 0 : class_of(c->size) + 1;
+            if (class >= CLASS_SUM) {
+                class = CLASS_SUM - 1;
+            }
+            if ((c = chunk_alloc(class)) == NULL) {
+                return -1;
+            }
+            if (l->tail != NULL) {
+                l->tail->next = c;
+            } else {
+                l->head = c;
+            }
+            l->tail = c;
+            l->count++;
+        }
+        n = c->size - c->len < len ? c->size - c->len : len;
+        memcpy(c->data + c->len, buf, n);
+        c->len += n;
+        l->len += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * chunk_list_free - return every chunk to the pool and empty the list
+ */
+void chunk_list_free(chunk_list_t *l) {
+    chunk_t *c, *next;
+    int class;
+
+    for (c = l->head; c != NULL; c = next) {
+        next = c->next;
+        class = class_of(c->size);
+        pthread_mutex_lock(&pool_mutex);
+        if (pool_count[class] < POOL_MAX_PER_CLASS) {
+            c->next = pool[class];
+            pool[class] = c;
+            pool_count[class]++;
+            c = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+        free(c);
+    }
+    chunk_list_init(l);
+}
@@ -0,0 +1,34 @@
+/*
+ * chunk.h - pooled buffer chunks for capturing web objects
+ *
+ * A response body headed for the cache is appended to a chunk list as
+ * it is relayed, so nothing is allocated or zeroed up front and a small
+ * object only takes a small chunk. Chunks double in size from CHUNK_MIN
+ * up to CHUNK_MAX. A finished list is handed to the cache as is; freed
+ * chunks go back to a pool per size for the next capture.
+ */
+#ifndef __CHUNK_H__
+#define __CHUNK_H__
+
+#define CHUNK_MIN 1024
+#define CHUNK_MAX (16*1024)
+
+typedef struct chunk {
+    struct chunk *next;
+    int len;                /* bytes used in data */
+    int size;               /* bytes available in data */
+    char data[];
+} chunk_t;
+
+typedef struct {
+    chunk_t *head;
+    chunk_t *tail;
+    int len;                /* bytes in all chunks */
+    int count;              /* number of chunks */
+} chunk_list_t;
+
+void chunk_list_init(chunk_list_t *l);
+int chunk_append(chunk_list_t *l, const char *buf, int len);
+void chunk_list_free(chunk_list_t *l);
+
+#endif /* __CHUNK_H__ */
@@ -0,0 +1,169 @@
+/*
+ * config.c - proxy settings from the command line and a config file
+ *
+ * The command line and the file go through config_set, so the two
+ * cannot disagree on a setting's name, unit or range.
+ */
+#include <limits.h>
+#include "csapp.h"
+#include "cache.h"
+#include "upool.h"
+#include "config.h"
+
+/*
+ * parse_long - parse a whole decimal value no smaller than min
+ *              return 0 on success, -1 if it is not one
+ */
+static int parse_long(const char *value, long min, long *n) {
+    char *end;
+
+    if (value == NULL) {
+        return -1;
+    }
+    errno = 0;
+    *n = strtol(value, &end, 10);
+    return (errno != 0 || end == value || *end != '\0' || *n < min ||
+            *n > INT_MAX) ? -1 : 0;
+}
+
+/*
+ * parse_flag - parse a flag's value, on if there is none
+ *              return 0 on success, -1 if it is not one
+ */
+static int parse_flag(const char *value, int *flag) {
+    if (value == NULL || strcmp(value, "on") == 0) {
+        *flag = 1;
+    } else if (strcmp(value, "off") == 0) {
+        *flag = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * config_init - fill in the defaults
+ */
+void config_init(config_t *cf) {
+    cf->threads = 0;
+    cf->queue_size = 0;
+    cf->event_mode = 0;
+    cf->reuseport = 0;
+    cf->admission = CACHE_ADMIT_ALL;
+    cf->cache_size = MAX_CACHE_SIZE;
+    cf->disk_path[0] = '\0';
+    cf->disk_size = DISK_CACHE_SIZE;
+    cf->client_timeout = CLIENT_IDLE_TIMEOUT;
+    cf->server_timeout = UPOOL_IDLE_TIMEOUT;
+    cf->drain_timeout = DRAIN_TIMEOUT;
+    cf->snapshot = 0;
+}
+
+/*
+ * config_set - set the setting with a long option's name; value is NULL
+ *              for a flag given without one
+ *              return 0 on success, -1 if the name or value is invalid
+ */
+int config_set(config_t *cf, const char *name, const char *value) {
+    long n;
+
+    if (strcmp(name, "event") == 0) {
+        return parse_flag(value, &cf->event_mode);
+    }
+    if (strcmp(name, "reuseport") == 0) {
+        return parse_flag(value, &cf->reuseport);
+    }
+    if (strcmp(name, "snapshot") == 0) {
+        return parse_flag(value, &cf->snapshot);
+    }
+    if (strcmp(name, "admission") == 0) {
+        if (value != NULL && strcmp(value, "all") == 0) {
+            cf->admission = CACHE_ADMIT_ALL;
+        } else if (value != NULL && strcmp(value, "tinylfu") == 0) {
+            cf->admission = CACHE_ADMIT_TINYLFU;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(name, "disk-cache") == 0) {
+        if (value == NULL || strlen(value) >= MAXLINE) {
+            return -1;
+        }
+        strcpy(cf->disk_path, value);
+        return 0;
+    }
+
+    /* the rest are numbers */
+    if (strcmp(name, "threads") == 0 && parse_long(value, 0, &n) == 0) {
+        cf->threads = n;
+    } else if (strcmp(name, "queue") == 0 && parse_long(value, 0, &n) == 0) {
+        cf->queue_size = n;
+    } else if (strcmp(name, "cache-size") == 0 &&
+               parse_long(value, 1, &n) == 0 && n <= INT_MAX / 1024) {
+        cf->cache_size = n * 1024;
+    } else if (strcmp(name, "disk-size") == 0 &&
+               parse_long(value, 1, &n) == 0) {
+        cf->disk_size = n;
+    } else if (strcmp(name, "client-timeout") == 0 &&
+               parse_long(value, 1, &n) == 0) {
+        cf->client_timeout = n;
+    } else if (strcmp(name, "server-timeout") == 0 &&
+               parse_long(value, 1, &n) == 0) {
+        cf->server_timeout = n;
+    } else if (strcmp(name, "drain-timeout") == 0 &&
+               parse_long(value, 0, &n) == 0) {
+        cf->drain_timeout = n;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * config_load - apply the settings in a config file on top of cf
+ *               return 0 on success, -1 if the file cannot be read or
+ *               has an invalid line, leaving cf partly updated
+ */
+int config_load(config_t *cf, const char *path) {
+    char line[MAXLINE], *name, *value, *p;
+    FILE *fp;
+    int lineno = 0, rc = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "config: cannot open %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((name = strtok(line, " \t\r\n")) == NULL) {
+            continue;
+        }
+        value = strtok(NULL, " \t\r\n");
+        if (strtok(NULL, " \t\r\n") != NULL ||
+            config_set(cf, name, value) < 0) {
+            fprintf(stderr, "config: %s:%d: invalid setting %s\n", path,
+                    lineno, name);
+            rc = -1;
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * config_finish - turn the defaults that depend on the machine into
+ *                 numbers
+ */
+void config_finish(config_t *cf, long cores) {
+    if (cf->threads == 0) {
+        cf->threads = cf->event_mode ? cores : THREADS_PER_CORE * cores;
+    }
+    if (cf->queue_size == 0) {
+        cf->queue_size = QUEUE_PER_THREAD * cf->threads;
+    }
+}
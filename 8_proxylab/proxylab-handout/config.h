@@ -0,0 +1,40 @@
+/*
+ * config.h - proxy settings from the command line and a config file
+ *
+ * Every setting has a long option and a config file line of the same
+ * name, "name value", one per line, with # starting a comment; a flag
+ * such as event takes on or off, or nothing for on. The file is read
+ * after the command line, so its lines win, and read again on SIGHUP.
+ */
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "csapp.h"
+
+#define THREADS_PER_CORE 8      /* default workers per core; they block */
+#define QUEUE_PER_THREAD 4      /* default queue slots per worker */
+#define CLIENT_IDLE_TIMEOUT 15  /* seconds a persistent client may idle */
+#define DRAIN_TIMEOUT 30        /* seconds a drain waits for requests */
+#define DISK_CACHE_SIZE 64      /* default disk tier size, in MiB */
+
+typedef struct {
+    int threads;                /* workers, or event loops; 0 for default */
+    int queue_size;             /* 0 for the default */
+    int event_mode;
+    int reuseport;              /* share the port with the next proxy */
+    int admission;              /* CACHE_ADMIT_* */
+    int cache_size;             /* bytes */
+    char disk_path[MAXLINE];    /* "" if there is no disk tier */
+    long disk_size;             /* MiB */
+    int client_timeout;         /* seconds */
+    int server_timeout;         /* seconds an idle server link is kept */
+    int drain_timeout;          /* seconds */
+    int snapshot;               /* a drain copies the cache to disk */
+} config_t;
+
+void config_init(config_t *cf);
+int config_set(config_t *cf, const char *name, const char *value);
+int config_load(config_t *cf, const char *path);
+void config_finish(config_t *cf, long cores);
+
+#endif /* __CONFIG_H__ */
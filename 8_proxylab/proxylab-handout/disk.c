@@ -0,0 +1,636 @@
+/*
+ * disk.c - optional on-disk tier of the web object cache
+ *
+ * A segment file starts with a segment_header_t whose seq orders the two
+ * segments; records follow back to back, each a record_t, the host, the
+ * file, the header lines and the body, padded to 8 bytes. The checksum
+ * covers everything in the record after the checksum field.
+ *
+ * Each segment is mapped read-only over its whole maximum size once, so
+ * headers are read in place and appends show up through the mapping.
+ * The index lives in memory only: it is rebuilt from the segments at
+ * startup, older segment first so newer records win. Recycling a segment
+ * writes a fresh file and renames it over the old one, so pinned hits
+ * keep reading the old file until they release it.
+ *
+ * One mutex protects the index, the segment slots and the appends.
+ *
+ * Only one proxy uses the files at a time: it holds an flock on
+ * <path>.lock until it exits. A proxy started to take over from a
+ * draining one waits for that lock in the background, so it indexes the
+ * segments only after the old proxy has snapshotted its memory cache to
+ * them.
+ */
+#include <stddef.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "http.h"
+#include "cache.h"
+#include "disk.h"
+
+#define SEGMENT_MAGIC 0x4b445850    /* "PXDK" */
+#define RECORD_MAGIC 0x4a424f50     /* "POBJ" */
+#define DISK_VERSION 3             /* 3: only identity bodies */
+#define INIT_INDEX_SUM 256
+#define ALIGN8(n) (((n) + 7) & ~7L)
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long seq;         /* higher is newer */
+} segment_header_t;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int checksum;          /* FNV-1a of the rest of the record */
+    int port;
+    int host_len;
+    int file_len;
+    int header_len;
+    int body_len;
+    int pad;
+    long long expires;              /* fresh until then */
+} record_t;
+
+struct disk_segment {
+    int fd;
+    char *map;                      /* segment_max bytes, read only */
+    unsigned long long seq;
+    long end;                       /* bytes of valid records */
+    int refcnt;                     /* the tier's slot + pinned hits */
+};
+
+/* where an object lives on disk */
+typedef struct disk_entry {
+    char *host;                     /* key */
+    int port;
+    char *file;
+    unsigned int hash;
+    int slot;                       /* segment 0 or 1 */
+    long offset;                    /* of the record */
+    long header_offset;
+    int header_len;
+    int body_len;
+    time_t expires;
+    struct disk_entry *next;        /* next entry in the same bucket */
+} disk_entry_t;
+
+/* tier state */
+static int enabled;                 /* set once the segments are indexed */
+static int lock_fd;                 /* holds the flock on <path>.lock */
+static char *base_path;
+static long segment_max;
+static disk_segment_t *slots[2];
+static int active;                  /* slot being appended to */
+static disk_entry_t **index_buckets;
+static unsigned int index_bucket_sum;
+static disk_stats_t stats;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * disk_error - report a failed operation on the tier
+ */
+static void disk_error(const char *msg) {
+    fprintf(stderr, "disk cache: %s: %s\n", msg, strerror(errno));
+}
+
+/*
+ * fnv - continue an FNV-1a hash over len bytes
+ */
+static unsigned int fnv(unsigned int h, const void *buf, long len) {
+    const unsigned char *p = buf;
+
+    while (len-- > 0) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+ * hash_key - FNV-1a hash of (host, port, file), as the memory tier does it
+ */
+static unsigned int hash_key(const char *host, int port, const char *file) {
+    unsigned int h = fnv(2166136261u, host, strlen(host));
+
+    h = (h ^ (unsigned int)port) * 16777619u;
+    return fnv(h, file, strlen(file));
+}
+
+/*
+ * record_size - bytes a record takes in a segment, padding included
+ */
+static long record_size(const record_t *r) {
+    return ALIGN8(sizeof(record_t) + (long)r->host_len + r->file_len +
+                  r->header_len + r->body_len);
+}
+
+/*
+ * segment_path - the file name of a slot, or of its replacement
+ */
+static void segment_path(char *buf, int slot, int tmp) {
+    sprintf(buf, "%s.%d%s", base_path, slot, tmp ? ".tmp" : "");
+}
+
+/*
+ * map_segment - wrap an open segment file whose header is valid
+ *               return NULL on error
+ */
+static disk_segment_t *map_segment(int fd, unsigned long long seq, long end) {
+    disk_segment_t *seg;
+
+    if ((seg = calloc(1, sizeof(disk_segment_t))) == NULL) {
+        return NULL;
+    }
+    seg->map = mmap(NULL, segment_max, PROT_READ, MAP_SHARED, fd, 0);
+    if (seg->map == MAP_FAILED) {
+        free(seg);
+        return NULL;
+    }
+    seg->fd = fd;
+    seg->seq = seq;
+    seg->end = end;
+    seg->refcnt = 1;
+    return seg;
+}
+
+/*
+ * put_segment - release a reference to a segment, unmapping and closing
+ *               it after the last; caller holds disk_mutex
+ */
+static void put_segment(disk_segment_t *seg) {
+    if (--seg->refcnt == 0) {
+        munmap(seg->map, segment_max);
+        close(seg->fd);
+        free(seg);
+    }
+}
+
+/*
+ * new_segment - create an empty segment file for a slot, replacing the
+ *               old file atomically
+ *               return NULL on error
+ */
+static disk_segment_t *new_segment(int slot, unsigned long long seq) {
+    char path[MAXLINE], tmp[MAXLINE];
+    segment_header_t sh;
+    disk_segment_t *seg;
+    int fd;
+
+    segment_path(path, slot, 0);
+    segment_path(tmp, slot, 1);
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return NULL;
+    }
+    sh.magic = SEGMENT_MAGIC;
+    sh.version = DISK_VERSION;
+    sh.seq = seq;
+    if (write(fd, &sh, sizeof(sh)) != sizeof(sh) || rename(tmp, path) < 0 ||
+        (seg = map_segment(fd, seq, sizeof(sh))) == NULL) {
+        close(fd);
+        unlink(tmp);
+        return NULL;
+    }
+    return seg;
+}
+
+/*
+ * open_segment - open a slot's existing segment file, or start a new one
+ *                if it is missing or not a segment
+ *                return NULL on error
+ */
+static disk_segment_t *open_segment(int slot) {
+    char path[MAXLINE];
+    segment_header_t sh;
+    struct stat st;
+    disk_segment_t *seg;
+    int fd;
+
+    segment_path(path, slot, 0);
+    if ((fd = open(path, O_RDWR)) < 0) {
+        return new_segment(slot, 0);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(sh) ||
+        read(fd, &sh, sizeof(sh)) != sizeof(sh) ||
+        sh.magic != SEGMENT_MAGIC || sh.version != DISK_VERSION ||
+        (seg = map_segment(fd, sh.seq, st.st_size)) == NULL) {
+        close(fd);
+        return new_segment(slot, 0);
+    }
+    return seg;
+}
+
+/*
+ * find_entry - return the link to the index entry with the key; the link
+ *              is the NULL at the end of the chain on a miss
+ */
+static disk_entry_t **find_entry(const char *host, int port,
+                                 const char *file, unsigned int hash) {
+    disk_entry_t **pp;
+
+    for (pp = &index_buckets[hash & (index_bucket_sum - 1)]; *pp != NULL;
+         pp = &(*pp)->next) {
+        if ((*pp)->hash == hash && (*pp)->port == port &&
+            strcmp((*pp)->host, host) == 0 && strcmp((*pp)->file, file) == 0) {
+            return pp;
+        }
+    }
+    return pp;
+}
+
+/*
+ * free_entry - unlink and release the entry *pp
+ */
+static void free_entry(disk_entry_t **pp) {
+    disk_entry_t *e = *pp;
+
+    *pp = e->next;
+    stats.objects--;
+    free(e->host);
+    free(e->file);
+    free(e);
+}
+
+/*
+ * grow_index - double the number of index buckets
+ */
+static void grow_index(void) {
+    disk_entry_t **old = index_buckets, *e, *next;
+    unsigned int old_sum = index_bucket_sum, i;
+
+    index_buckets = calloc(old_sum * 2, sizeof(disk_entry_t *));
+    if (index_buckets == NULL) {
+        index_buckets = old;
+        return;
+    }
+    index_bucket_sum = old_sum * 2;
+    for (i = 0; i < old_sum; i++) {
+        for (e = old[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = index_buckets[e->hash & (index_bucket_sum - 1)];
+            index_buckets[e->hash & (index_bucket_sum - 1)] = e;
+        }
+    }
+    free(old);
+}
+
+/*
+ * index_add - point the key at a record, replacing an older entry
+ */
+static void index_add(const char *host, int port, const char *file,
+                      int slot, long offset, const record_t *r) {
+    unsigned int hash = hash_key(host, port, file);
+    disk_entry_t **pp = find_entry(host, port, file, hash), *e;
+
+    if (*pp != NULL) {
+        free_entry(pp);
+    }
+    if ((e = calloc(1, sizeof(disk_entry_t))) == NULL) {
+        return;
+    }
+    e->host = strdup(host);
+    e->file = strdup(file);
+    if (e->host == NULL || e->file == NULL) {
+        free(e->host);
+        free(e->file);
+        free(e);
+        return;
+    }
+    e->port = port;
+    e->hash = hash;
+    e->slot = slot;
+    e->offset = offset;
+    e->header_offset = offset + sizeof(record_t) + r->host_len + r->file_len;
+    e->header_len = r->header_len;
+    e->body_len = r->body_len;
+    e->expires = r->expires;
+    e->next = index_buckets[hash & (index_bucket_sum - 1)];
+    index_buckets[hash & (index_bucket_sum - 1)] = e;
+    if ((unsigned int)++stats.objects > index_bucket_sum) {
+        grow_index();
+    }
+}
+
+/*
+ * drop_slot - forget every object in a slot
+ */
+static void drop_slot(int slot) {
+    disk_entry_t **pp;
+    unsigned int i;
+
+    for (i = 0; i < index_bucket_sum; i++) {
+        for (pp = &index_buckets[i]; *pp != NULL; ) {
+            if ((*pp)->slot == slot) {
+                free_entry(pp);
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+}
+
+/*
+ * scan_slot - index every valid record in a slot's segment and cut the
+ *             file after the last one
+ */
+static void scan_slot(int slot) {
+    disk_segment_t *seg = slots[slot];
+    long off = sizeof(segment_header_t), size = seg->end;
+    char host[MAXLINE], file[MAXLINE];
+    const record_t *r;
+    const char *p;
+
+    if (size > segment_max) {
+        size = segment_max;
+    }
+    while (off + (long)sizeof(record_t) <= size) {
+        r = (const record_t *)(seg->map + off);
+        if (r->magic != RECORD_MAGIC || r->host_len <= 0 ||
+            r->host_len >= MAXLINE || r->file_len <= 0 ||
+            r->file_len >= MAXLINE || r->header_len < 0 || r->body_len < 0 ||
+            off + record_size(r) > size ||
+            fnv(2166136261u, &r->port,
+                record_size(r) - offsetof(record_t, port)) != r->checksum) {
+            break;
+        }
+        p = seg->map + off + sizeof(record_t);
+        memcpy(host, p, r->host_len);
+        host[r->host_len] = '\0';
+        memcpy(file, p + r->host_len, r->file_len);
+        file[r->file_len] = '\0';
+        index_add(host, r->port, file, slot, off, r);
+        off += record_size(r);
+    }
+    if (off != seg->end) {
+        fprintf(stderr, "disk cache: segment %d cut from %ld to %ld bytes\n",
+                slot, seg->end, off);
+        if (ftruncate(seg->fd, off) < 0) {
+            disk_error("cannot cut segment");
+        }
+        seg->end = off;
+    }
+    stats.bytes += seg->end;
+}
+
+/*
+ * open_tier - open or create the segments and index the objects in them
+ *             return 0 on success, -1 if the tier cannot be used
+ */
+static int open_tier(void) {
+    int old;
+
+    pthread_mutex_lock(&disk_mutex);
+    index_bucket_sum = INIT_INDEX_SUM;
+    index_buckets = calloc(index_bucket_sum, sizeof(disk_entry_t *));
+    if (index_buckets == NULL ||
+        (slots[0] = open_segment(0)) == NULL ||
+        (slots[1] = open_segment(1)) == NULL) {
+        pthread_mutex_unlock(&disk_mutex);
+        return -1;
+    }
+    active = slots[1]->seq > slots[0]->seq;
+    old = !active;
+    scan_slot(old);
+    scan_slot(active);
+    pthread_mutex_unlock(&disk_mutex);
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * lock_thread - open the tier once the proxy holding its lock exits
+ */
+static void *lock_thread(void *vargp) {
+    Pthread_detach(pthread_self());
+    if (flock(lock_fd, LOCK_EX) < 0 || open_tier() < 0) {
+        disk_error("cannot take over the tier");
+    } else {
+        fprintf(stderr, "disk cache: %s taken over\n", base_path);
+    }
+    return NULL;
+}
+
+/*
+ * disk_init - open or create the tier's segments under path, bounded to
+ *             max_size bytes, and index the objects already on disk; if
+ *             another proxy holds the tier, do that in the background
+ *             once it exits, the tier missing until then
+ *             return 0 on success, -1 if the tier cannot be used
+ */
+int disk_init(const char *path, long max_size) {
+    char lock_path[MAXLINE];
+    pthread_t tid;
+
+    base_path = strdup(path);
+    segment_max = ALIGN8(max_size / 2);
+    if (base_path == NULL || segment_max <= (long)sizeof(segment_header_t) ||
+        strlen(path) + sizeof(".lock") > MAXLINE) {
+        return -1;
+    }
+    sprintf(lock_path, "%s.lock", path);
+    if ((lock_fd = open(lock_path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return -1;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) == 0) {
+        return open_tier();
+    }
+    if (errno != EWOULDBLOCK) {
+        return -1;
+    }
+    fprintf(stderr, "disk cache: %s is in use, waiting for it\n", path);
+    Pthread_create(&tid, NULL, lock_thread, NULL);
+    return 0;
+}
+
+/*
+ * recycle - drop the older segment and make it the active one
+ *           return 0 on success, -1 on error; caller holds disk_mutex
+ */
+static int recycle(void) {
+    int slot = !active;
+    disk_segment_t *seg;
+
+    if ((seg = new_segment(slot, slots[active]->seq + 1)) == NULL) {
+        return -1;
+    }
+    drop_slot(slot);
+    stats.bytes -= slots[slot]->end - seg->end;
+    put_segment(slots[slot]);
+    slots[slot] = seg;
+    active = slot;
+    stats.recycles++;
+    return 0;
+}
+
+/*
+ * disk_store - append an object evicted from memory to the tier, unless
+ *              it is no longer fresh
+ */
+void disk_store(const char *host, int port, const char *file,
+                const char *header, int header_len, chunk_list_t *body,
+                time_t expires) {
+    static char zero[8];
+    struct iovec iov[CACHE_IOV_MAX + 8];
+    disk_segment_t *seg;
+    record_t r;
+    chunk_t *c;
+    long size;
+    unsigned int h;
+    int n, i;
+
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) ||
+        expires <= time(NULL)) {
+        return;
+    }
+    r.magic = RECORD_MAGIC;
+    r.port = port;
+    r.host_len = strlen(host);
+    r.file_len = strlen(file);
+    r.header_len = header_len;
+    r.body_len = body->len;
+    r.pad = 0;
+    r.expires = expires;
+    size = record_size(&r);
+    if (size > segment_max - (long)sizeof(segment_header_t) ||
+        body->count > CACHE_IOV_MAX) {
+        return;
+    }
+
+    iov[0].iov_base = &r;
+    iov[0].iov_len = sizeof(r);
+    iov[1].iov_base = (char *)host;
+    iov[1].iov_len = r.host_len;
+    iov[2].iov_base = (char *)file;
+    iov[2].iov_len = r.file_len;
+    iov[3].iov_base = (char *)header;
+    iov[3].iov_len = header_len;
+    n = 4;
+    for (c = body->head; c != NULL; c = c->next) {
+        iov[n].iov_base = c->data;
+        iov[n].iov_len = c->len;
+        n++;
+    }
+    iov[n].iov_base = zero;
+    iov[n].iov_len = size - (sizeof(r) + r.host_len + r.file_len +
+                             header_len + body->len);
+    n++;
+    h = fnv(2166136261u, &r.port, sizeof(r) - offsetof(record_t, port));
+    for (i = 1; i < n; i++) {
+        h = fnv(h, iov[i].iov_base, iov[i].iov_len);
+    }
+    r.checksum = h;
+
+    pthread_mutex_lock(&disk_mutex);
+    if (slots[active]->end + size > segment_max && recycle() < 0) {
+        disk_error("cannot recycle segment");
+        pthread_mutex_unlock(&disk_mutex);
+        return;
+    }
+    seg = slots[active];
+    if (pwritev(seg->fd, iov, n, seg->end) != size) {
+        disk_error("cannot write record");
+        if (ftruncate(seg->fd, seg->end) < 0) {
+            disk_error("cannot cut segment");
+        }
+    } else {
+        index_add(host, port, file, active, seg->end, &r);
+        seg->end += size;
+        stats.bytes += size;
+        stats.stores++;
+    }
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+/*
+ * disk_get - look up a fresh object on disk and pin its segment
+ *            return 1 on a hit, 0 on a miss; release a hit with
+ *            disk_release
+ */
+int disk_get(const char *host, int port, const char *file, disk_hit_t *hit) {
+    unsigned int hash;
+    disk_entry_t *e;
+    disk_segment_t *seg;
+
+    hit->segment = NULL;
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    hash = hash_key(host, port, file);
+    pthread_mutex_lock(&disk_mutex);
+    if ((e = *find_entry(host, port, file, hash)) == NULL ||
+        e->expires <= time(NULL)) {
+        pthread_mutex_unlock(&disk_mutex);
+        return 0;
+    }
+    seg = slots[e->slot];
+    seg->refcnt++;
+    stats.hits++;
+    hit->segment = seg;
+    hit->header = seg->map + e->header_offset;
+    hit->header_len = e->header_len;
+    hit->fd = seg->fd;
+    hit->body_offset = e->header_offset + e->header_len;
+    hit->body_len = e->body_len;
+    pthread_mutex_unlock(&disk_mutex);
+    return 1;
+}
+
+/*
+ * disk_release - unpin a hit
+ */
+void disk_release(disk_hit_t *hit) {
+    if (hit->segment != NULL) {
+        pthread_mutex_lock(&disk_mutex);
+        put_segment(hit->segment);
+        pthread_mutex_unlock(&disk_mutex);
+        hit->segment = NULL;
+    }
+}
+
+/*
+ * disk_send - write the object to fd if it is fresh on disk, the header with
+ *             writev and the body with sendfile
+ *             return the bytes written on a hit, 0 on a miss, -1 if the
+ *             write failed
+ */
+long disk_send(int fd, const char *host, int port, const char *file,
+               int persistent) {
+    disk_hit_t hit;
+    struct iovec iov[2];
+    off_t offset;
+    long left, rc;
+    ssize_t n;
+
+    if (!disk_get(host, port, file, &hit)) {
+        return 0;
+    }
+    iov[0].iov_base = (char *)hit.header;
+    iov[0].iov_len = hit.header_len;
+    connection_end(&iov[1], persistent);
+    rc = writev_n(fd, iov, 2);
+    if (rc >= 0) {
+        rc += hit.body_len;
+    }
+    offset = hit.body_offset;
+    for (left = hit.body_len; rc > 0 && left > 0; left -= n) {
+        if ((n = sendfile(fd, hit.fd, &offset, left)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            rc = -1;
+        }
+    }
+    disk_release(&hit);
+    return rc;
+}
+
+/*
+ * disk_stats - take a consistent snapshot of the tier's counters
+ */
+void disk_stats(disk_stats_t *st) {
+    pthread_mutex_lock(&disk_mutex);
+    *st = stats;
+    pthread_mutex_unlock(&disk_mutex);
+}
@@ -0,0 +1,53 @@
+/*
+ * disk.h - optional on-disk tier of the web object cache
+ *
+ * Objects evicted from memory are appended to one of two segment files,
+ * <path>.0 and <path>.1, each holding up to half of the tier's size.
+ * When the active segment is full, the older one is dropped and started
+ * over, so the tier is bounded and keeps the most recently evicted
+ * objects. Every record carries a checksum; at startup the segments are
+ * mapped, scanned to rebuild the index, and cut at the first bad record,
+ * so a crash in the middle of an append loses only that record.
+ *
+ * Hits pin the segment they are in and send the body with sendfile().
+ * Objects keep the time they stop being fresh; the tier cannot
+ * revalidate, so a stale object is a miss and is fetched again.
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include <sys/types.h>
+#include <time.h>
+#include "chunk.h"
+
+typedef struct disk_segment disk_segment_t;
+
+/* a pinned object on disk, see disk_get */
+typedef struct {
+    disk_segment_t *segment;    /* NULL if none */
+    const char *header;         /* header lines, in the segment's mapping */
+    int header_len;
+    int fd;                     /* segment file */
+    off_t body_offset;          /* where the body starts in fd */
+    int body_len;
+} disk_hit_t;
+
+typedef struct {
+    int objects;
+    long long bytes;            /* in both segments */
+    long long hits;
+    long long stores;
+    long long recycles;         /* segments dropped to make room */
+} disk_stats_t;
+
+int disk_init(const char *path, long max_size);
+void disk_store(const char *host, int port, const char *file,
+                const char *header, int header_len, chunk_list_t *body,
+                time_t expires);
+int disk_get(const char *host, int port, const char *file, disk_hit_t *hit);
+void disk_release(disk_hit_t *hit);
+long disk_send(int fd, const char *host, int port, const char *file,
+               int persistent);
+void disk_stats(disk_stats_t *st);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,321 @@
+/*
+ * dns.c - cache of upstream host addresses, filled by resolver threads
+ *
+ * Entries hash into a fixed table of chains behind one mutex. Entries
+ * that need a lookup, new or expired, are queued for a pool of
+ * DNS_RESOLVERS threads, so one slow name holds up only its own thread;
+ * each finished lookup wakes every waiting worker through one condition
+ * variable and writes to every descriptor registered with dns_notify,
+ * so event loops can retry without blocking. Once the table is full,
+ * each new entry first moves a sweep hand over DNS_SWEEP_BUCKETS
+ * buckets, freeing the expired entries there.
+ */
+#include "csapp.h"
+#include "dns.h"
+
+#define DNS_BUCKET_SUM 256
+#define DNS_SWEEP_BUCKETS 8     /* buckets swept per new entry when full */
+
+/* entry states */
+#define DNS_PENDING 0           /* never resolved, waiting for the resolver */
+#define DNS_FOUND   1
+#define DNS_FAILED  2
+
+typedef struct dns_entry {
+    char *host;
+    int state;
+    struct in_addr addr;        /* if DNS_FOUND */
+    time_t expires;
+    int queued;                 /* on the resolver's queue */
+    int waiters;                /* workers blocked on this entry */
+    struct dns_entry *next;     /* hash chain */
+    struct dns_entry *queue_next;
+} dns_entry_t;
+
+static dns_entry_t *buckets[DNS_BUCKET_SUM];
+static dns_entry_t *queue_head, *queue_tail;
+static int entry_sum;
+static int sweep_hand;          /* next bucket to sweep */
+static dns_stats_t stats;
+static int notify_fds[DNS_MAX_NOTIFY];
+static int notify_sum;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;     /* queue not empty */
+static pthread_cond_t resolved = PTHREAD_COND_INITIALIZER; /* a lookup ended */
+
+/*
+ * bucket_of - return the hash chain of a host name
+ */
+static dns_entry_t **bucket_of(const char *host) {
+    unsigned int h = 2166136261u;
+
+    for (; *host; host++) {
+        h = (h ^ (unsigned char)(*host | 0x20)) * 16777619u;
+    }
+    return &buckets[h % DNS_BUCKET_SUM];
+}
+
+/*
+ * enqueue - hand an entry to the resolver thread; caller holds the mutex
+ */
+static void enqueue(dns_entry_t *e) {
+    if (e->queued) {
+        return;
+    }
+    e->queued = 1;
+    e->queue_next = NULL;
+    if (queue_tail != NULL) {
+        queue_tail->queue_next = e;
+    } else {
+        queue_head = e;
+    }
+    queue_tail = e;
+    pthread_cond_signal(&work);
+}
+
+/*
+ * sweep - free the expired entries nobody is using in the next
+ *         DNS_SWEEP_BUCKETS buckets; caller holds the mutex
+ */
+static void sweep(time_t now) {
+    dns_entry_t **pp, *e;
+    int i;
+
+    for (i = 0; i < DNS_SWEEP_BUCKETS; i++) {
+        pp = &buckets[sweep_hand];
+        sweep_hand = (sweep_hand + 1) % DNS_BUCKET_SUM;
+        while ((e = *pp) != NULL) {
+            if (e->state != DNS_PENDING && !e->queued && e->waiters == 0 &&
+                now >= e->expires) {
+                *pp = e->next;
+                free(e->host);
+                free(e);
+                entry_sum--;
+            } else {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+/*
+ * find_entry - return the entry for host, creating a pending one if there
+ *              is none and setting *created; caller holds the mutex
+ *              return NULL if out of memory
+ */
+static dns_entry_t *find_entry(const char *host, time_t now, int *created) {
+    dns_entry_t **bucket = bucket_of(host), *e;
+
+    *created = 0;
+    for (e = *bucket; e != NULL; e = e->next) {
+        if (strcasecmp(e->host, host) == 0) {
+            return e;
+        }
+    }
+    if (entry_sum >= DNS_MAX_ENTRIES) {
+        sweep(now);
+    }
+    if ((e = calloc(1, sizeof(dns_entry_t))) == NULL) {
+        return NULL;
+    }
+    if ((e->host = strdup(host)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->state = DNS_PENDING;
+    e->next = *bucket;
+    *bucket = e;
+    entry_sum++;
+    enqueue(e);
+    *created = 1;
+    return e;
+}
+
+/*
+ * resolve - look up a host's IPv4 address
+ *           return 0 on success, -1 if it has none
+ */
+static int resolve(const char *host, struct in_addr *addr) {
+    struct addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        return -1;
+    }
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return 0;
+}
+
+/*
+ * resolver_thread - look up queued hosts one at a time, forever; each
+ *                   of the DNS_RESOLVERS threads takes the next one
+ */
+static void *resolver_thread(void *vargp) {
+    struct in_addr addr;
+    dns_entry_t *e;
+    uint64_t one = 1;
+    int rc, i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&mutex);
+        while ((e = queue_head) == NULL) {
+            pthread_cond_wait(&work, &mutex);
+        }
+        if ((queue_head = e->queue_next) == NULL) {
+            queue_tail = NULL;
+        }
+        stats.lookups++;
+        pthread_mutex_unlock(&mutex);
+
+        /* queued entries are never swept, so e->host stays valid */
+        rc = resolve(e->host, &addr);
+
+        pthread_mutex_lock(&mutex);
+        if (rc == 0) {
+            e->state = DNS_FOUND;
+            e->addr = addr;
+            e->expires = time(NULL) + DNS_TTL;
+        } else {
+            e->state = DNS_FAILED;
+            e->expires = time(NULL) + DNS_NEGATIVE_TTL;
+            stats.failures++;
+        }
+        e->queued = 0;
+        pthread_cond_broadcast(&resolved);
+        for (i = 0; i < notify_sum; i++) {
+            if (write(notify_fds[i], &one, sizeof(one)) < 0 &&
+                errno != EAGAIN) {
+                unix_error("dns: notify error");
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+/*
+ * dns_init - start the resolver threads, with every signal blocked so
+ *            signals go to the threads that handle them
+ */
+void dns_init(void) {
+    sigset_t all, old;
+    pthread_t tid;
+    int i;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 0; i < DNS_RESOLVERS; i++) {
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * dns_lookup - find the address of host; if it has never been resolved,
+ *              wait for the resolver when wait is set, for at most
+ *              DNS_WAIT_TIMEOUT seconds
+ *              return 1 if found, 0 if still pending, -1 if it has none
+ */
+int dns_lookup(const char *host, struct in_addr *addr, int wait) {
+    time_t now = time(NULL);
+    struct timespec deadline;
+    dns_entry_t *e;
+    int created, rc;
+
+    pthread_mutex_lock(&mutex);
+    if ((e = find_entry(host, now, &created)) == NULL) {
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    if (e->state != DNS_PENDING && now >= e->expires) {
+        if (e->state == DNS_FAILED) { /* nothing stale to answer with */
+            e->state = DNS_PENDING;
+            created = 1;
+        }
+        enqueue(e);
+    }
+    if (e->state == DNS_PENDING) {
+        if (created) {
+            stats.misses++;
+        }
+        e->waiters++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += DNS_WAIT_TIMEOUT;
+        while (wait && e->state == DNS_PENDING) {
+            if (pthread_cond_timedwait(&resolved, &mutex, &deadline) ==
+                ETIMEDOUT) {
+                break;
+            }
+        }
+        e->waiters--;
+    } else if (e->state == DNS_FOUND) {
+        if (e->queued) {
+            stats.stale_hits++;
+        } else {
+            stats.hits++;
+        }
+    } else {
+        stats.negative_hits++;
+    }
+
+    if (e->state == DNS_FOUND) {
+        *addr = e->addr;
+        rc = 1;
+    } else {
+        rc = (e->state == DNS_PENDING) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&mutex);
+    return rc;
+}
+
+/*
+ * dns_notify - have fd, an eventfd, written to after every lookup;
+ *              call before traffic starts
+ */
+void dns_notify(int fd) {
+    pthread_mutex_lock(&mutex);
+    if (notify_sum < DNS_MAX_NOTIFY) {
+        notify_fds[notify_sum++] = fd;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * dns_open_clientfd - open_clientfd with the address from the cache
+ *                     return -2 if the host has no address, or none was
+ *                     found in DNS_WAIT_TIMEOUT seconds, -1 on other
+ *                     errors
+ */
+int dns_open_clientfd(const char *host, int port) {
+    struct sockaddr_in serveraddr;
+    int clientfd;
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    if (dns_lookup(host, &serveraddr.sin_addr, 1) <= 0) {
+        return -2;
+    }
+    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(port);
+    if (connect(clientfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0) {
+        close(clientfd);
+        return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * dns_stats - copy the counters
+ */
+void dns_stats(dns_stats_t *st) {
+    pthread_mutex_lock(&mutex);
+    *st = stats;
+    st->entries = entry_sum;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,40 @@
+/*
+ * dns.h - cache of upstream host addresses, filled by resolver threads
+ *
+ * Workers never call the resolver themselves. A host seen for the first
+ * time is queued for a small pool of resolver threads, which use
+ * getaddrinfo() and so are safe to run next to the workers. Found
+ * addresses are kept for DNS_TTL seconds and failures for
+ * DNS_NEGATIVE_TTL seconds; an expired address is still returned while
+ * a resolver looks it up again, so only the first request for a host
+ * waits for a lookup, and it waits no longer than DNS_WAIT_TIMEOUT.
+ */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include <netinet/in.h>
+
+#define DNS_TTL 60              /* seconds an address is used */
+#define DNS_NEGATIVE_TTL 5      /* seconds a failed lookup is remembered */
+#define DNS_MAX_ENTRIES 1024    /* expired entries are swept above this */
+#define DNS_MAX_NOTIFY 64
+#define DNS_RESOLVERS 4         /* lookups run at once */
+#define DNS_WAIT_TIMEOUT 5      /* seconds a worker waits for a first lookup */
+
+typedef struct {
+    int entries;
+    long long hits;             /* answered from the cache */
+    long long stale_hits;       /* answered while being refreshed */
+    long long negative_hits;    /* failures answered from the cache */
+    long long misses;           /* nothing cached: a lookup was started */
+    long long lookups;          /* getaddrinfo calls */
+    long long failures;         /* lookups that found nothing */
+} dns_stats_t;
+
+void dns_init(void);
+int dns_lookup(const char *host, struct in_addr *addr, int wait);
+void dns_notify(int fd);
+int dns_open_clientfd(const char *host, int port);
+void dns_stats(dns_stats_t *st);
+
+#endif /* __DNS_H__ */
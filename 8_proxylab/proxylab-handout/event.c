@@ -0,0 +1,1174 @@
+/*
+ * event.c - event-driven proxy mode
+ *
+ * event_run starts one epoll loop per thread. Every loop watches the
+ * shared listening socket and accepts its own connections, so a
+ * connection lives on one loop for its whole life and needs no locks
+ * apart from the cache's.
+ *
+ * A connection moves through these states:
+ *
+ *   READ_REQUEST  - read the client's request, parsing it as it arrives
+ *   SEND_CACHED   - write a pinned cache object to the client, from
+ *                   memory or from the disk tier with sendfile()
+ *   RESOLVE       - wait for a resolver thread to look up the server;
+ *                   it wakes the loop through an eventfd
+ *   CONNECT       - wait for the non-blocking connect to the server
+ *   SEND_REQUEST  - write the forward request to the server
+ *   RELAY         - read the response header, send the client the
+ *                   header the threaded proxy would send a closing
+ *                   client, then copy the body
+ *
+ * A stale cached object stays pinned while the server is asked with its
+ * validators; on a 304 the connection goes to SEND_CACHED with the copy
+ * cache_refresh made, and if the server cannot be reached at all it is
+ * sent whole with a Warning, if cache_stale_ok allows it.
+ *
+ * A range request is answered from a cached object in SEND_CACHED.
+ * On a miss the whole object may be fetched: RELAY then either holds
+ * the body and goes to SEND_CACHED with the ranges cut from it, or
+ * drops the body bytes outside the one range it relays.
+ *
+ * Requests are parsed and forwarded with the same helpers as the
+ * threaded proxy, and responses are captured for the cache under the
+ * same rules, but this mode serves one request per client connection.
+ * Every reply says Connection: close, where the threaded proxy answers
+ * an HTTP/1.1 client with keep-alive, and each request goes to the
+ * server as HTTP/1.0 with Connection: close on a new connection, not
+ * one from upool. So the two modes' replies differ in their Connection
+ * line, and a server may frame a body differently for the HTTP/1.0
+ * request.
+ *
+ * event_drain makes every loop take the connections already queued on
+ * the listening socket and stop watching it; each loop then ends when
+ * its last connection is freed.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include "csapp.h"
+#include "proxy.h"
+#include "http.h"
+#include "cache.h"
+#include "disk.h"
+#include "dns.h"
+#include "metrics.h"
+#include "event.h"
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
+#endif
+
+#define MAX_EVENTS 256
+#define REQUEST_INIT_SIZE 1024
+#define MAX_RESPONSE_HEADER (4 * MAXLINE)
+
+/* connection states */
+#define READ_REQUEST 0
+#define SEND_CACHED  1
+#define RESOLVE      2
+#define CONNECT      3
+#define SEND_REQUEST 4
+#define RELAY        5
+#define CLOSED       6   /* waiting to be freed at the end of the batch */
+
+typedef struct conn conn_t;
+typedef struct loop loop_t;
+
+/* one socket of a connection, as registered with epoll */
+typedef struct {
+    conn_t *conn;
+    int fd;                      /* -1 once closed */
+    unsigned int events;         /* events currently watched */
+    int registered;
+} endpoint_t;
+
+struct conn {
+    int state;
+    loop_t *loop;
+    conn_t *next_dead;
+    conn_t *next_resolving;
+    endpoint_t client;
+    endpoint_t server;
+
+    /* header being read: the request, then the response */
+    char *in;
+    int in_len;
+    int in_size;
+    int scan;                    /* in[0..scan) has no blank line */
+
+    /* request from the client */
+    request_t *request;          /* while it is being read */
+    char *method;
+    char *host;
+    int port;
+    char *file;
+    int cacheable;               /* the request may be answered from cache */
+    range_set_t range;           /* the client's byte ranges */
+    int fill;                    /* the whole object is fetched for them */
+
+    /* response from the server */
+    response_t response;
+    int header_done;
+    int raw;                     /* not HTTP: relay until the server closes */
+    int storable;                /* the response may be cached */
+    int body_done;
+    int plan;                    /* FILL_* */
+    long skip;                   /* body bytes before the relayed range */
+    long slice_left;             /* bytes of the range still to relay */
+
+    /* bytes being written: forward request, then response chunks */
+    char *out;
+    int out_len;
+    int out_pos;
+
+    /* cache */
+    cache_object_t *obj;         /* pinned object on a hit */
+    cache_object_t *stale;       /* pinned object being revalidated */
+    int revalidated;             /* obj was confirmed by a 304 */
+    int stale_ok;                /* stale may be sent if the server fails */
+    int sent_stale;              /* obj is that stale copy */
+    struct iovec iov[CACHE_IOV_MAX]; /* its unwritten parts */
+    struct iovec *iov_next;
+    int iov_sum;
+    struct iovec *range_iov;     /* or a reply cut to the client's ranges */
+    char *range_buf;
+    disk_hit_t disk;             /* pinned object on a disk hit */
+    off_t disk_offset;           /* its unsent body */
+    long disk_left;
+    chunk_list_t capture;        /* body captured for the cache */
+    int object_size;             /* body bytes read so far */
+
+    /* metrics */
+    long long start;             /* when the request was read, 0 if none */
+    long long first_byte;        /* when the client got the first byte */
+    long long sent;              /* bytes written to the client */
+    int outcome;                 /* OUTCOME_* */
+};
+
+/*
+ * One epoll batch can hold events for both sockets of a connection, so
+ * closed connections are only freed once the batch is done.
+ */
+struct loop {
+    int epfd;
+    endpoint_t listen;
+    endpoint_t resolved;         /* eventfd the resolver threads write */
+    endpoint_t drain;            /* eventfd event_drain writes */
+    conn_t *resolving;           /* connections in RESOLVE */
+    conn_t *dead;                /* connections closed in this batch */
+    int open;                    /* connections not yet freed */
+    int draining;                /* no longer accepting */
+};
+
+/* loops still accepting and still running, for event_drain */
+static int drain_fd;
+static int loops_accepting;
+static int loops_running;
+static pthread_mutex_t loops_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t loops_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * set_nonblocking - put a descriptor into non-blocking mode
+ */
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+ * watch - register the events an endpoint waits for
+ */
+static void watch(loop_t *loop, endpoint_t *ep, unsigned int events) {
+    struct epoll_event ev;
+
+    if (ep->fd < 0 || (ep->registered && ep->events == events)) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  ep->fd, &ev) < 0) {
+        error("epoll_ctl", strerror(errno));
+        return;
+    }
+    ep->registered = 1;
+    ep->events = events;
+}
+
+/*
+ * update_events - watch the events the connection's state waits for
+ */
+static void update_events(loop_t *loop, conn_t *c) {
+    switch (c->state) {
+    case READ_REQUEST:
+        watch(loop, &c->client, EPOLLIN);
+        break;
+    case SEND_CACHED:
+        watch(loop, &c->client, EPOLLOUT);
+        break;
+    case RESOLVE:
+        watch(loop, &c->client, 0);
+        break;
+    case CONNECT:
+    case SEND_REQUEST:
+        watch(loop, &c->client, 0);
+        watch(loop, &c->server, EPOLLOUT);
+        break;
+    case RELAY:
+        if (c->out_pos < c->out_len) {
+            watch(loop, &c->client, EPOLLOUT);
+            watch(loop, &c->server, 0);
+        } else {
+            watch(loop, &c->client, 0);
+            watch(loop, &c->server, EPOLLIN);
+        }
+        break;
+    }
+}
+
+/*
+ * close_endpoint - close one socket of a connection
+ */
+static void close_endpoint(endpoint_t *ep, const char *name) {
+    if (ep->fd >= 0 && close(ep->fd) < 0) {
+        error("close", name);
+    }
+    ep->fd = -1;
+    ep->registered = 0;
+}
+
+/*
+ * conn_close - close both sockets and queue the connection to be freed
+ */
+static void conn_close(conn_t *c) {
+    conn_t **pp;
+
+    if (c->state == RESOLVE) {
+        for (pp = &c->loop->resolving; *pp != c; pp = &(*pp)->next_resolving)
+            ;
+        *pp = c->next_resolving;
+    }
+    close_endpoint(&c->client, "cannot close connfd");
+    close_endpoint(&c->server, "cannot close clientfd");
+    if (c->obj != NULL) {
+        cache_put(c->obj);
+        c->obj = NULL;
+    }
+    if (c->stale != NULL) {
+        cache_put(c->stale);
+        c->stale = NULL;
+    }
+    disk_release(&c->disk);
+    if (c->start != 0) {
+        metrics_fetched(metrics_local(), c->header_done ? c->object_size : 0);
+        metrics_request(metrics_local(), c->outcome, c->start, c->first_byte,
+                        c->sent);
+    }
+    c->state = CLOSED;
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
+
+/*
+ * conn_free - release a closed connection
+ */
+static void conn_free(conn_t *c) {
+    c->loop->open--;
+    free(c->in);
+    free(c->request);
+    free(c->method);
+    free(c->host);
+    free(c->file);
+    free(c->out);
+    free(c->range_iov);
+    free(c->range_buf);
+    chunk_list_free(&c->capture);
+    response_free(&c->response);
+    free(c);
+}
+
+/*
+ * write_some - write as much of buf as the socket takes
+ *              return bytes written, or -1 on error other than EAGAIN
+ */
+static int write_some(int fd, const char *buf, int n) {
+    int written = 0, rc;
+
+    while (written < n) {
+        rc = write(fd, buf + written, n - written);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        written += rc;
+    }
+    return written;
+}
+
+/*
+ * capture - keep response bytes for the cache while the object still fits
+ */
+static void capture(conn_t *c, const char *buf, int len) {
+    if (c->storable && c->object_size + len <= MAX_OBJECT_SIZE &&
+        chunk_append(&c->capture, buf, len) < 0) {
+        c->storable = 0;    /* out of memory: just relay */
+    }
+    if (!c->storable || c->object_size + len > MAX_OBJECT_SIZE) {
+        chunk_list_free(&c->capture);
+    }
+    c->object_size += len;
+}
+
+/*
+ * finish_relay - the body is complete: cache the object if possible and close
+ */
+static void finish_relay(conn_t *c) {
+    if (c->client.fd >= 0) {
+        c->outcome = c->cacheable ? OUTCOME_MISS : OUTCOME_PASS;
+    }
+    if (c->storable && c->header_done && !c->raw &&
+        c->object_size <= MAX_OBJECT_SIZE) {
+        cache_insert(c->host, c->port, c->file, &c->response, &c->capture);
+        dbg_printf("web object is cached, size %d\n", c->object_size);
+    }
+    conn_close(c);
+}
+
+/*
+ * client_lost - the client went away; keep fetching only to fill the cache
+ *               return 1 if the connection is still alive
+ */
+static int client_lost(conn_t *c) {
+    close_endpoint(&c->client, "cannot close connfd");
+    if ((c->state == CONNECT || c->state == SEND_REQUEST ||
+         c->state == RELAY) && !c->raw &&
+        (c->header_done ? c->storable : c->cacheable) &&
+        c->object_size <= MAX_OBJECT_SIZE) {
+        if (c->state == RELAY) {
+            c->out_pos = c->out_len = 0;
+        }
+        return 1;
+    }
+    conn_close(c);
+    return 0;
+}
+
+/*
+ * queue_object - send a pinned object next, cut to the client's ranges
+ *                if it asked for some, or whole with a Warning if it is
+ *                sent stale
+ */
+static void queue_object(conn_t *c, cache_object_t *obj) {
+    c->state = SEND_CACHED;
+    c->iov_sum = c->sent_stale ? 0 :
+                 range_iov(&c->range, obj->header, obj->header_len,
+                           &obj->body, 0, &c->range_iov, &c->range_buf);
+    if (c->iov_sum > 0) {
+        c->iov_next = c->range_iov;
+    } else {
+        c->iov_next = c->iov;
+        c->iov_sum = cache_iov(obj, 0, c->sent_stale, c->iov);
+    }
+}
+
+/*
+ * send_held - the body held for a range request is in: send the client
+ *             the ranges cut from it; send_cached caches it afterwards
+ *             return 1 if the connection is still alive
+ */
+static int send_held(conn_t *c) {
+    close_endpoint(&c->server, "cannot close clientfd");
+    c->state = SEND_CACHED;
+    if (!c->storable ||
+        (c->iov_sum = range_iov(&c->range, c->response.header,
+                                c->response.header_len, &c->capture, 0,
+                                &c->range_iov, &c->range_buf)) == 0) {
+        conn_close(c);          /* out of memory */
+        return 0;
+    }
+    c->iov_next = c->range_iov;
+    return 1;
+}
+
+/*
+ * send_stale - answer with the pinned stale object instead of the
+ *              server's response, dropping the server connection
+ *              return 1 if the connection is still alive
+ */
+static int send_stale(conn_t *c) {
+    close_endpoint(&c->server, "cannot close clientfd");
+    if (c->client.fd < 0) {
+        conn_close(c);
+        return 0;
+    }
+    c->obj = c->stale;
+    c->stale = NULL;
+    queue_object(c, c->obj);
+    return 1;
+}
+
+/*
+ * server_failed - the server cannot be reached or did not answer: send
+ *                 the stale object if there is one that may be used
+ *                 stale, else give up
+ *                 return 1 if the connection is still alive
+ */
+static int server_failed(conn_t *c, const char *type, const char *detail) {
+    error(type, detail);
+    if (c->stale != NULL && c->stale_ok) {
+        dbg_printf("stale copy sent!\n");
+        c->sent_stale = 1;
+        return send_stale(c);
+    }
+    conn_close(c);
+    return 0;
+}
+
+/*
+ * open_server - start a non-blocking connect to addr:port
+ *               return the socket, or -1
+ */
+static int open_server(struct in_addr addr, int port) {
+    struct sockaddr_in serveraddr;
+    int fd;
+
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr = addr;
+    serveraddr.sin_port = htons(port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || set_nonblocking(fd) < 0 ||
+        (connect(fd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 &&
+         errno != EINPROGRESS)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * start_connect - start connecting to the server once dns_lookup found
+ *                 its address (found > 0) or did not (found < 0)
+ *                 return 1 if the connection is still alive
+ */
+static int start_connect(conn_t *c, int found, struct in_addr addr) {
+    c->state = CONNECT;
+    if (found > 0) {
+        c->server.fd = open_server(addr, c->port);
+    }
+    if (found < 0 || c->server.fd < 0) {
+        return server_failed(c, "open_clientfd", "cannot connect to host");
+    }
+    return 1;
+}
+
+/*
+ * fill_in - read what fd has into c->in, growing it up to max_size
+ *           return 1 if bytes were read, 0 if none are ready, -1 on EOF or
+ *           error, -2 if the header is too large
+ */
+static int fill_in(conn_t *c, int fd, int max_size) {
+    int n;
+
+    if (c->in_len == c->in_size) {
+        if (c->in_size >= max_size) {
+            error("read_header", "header too large");
+            return -2;
+        }
+        c->in_size *= 2;
+        c->in = Realloc(c->in, c->in_size);
+    }
+    do {
+        n = read(fd, c->in + c->in_len, c->in_size - c->in_len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    c->in_len += n;
+    return 1;
+}
+
+/*
+ * read_header - read from fd into c->in until it holds a blank line
+ *               return the bytes through the blank line, 0 if more are
+ *               needed, -1 on EOF or error, -2 if the header is too large
+ */
+static int read_header(conn_t *c, int fd, int max_size) {
+    char *p, *end;
+    int rc;
+
+    while ((rc = fill_in(c, fd, max_size)) > 0) {
+        /* only look at bytes not yet scanned for the blank line */
+        end = c->in + c->in_len;
+        for (p = c->in + c->scan; p + 1 < end; p++) {
+            if (p[0] == '\n' && p[1] == '\n') {
+                return p + 2 - c->in;
+            }
+            if (p[0] == '\n' && p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+                return p + 3 - c->in;
+            }
+        }
+        c->scan = (c->in_len > 2) ? c->in_len - 2 : 0;
+    }
+    return rc;
+}
+
+/*
+ * reset_in - empty the header buffer for the next header
+ */
+static void reset_in(conn_t *c) {
+    c->in_len = 0;
+    c->scan = 0;
+}
+
+/*
+ * start_request - serve a parsed request from the cache or start
+ *                 connecting to the server
+ *                 return 1 if the connection is still alive
+ */
+static int start_request(conn_t *c, int header_end) {
+    request_t *r = c->request;
+    char method[MAXLINE], uri[MAXLINE];
+    char host[MAXLINE], file[MAXLINE];
+    struct iovec iov[REQUEST_IOV_MAX];
+    struct in_addr addr;
+    int iov_sum, found;
+
+    dbg_printf("----- proxy debug info: client -> proxy -----\n");
+    dbg_printf("%.*s", header_end, c->in);
+    c->start = metrics_now();
+    c->outcome = OUTCOME_ERROR;
+    if (slice_copy(r, r->method, method, MAXLINE) < 0 ||
+        slice_copy(r, r->uri, uri, MAXLINE) < 0) {
+        error("read_request", "request line too long");
+        goto fail;
+    }
+    if (strcmp(uri, METRICS_PATH) == 0) {
+        c->start = 0;           /* not counted */
+        c->out = Malloc(METRICS_RESPONSE_SIZE);
+        c->iov[0].iov_base = c->out;
+        c->iov[0].iov_len = metrics_response(c->out, METRICS_RESPONSE_SIZE, 0);
+        c->iov_next = c->iov;
+        c->iov_sum = 1;
+        c->state = SEND_CACHED;
+        goto done;
+    }
+    c->cacheable = (strcasecmp(method, "GET") == 0 &&
+                    r->content_length == 0 && !r->chunked && !r->no_store);
+    range_parse(&c->range, r);
+    c->fill = c->cacheable && range_start(&c->range) >= 0 &&
+              range_start(&c->range) < MAX_OBJECT_SIZE;
+    dbg_printf("uri: %s\n", uri);
+    if (parse_uri(uri, host, &c->port, file) < 0) {
+        error("parse_uri", "cannot parse URI");
+        goto fail;
+    }
+    dbg_printf("host: %s, port: %d, file: %s\n", host, c->port, file);
+    dbg_printf("---------------------------------------------\n");
+
+    /* send the cached web object without connecting to server if possible */
+    if (c->cacheable && (c->obj = cache_lookup(host, c->port, file,
+                                                 cache_flags(r))) != NULL) {
+        if (!r->no_cache && cache_fresh(c->obj)) {
+            dbg_printf("cache hit!\n");
+            queue_object(c, c->obj);
+            goto done;
+        }
+        if (c->obj->validators != NULL) { /* revalidate it */
+            c->stale = c->obj;
+            c->stale_ok = cache_stale_ok(c->obj, cache_flags(r));
+        } else {
+            cache_put(c->obj);
+        }
+        c->obj = NULL;
+    }
+    if (c->cacheable && !r->no_cache &&
+        disk_get(host, c->port, file, &c->disk)) {
+        dbg_printf("disk cache hit!\n");
+        c->state = SEND_CACHED;
+        c->iov[0].iov_base = (char *)c->disk.header;
+        c->iov[0].iov_len = c->disk.header_len;
+        connection_end(&c->iov[1], 0);
+        c->iov_next = c->iov;
+        c->iov_sum = 2;
+        c->disk_offset = c->disk.body_offset;
+        c->disk_left = c->disk.body_len;
+        goto done;
+    }
+
+    c->method = strdup(method);
+    c->host = strdup(host);
+    c->file = strdup(file);
+    iov_sum = build_request(iov, r, host, file, 0, 0,
+                            c->stale != NULL ? c->stale->validators : NULL,
+                            c->fill);
+    c->out = Malloc(MAX_REQUEST_SIZE + MAXLINE);
+    c->out_len = iov_gather(c->out, iov, iov_sum);
+    c->out_pos = 0;
+    reset_in(c);
+    free(c->request);
+    c->request = NULL;
+
+    /* wait for the resolver rather than block the loop */
+    if ((found = dns_lookup(host, &addr, 0)) == 0) {
+        c->state = RESOLVE;
+        c->next_resolving = c->loop->resolving;
+        c->loop->resolving = c;
+        return 1;
+    }
+    return start_connect(c, found, addr);
+
+done:
+    reset_in(c);
+    free(c->request);
+    c->request = NULL;
+    return 1;
+
+fail:
+    conn_close(c);
+    return 0;
+}
+
+/*
+ * read_request - parse request bytes as they arrive until the header is
+ *                complete
+ *                return 1 if the connection is still alive
+ */
+static int read_request(conn_t *c) {
+    int rc;
+
+    if (c->request == NULL) {
+        c->request = Malloc(sizeof(request_t));
+        request_init(c->request);
+    }
+    while ((rc = request_parse(c->request, c->in, c->in_len)) == 0) {
+        if ((rc = fill_in(c, c->client.fd, MAX_REQUEST_SIZE)) == 0) {
+            return 1;
+        }
+        if (rc < 0) {
+            conn_close(c);
+            return 0;
+        }
+    }
+    if (rc < 0) {
+        error("read_request", "malformed request");
+        conn_close(c);
+        return 0;
+    }
+    return start_request(c, rc);
+}
+
+/*
+ * send_cached - write the pinned cache object to the client, then the
+ *               body of a disk hit
+ *               return 1 if the connection is still alive
+ */
+static int send_cached(conn_t *c) {
+    ssize_t n;
+
+    while (c->iov_sum > 0) {
+        n = writev(c->client.fd, c->iov_next, c->iov_sum);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            conn_close(c);
+            return 0;
+        }
+        if (c->first_byte == 0) {
+            c->first_byte = metrics_now();
+        }
+        c->sent += n;
+        iov_consume(&c->iov_next, &c->iov_sum, n);
+    }
+    while (c->disk_left > 0) {
+        n = sendfile(c->client.fd, c->disk.fd, &c->disk_offset, c->disk_left);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        c->sent += n;
+        c->disk_left -= n;
+    }
+    if (c->disk_left == 0) {
+        c->outcome = c->revalidated ? OUTCOME_REVALIDATED :
+                     c->sent_stale ? OUTCOME_STALE :
+                     c->plan == FILL_HOLD ? OUTCOME_MISS : OUTCOME_HIT;
+    }
+    if (c->plan == FILL_HOLD) {
+        cache_insert(c->host, c->port, c->file, &c->response, &c->capture);
+        dbg_printf("web object is cached, size %d\n", c->object_size);
+    }
+    conn_close(c);
+    return 0;
+}
+
+/*
+ * server_writable - finish the connect, then write the forward request
+ *                   return 1 if the connection is still alive
+ */
+static int server_writable(conn_t *c) {
+    int err = 0, n;
+    socklen_t len = sizeof(err);
+
+    if (c->state == CONNECT) {
+        if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err != 0) {
+            return server_failed(c, "open_clientfd", "cannot connect to host");
+        }
+        c->state = SEND_REQUEST;
+        dbg_printf("----- proxy debug info: proxy -> server -----\n");
+        dbg_printf("%s", c->out);
+        dbg_printf("---------------------------------------------\n");
+    }
+    n = write_some(c->server.fd, c->out + c->out_pos, c->out_len - c->out_pos);
+    if (n < 0) {
+        conn_close(c);
+        return 0;
+    }
+    c->out_pos += n;
+    if (c->out_pos == c->out_len) {
+        c->state = RELAY;
+        c->out_pos = c->out_len = 0;
+        response_init(&c->response);
+    }
+    return 1;
+}
+
+/*
+ * flush_client - write pending response bytes to the client
+ *                return 1 if the connection is still alive
+ */
+static int flush_client(conn_t *c) {
+    int n;
+
+    if (c->client.fd < 0) {
+        n = c->out_len - c->out_pos;  /* nobody to send to: drop it */
+    } else {
+        n = write_some(c->client.fd, c->out + c->out_pos,
+                       c->out_len - c->out_pos);
+        if (n < 0) {
+            return client_lost(c);
+        }
+        if (n > 0 && c->first_byte == 0) {
+            c->first_byte = metrics_now();
+        }
+        c->sent += n;
+    }
+    c->out_pos += n;
+    if (c->out_pos == c->out_len) {
+        c->out_pos = c->out_len = 0;
+        if (c->body_done) {
+            if (c->plan == FILL_HOLD && c->client.fd >= 0) {
+                return send_held(c);
+            }
+            finish_relay(c);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * queue_body - queue body bytes for the client after those in c->out:
+ *              none while the body is held, only those inside the range
+ *              of a slice, whose end ends the body
+ */
+static void queue_body(conn_t *c, const char *buf, int n) {
+    long drop;
+
+    if (c->plan == FILL_HOLD) {
+        return;
+    }
+    if (c->plan == FILL_SLICE) {
+        drop = c->skip < n ? c->skip : n;
+        c->skip -= drop;
+        buf += drop;
+        n -= drop;
+        if (n >= c->slice_left) {
+            n = c->slice_left;
+            c->body_done = 1;
+        }
+        c->slice_left -= n;
+    }
+    memmove(c->out + c->out_len, buf, n);
+    c->out_len += n;
+}
+
+/*
+ * start_response - parse the complete response header and queue the
+ *                  client's header plus any body bytes read with it
+ *                  return 1 if the connection is still alive
+ */
+static int start_response(conn_t *c, int header_end) {
+    byte_range_t ranges[RANGE_MAX];
+    int rc, rest, size, range_sum;
+
+    rc = response_parse(&c->response, c->in, header_end);
+    rest = c->in_len - header_end;
+    if (rc >= 0 && c->stale != NULL && c->response.status == 304) {
+        /* the stale copy is still good: refresh it and send it instead */
+        dbg_printf("cache revalidated!\n");
+        c->stale = cache_refresh(c->stale, &c->response);
+        c->revalidated = 1;
+        c->header_done = 1;
+        return send_stale(c);
+    }
+    if (rc < 0) { /* not HTTP: pass it through until the server closes */
+        c->raw = 1;
+        c->out = Realloc(c->out, c->in_len > MAXLINE ? c->in_len : MAXLINE);
+        memcpy(c->out, c->in, c->in_len);
+        c->out_len = c->in_len;
+    } else {
+        c->storable = c->cacheable && response_storable(&c->response);
+        c->plan = c->fill ? cache_plan_fill(&c->response, &c->range, ranges,
+                                            &range_sum) : FILL_WHOLE;
+        size = c->response.header_len + RANGE_HEADER_EXTRA + rest;
+        c->out = Realloc(c->out, size > MAXLINE ? size : MAXLINE);
+        if (c->plan == FILL_HOLD) {
+            c->out_len = 0;     /* nothing for the client until it is in */
+        } else if (c->plan == FILL_SLICE) {
+            c->storable = 0;
+            c->out_len = range_header(c->out, c->response.header,
+                                      c->response.header_len,
+                                      range_sum == 1 ? &ranges[0] : NULL,
+                                      c->response.content_length, 0);
+            c->skip = range_sum == 1 ? ranges[0].first : 0;
+            c->slice_left = range_sum == 1 ?
+                ranges[0].last - ranges[0].first + 1 : 0;
+        } else {
+            c->out_len = response_header(&c->response, c->out, 0);
+        }
+        if (!response_has_body(&c->response, c->method)) {
+            rest = 0;
+            c->body_done = 1;
+        } else if (c->response.content_length >= 0 &&
+                   rest >= c->response.content_length) {
+            rest = c->response.content_length;
+            c->body_done = 1;
+        }
+        capture(c, c->in + header_end, rest);
+        queue_body(c, c->in + header_end, rest);
+    }
+    c->out_pos = 0;
+    c->header_done = 1;
+    free(c->in);
+    c->in = NULL;
+    return flush_client(c);
+}
+
+/*
+ * server_readable - read the response header, then body chunks, and pass
+ *                   them to the client
+ *                   return 1 if the connection is still alive
+ */
+static int server_readable(conn_t *c) {
+    long left;
+    int n;
+
+    if (!c->header_done) {
+        n = read_header(c, c->server.fd, MAX_RESPONSE_HEADER);
+        /* the server closed inside the header: relay it only if not HTTP */
+        if (n == -1 && c->in_len > 0 &&
+            response_parse(&c->response, c->in, c->in_len) < 0) {
+            n = c->in_len;
+        }
+        if (n == -1 && c->in_len == 0) { /* closed without a word */
+            return server_failed(c, "forward", "no response from server");
+        }
+        if (n < 0) {
+            conn_close(c);
+            return 0;
+        }
+        if (n == 0 || !start_response(c, n)) {
+            return n == 0;
+        }
+        if (c->state != RELAY) { /* answered from the revalidated copy */
+            return 1;
+        }
+    }
+    while (c->out_len == 0 && !c->body_done) {
+        n = read(c->server.fd, c->out, MAXLINE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        }
+        if (n == 0 && (c->raw || c->response.content_length < 0)) {
+            finish_relay(c);
+            return 0;
+        }
+        if (n <= 0) {
+            conn_close(c);  /* error, or the body ended early */
+            return 0;
+        }
+        if (!c->raw && c->response.content_length >= 0) {
+            left = c->response.content_length - c->object_size;
+            if (n >= left) {
+                n = left;
+                c->body_done = 1;
+            }
+        }
+        capture(c, c->out, n);
+        if (c->client.fd < 0 && c->object_size > MAX_OBJECT_SIZE) {
+            conn_close(c);  /* nobody to send to and too big to cache */
+            return 0;
+        }
+        c->out_len = 0;
+        queue_body(c, c->out, n);
+        c->out_pos = 0;
+        if (!flush_client(c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * handle_accept - accept every pending connection on the listening socket
+ */
+static void handle_accept(loop_t *loop) {
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen;
+    conn_t *c;
+    int connfd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(loop->listen.fd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                error("accept", strerror(errno));
+            }
+            return;
+        }
+        if (set_nonblocking(connfd) < 0) {
+            close(connfd);
+            continue;
+        }
+        c = Calloc(1, sizeof(conn_t));
+        c->state = READ_REQUEST;
+        c->loop = loop;
+        c->client.conn = c;
+        c->client.fd = connfd;
+        c->server.conn = c;
+        c->server.fd = -1;
+        c->in_size = REQUEST_INIT_SIZE;
+        c->in = Malloc(c->in_size);
+        loop->open++;
+        update_events(loop, c);
+    }
+}
+
+/*
+ * handle_drain - stop accepting, once the connections already queued on
+ *                the listening socket are taken
+ */
+static void handle_drain(loop_t *loop) {
+    handle_accept(loop);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen.fd, NULL);
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->drain.fd, NULL);
+    loop->draining = 1;
+    pthread_mutex_lock(&loops_mutex);
+    loops_accepting--;
+    pthread_cond_broadcast(&loops_cond);
+    pthread_mutex_unlock(&loops_mutex);
+}
+
+/*
+ * handle_resolved - go on with the connections whose server the resolver
+ *                   has looked up
+ */
+static void handle_resolved(loop_t *loop) {
+    struct in_addr addr;
+    conn_t **pp = &loop->resolving, *c;
+    uint64_t n;
+    int found;
+
+    if (read(loop->resolved.fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        error("read", "cannot read resolver eventfd");
+    }
+    while ((c = *pp) != NULL) {
+        if ((found = dns_lookup(c->host, &addr, 0)) == 0) {
+            pp = &c->next_resolving;
+            continue;
+        }
+        *pp = c->next_resolving;
+        if (start_connect(c, found, addr)) {
+            update_events(loop, c);
+        }
+    }
+}
+
+/*
+ * handle_event - advance a connection on an event from one of its sockets
+ */
+static void handle_event(loop_t *loop, endpoint_t *ep, unsigned int events) {
+    conn_t *c = ep->conn;
+    int alive = 1;
+
+    if (c->state == CLOSED) {
+        return;
+    }
+    if (ep == &c->client) {
+        if (c->state == READ_REQUEST) {
+            alive = read_request(c);
+        } else if (c->state == SEND_CACHED) {
+            alive = send_cached(c);
+        } else if (events & EPOLLOUT) {
+            alive = flush_client(c);
+        } else if (events & (EPOLLERR | EPOLLHUP)) {
+            alive = client_lost(c);
+        }
+    } else {
+        if (c->state == CONNECT || c->state == SEND_REQUEST) {
+            alive = server_writable(c);
+        } else if (c->state == RELAY) {
+            alive = server_readable(c);
+        }
+    }
+    if (alive) {
+        update_events(loop, c);
+    }
+}
+
+/*
+ * event_loop - wait for events on one epoll instance, until it is
+ *              drained and its last connection is gone
+ */
+static void *event_loop(void *vargp) {
+    loop_t *loop = (loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+    conn_t *c;
+    int n, i;
+
+    Pthread_detach(pthread_self());
+    while (!loop->draining || loop->open > 0) {
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR) {
+                error("epoll_wait", strerror(errno));
+            }
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &loop->listen) {
+                handle_accept(loop);
+            } else if (events[i].data.ptr == &loop->resolved) {
+                handle_resolved(loop);
+            } else if (events[i].data.ptr == &loop->drain) {
+                handle_drain(loop);
+            } else {
+                handle_event(loop, events[i].data.ptr, events[i].events);
+            }
+        }
+        while ((c = loop->dead) != NULL) {
+            loop->dead = c->next_dead;
+            conn_free(c);
+        }
+    }
+    pthread_mutex_lock(&loops_mutex);
+    loops_running--;
+    pthread_cond_broadcast(&loops_cond);
+    pthread_mutex_unlock(&loops_mutex);
+    return NULL;
+}
+
+/*
+ * event_run - start loop_sum event loops serving listenfd
+ */
+void event_run(int listenfd, int loop_sum) {
+    struct rlimit rl;
+    loop_t *loops;
+    pthread_t tid;
+    int i;
+
+    /* one descriptor per idle client: raise the soft limit to the hard one */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (set_nonblocking(listenfd) < 0) {
+        unix_error("event_run: fcntl error");
+    }
+
+    if ((drain_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        unix_error("event_run: eventfd error");
+    }
+    loops = Calloc(loop_sum, sizeof(loop_t));
+    for (i = 0; i < loop_sum; i++) {
+        if ((loops[i].epfd = epoll_create1(0)) < 0) {
+            unix_error("event_run: epoll_create1 error");
+        }
+        loops[i].listen.fd = listenfd;
+        watch(&loops[i], &loops[i].listen, EPOLLIN | EPOLLEXCLUSIVE);
+        if ((loops[i].resolved.fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            unix_error("event_run: eventfd error");
+        }
+        watch(&loops[i], &loops[i].resolved, EPOLLIN);
+        dns_notify(loops[i].resolved.fd);
+        /* never read, so every loop sees it */
+        loops[i].drain.fd = drain_fd;
+        watch(&loops[i], &loops[i].drain, EPOLLIN);
+    }
+    loops_accepting = loops_running = loop_sum;
+    for (i = 0; i < loop_sum; i++) {
+        Pthread_create(&tid, NULL, event_loop, &loops[i]);
+    }
+}
+
+/*
+ * event_drain - stop accepting on listenfd, close it, and wait up to
+ *               timeout seconds for the loops to finish their connections
+ *               return the number of loops still busy
+ */
+int event_drain(int listenfd, int timeout) {
+    struct timespec deadline;
+    uint64_t one = 1;
+    int busy;
+
+    if (write(drain_fd, &one, sizeof(one)) < 0) {
+        error("write", "cannot write drain eventfd");
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&loops_mutex);
+    while (loops_accepting > 0) {
+        pthread_cond_wait(&loops_cond, &loops_mutex);
+    }
+    close(listenfd);
+    while (loops_running > 0 &&
+           pthread_cond_timedwait(&loops_cond, &loops_mutex,
+                                  &deadline) == 0)
+        ;
+    busy = loops_running;
+    pthread_mutex_unlock(&loops_mutex);
+    return busy;
+}
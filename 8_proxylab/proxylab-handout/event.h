@@ -0,0 +1,14 @@
+/*
+ * event.h - event-driven proxy mode
+ *
+ * Each event loop owns an epoll instance and serves many connections
+ * from one thread, relaying between client and server sockets with
+ * non-blocking I/O and a per-connection state machine.
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int listenfd, int loop_sum);
+int event_drain(int listenfd, int timeout);
+
+#endif /* __EVENT_H__ */
@@ -0,0 +1,210 @@
+/*
+ * gzip.c - background compression of cached objects
+ *
+ * The queue is a ring of pinned objects under one mutex; the thread
+ * sleeps on a condition variable while it is empty. The body is
+ * deflated chunk by chunk into a new chunk list, in the gzip format, and
+ * the variant's header is the source's with its framing replaced, a
+ * weak ETag (the bytes differ) and Vary: Accept-Encoding added.
+ */
+#include <zlib.h>
+#include "csapp.h"
+#include "gzip.h"
+
+#define SHRINK_MIN 10               /* percent a body must shrink by */
+
+static cache_object_t *queue[GZIP_QUEUE_MAX];
+static int queue_first;
+static int queue_len;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * compressible - test if a Content-Type names text worth compressing
+ */
+static int compressible(const char *type, int len) {
+    static const char *types[] = {
+        "text/", "application/javascript", "application/json",
+        "application/xml", "application/xhtml+xml", "image/svg+xml", NULL
+    };
+    int i, n;
+
+    for (i = 0; types[i] != NULL; i++) {
+        n = strlen(types[i]);
+        if (len >= n && strncasecmp(type, types[i], n) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * deflate_body - compress body into out in the gzip format
+ *                return 0 on success, -1 on error
+ */
+static int deflate_body(chunk_list_t *body, chunk_list_t *out) {
+    unsigned char buf[CHUNK_MAX];
+    z_stream zs;
+    chunk_t *c;
+    int rc = 0, flush;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    for (c = body->head; c != NULL && rc == 0; c = c->next) {
+        zs.next_in = (unsigned char *)c->data;
+        zs.avail_in = c->len;
+        flush = c->next == NULL ? Z_FINISH : Z_NO_FLUSH;
+        do {
+            zs.next_out = buf;
+            zs.avail_out = sizeof(buf);
+            if (deflate(&zs, flush) == Z_STREAM_ERROR ||
+                chunk_append(out, (char *)buf, sizeof(buf) - zs.avail_out) <
+                0) {
+                rc = -1;
+                break;
+            }
+        } while (zs.avail_out == 0);
+    }
+    deflateEnd(&zs);
+    return rc;
+}
+
+/*
+ * emit - append n bytes of s to buf at *len, or with buf NULL only
+ *        count them
+ */
+static void emit(char *buf, int *len, const char *s, int n) {
+    if (buf != NULL) {
+        memcpy(buf + *len, s, n);
+    }
+    *len += n;
+}
+
+/*
+ * variant_header - build the gzip variant's header from the source's
+ *                  into buf, or with buf NULL only measure it
+ *                  return its length
+ */
+static int variant_header(char *buf, const char *header, int header_len,
+                          int length) {
+    const char *p = header, *end = header + header_len, *nl;
+    char tail[128];
+    int len = 0, vary = 0, n;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        nl++;
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            p = nl;
+            continue;
+        }
+        if (strncasecmp(p, "Vary:", 5) == 0) {
+            vary = 1;
+        }
+        if (strncasecmp(p, "ETag:", 5) == 0) {
+            for (p += 5; p < nl && (*p == ' ' || *p == '\t'); p++)
+                ;
+            emit(buf, &len, "ETag: ", 6);
+            if (*p == '"') {
+                emit(buf, &len, "W/", 2);
+            }
+        }
+        emit(buf, &len, p, nl - p);
+        p = nl;
+    }
+    n = snprintf(tail, sizeof(tail), "Content-Encoding: gzip\r\n%s"
+                 "Content-Length: %d\r\n",
+                 vary ? "" : "Vary: Accept-Encoding\r\n", length);
+    emit(buf, &len, tail, n);
+    return len;
+}
+
+/*
+ * compress_object - cache the gzip variant of a pinned identity object
+ *                   return the object's new GZIP_* state
+ */
+static int compress_object(cache_object_t *obj) {
+    chunk_list_t out;
+    const char *type;
+    char *header;
+    int type_len, len, state = GZIP_USELESS;
+
+    if (obj->body.len < GZIP_MIN_SIZE ||
+        (type = header_value(obj->header, obj->header_len, "Content-Type",
+                             &type_len)) == NULL ||
+        !compressible(type, type_len)) {
+        return GZIP_USELESS;
+    }
+    chunk_list_init(&out);
+    if (deflate_body(&obj->body, &out) < 0) {
+        chunk_list_free(&out);
+        return GZIP_UNTRIED;
+    }
+    if (out.len <= obj->body.len / 100 * (100 - SHRINK_MIN) &&
+        (header = malloc(variant_header(NULL, obj->header, obj->header_len,
+                                        out.len))) != NULL) {
+        len = variant_header(header, obj->header, obj->header_len, out.len);
+        /* made again if the variant is evicted */
+        if (cache_add_variant(obj, ENCODING_GZIP, header, len, &out)) {
+            state = GZIP_UNTRIED;
+        }
+        free(header);
+    }
+    chunk_list_free(&out);
+    return state;
+}
+
+/*
+ * gzip_thread - compress queued objects, forever
+ */
+static void *gzip_thread(void *vargp) {
+    cache_object_t *obj;
+    int state;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_len == 0) {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        obj = queue[queue_first];
+        queue_first = (queue_first + 1) % GZIP_QUEUE_MAX;
+        queue_len--;
+        pthread_mutex_unlock(&queue_mutex);
+
+        state = compress_object(obj);
+        __atomic_store_n(&obj->gzip_state, state, __ATOMIC_RELAXED);
+        cache_put(obj);
+    }
+    return NULL;
+}
+
+/*
+ * gzip_init - start the compression thread
+ */
+void gzip_init(void) {
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, gzip_thread, NULL);
+}
+
+/*
+ * gzip_queue - queue a pinned identity object to be compressed; the
+ *              thread releases it when done
+ *              return 1 if queued, 0 if the queue is full
+ */
+int gzip_queue(cache_object_t *obj) {
+    int queued = 0;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_len < GZIP_QUEUE_MAX) {
+        queue[(queue_first + queue_len) % GZIP_QUEUE_MAX] = obj;
+        queue_len++;
+        queued = 1;
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return queued;
+}
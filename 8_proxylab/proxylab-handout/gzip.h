@@ -0,0 +1,27 @@
+/*
+ * gzip.h - background compression of cached objects
+ *
+ * cache_lookup queues an identity object of a text type here when a
+ * client that takes gzip hits it. One thread deflates queued objects
+ * with zlib and caches the result as the object's gzip variant, so the
+ * request that found the identity copy never waits for the compression
+ * and an object is compressed once however many clients ask for it.
+ */
+#ifndef __GZIP_H__
+#define __GZIP_H__
+
+#include "cache.h"
+
+#define GZIP_QUEUE_MAX 64           /* objects waiting; more are not queued */
+#define GZIP_MIN_SIZE 256           /* smaller bodies are sent as they are */
+#define GZIP_LEVEL 6
+
+/* compression state of an identity object */
+#define GZIP_UNTRIED 0              /* may be queued */
+#define GZIP_QUEUED 1
+#define GZIP_USELESS 2              /* not text, too small or does not shrink */
+
+void gzip_init(void);
+int gzip_queue(cache_object_t *obj);
+
+#endif /* __GZIP_H__ */
@@ -0,0 +1,742 @@
+/*
+ * http.c - HTTP helpers shared by the threaded and event proxies
+ *
+ * Connection, Proxy-Connection and Keep-Alive are hop-by-hop headers:
+ * they are dropped from both requests and responses and the proxy
+ * sends its own. Response headers are kept without them so the same
+ * header can go to a persistent or a closing client.
+ *
+ * Freshness headers are parsed as the response header is read, and the
+ * validators are recorded as slices of the kept header, so a stale copy
+ * can be revalidated from the cached header alone.
+ *
+ * The server is only offered gzip when the client takes it, so a client
+ * never gets a coding it did not ask for.
+ */
+#define _GNU_SOURCE             /* strptime, timegm */
+#include "csapp.h"
+#include "http.h"
+
+/* request headers the proxy sends in place of the client's */
+#define FIXED_HEADERS \
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n" \
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+static char fixed_keep_alive[] = FIXED_HEADERS "Connection: keep-alive\r\n";
+static char fixed_close[] = FIXED_HEADERS
+    "Connection: close\r\nProxy-Connection: close\r\n";
+static char version_1_0[] = " HTTP/1.0\r\nHost: ";
+static char version_1_1[] = " HTTP/1.1\r\nHost: ";
+static char accept_gzip[] = "Accept-Encoding: gzip\r\n";
+static char accept_identity[] = "Accept-Encoding: identity\r\n";
+
+/*
+ * parse_uri - parse URI into host:port/file
+ */
+int parse_uri(char *uri, char *host, int *port, char *file) {
+    char *p;
+    char st[MAXLINE];
+    
+    /* initialize */
+    host[0] = '\0';
+    *port = 80;
+    file[0] = '\0';
+    
+    /* skip http:// */
+    strncpy(st, uri, 7);
+    st[7] = '\0';
+    if (strcmp(st, "http://") == 0) {
+        uri += 7;
+    }
+    
+    /* parse */
+    if (sscanf(uri, "%*[^:]:%d", port) != EOF) {
+        sscanf(uri, "%[^:]:%*d%s", host, file);
+        if (file[0] == '\0') { /* host:port */
+            strcpy(file, "/");
+        }
+    } else {
+        p = strchr(uri, '/');
+        if (p == NULL) { /* host */
+            sscanf(uri, "%s", host);
+            strcpy(file, "/");
+        } else { /* host/file */
+            *p = '\0';
+            sscanf(uri, "%s", host);
+            *p = '/';
+            sscanf(p, "%s", file);
+        }
+    }
+    
+    if (host[0] == '\0' || file[0] == '\0') {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * header_is - test if a header line has the given name, ignoring case
+ *             return a pointer to the value, or NULL
+ */
+static const char *header_is(const char *line, const char *name) {
+    int len = strlen(name);
+
+    if (strncasecmp(line, name, len) != 0 || line[len] != ':') {
+        return NULL;
+    }
+    line += len + 1;
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    return line;
+}
+
+/*
+ * has_token - test if a comma-separated header value lists the token
+ */
+static int has_token(const char *value, const char *token) {
+    int len = strlen(token);
+    const char *p = value;
+
+    while (*p != '\0' && *p != '\r' && *p != '\n') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (strncasecmp(p, token, len) == 0 &&
+            (p[len] == ',' || p[len] == ' ' || p[len] == '\t' ||
+             p[len] == '\r' || p[len] == '\n' || p[len] == '\0')) {
+            return 1;
+        }
+        while (*p != '\0' && *p != ',' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * iov_set - point an iovec at len bytes
+ */
+static void iov_set(struct iovec *iov, const void *base, size_t len) {
+    iov->iov_base = (void *)base;
+    iov->iov_len = len;
+}
+
+/*
+ * forwarded - test if a client header line with this id is passed on
+ */
+static int forwarded(int id, int revalidating, int whole) {
+    switch (id) {
+    case HDR_OTHER:
+    case HDR_CONTENT_LENGTH:
+    case HDR_TRANSFER_ENCODING:
+    case HDR_CACHE_CONTROL:
+    case HDR_PRAGMA:
+        return 1;
+    case HDR_IF_NONE_MATCH:
+    case HDR_IF_MODIFIED_SINCE:
+        return !revalidating;
+    case HDR_RANGE:
+    case HDR_IF_RANGE:
+        return !whole;
+    }
+    return 0;
+}
+
+/*
+ * build_request - describe the request forwarded to the server as
+ *                 HTTP/1.minor, asking it to keep the connection open if
+ *                 persistent; the headers the proxy sets itself are
+ *                 replaced and the others point into the client's buffer
+ *                 to revalidate a cached copy, validators holds its
+ *                 conditional header lines and the client's are dropped;
+ *                 with whole the client's Range is dropped so the whole
+ *                 object comes back for the cache to answer it from
+ *                 return the number of iovecs used, at most REQUEST_IOV_MAX
+ */
+int build_request(struct iovec *iov, const request_t *r,
+                  const char *host, const char *file,
+                  int persistent, int minor, const char *validators,
+                  int whole) {
+    const request_header_t *h;
+    struct iovec *last;
+    int n = 0, i;
+
+    iov_set(&iov[n++], SLICE_PTR(r, r->method), r->method.len);
+    iov_set(&iov[n++], " ", 1);
+    iov_set(&iov[n++], file, strlen(file));
+    iov_set(&iov[n++], minor ? version_1_1 : version_1_0,
+            sizeof(version_1_1) - 1);
+    iov_set(&iov[n++], host, strlen(host));
+    iov_set(&iov[n++], "\r\n", 2);
+    if (persistent) {
+        iov_set(&iov[n++], fixed_keep_alive, sizeof(fixed_keep_alive) - 1);
+    } else {
+        iov_set(&iov[n++], fixed_close, sizeof(fixed_close) - 1);
+    }
+    if (r->gzip) {
+        iov_set(&iov[n++], accept_gzip, sizeof(accept_gzip) - 1);
+    } else {
+        iov_set(&iov[n++], accept_identity, sizeof(accept_identity) - 1);
+    }
+
+    /* runs of forwarded lines are adjacent in the buffer: one iovec each */
+    last = NULL;
+    for (i = 0; i < r->header_sum; i++) {
+        h = &r->headers[i];
+        if (!forwarded(h->id, validators != NULL, whole)) {
+            last = NULL;
+        } else if (last != NULL &&
+                   (char *)last->iov_base + last->iov_len ==
+                   SLICE_PTR(r, h->line)) {
+            last->iov_len += h->line.len;
+        } else {
+            last = &iov[n++];
+            iov_set(last, SLICE_PTR(r, h->line), h->line.len);
+        }
+    }
+    if (validators != NULL) {
+        iov_set(&iov[n++], validators, strlen(validators));
+    }
+    iov_set(&iov[n++], "\r\n", 2);
+    return n;
+}
+
+/*
+ * iov_gather - copy the bytes an iovec array describes into buf
+ *              return their length
+ */
+int iov_gather(char *buf, const struct iovec *iov, int iovcnt) {
+    int len = 0, i;
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/*
+ * response_init - prepare to parse a response header
+ */
+void response_init(response_t *r) {
+    memset(r, 0, sizeof(response_t));
+    r->content_length = -1;
+    r->max_age = -1;
+}
+
+/*
+ * response_free - release a parsed response header
+ */
+void response_free(response_t *r) {
+    free(r->header);
+    r->header = NULL;
+}
+
+/*
+ * append_header - append a line to the kept response header
+ */
+static void append_header(response_t *r, const char *line, int len) {
+    if (r->header_len + len > r->header_size) {
+        r->header_size = r->header_size ? r->header_size : 512;
+        while (r->header_size < r->header_len + len) {
+            r->header_size *= 2;
+        }
+        r->header = Realloc(r->header, r->header_size);
+    }
+    memcpy(r->header + r->header_len, line, len);
+    r->header_len += len;
+}
+
+/*
+ * parse_date - parse an HTTP-date in the preferred format
+ *              return the time, or 0 if it is not one
+ */
+static time_t parse_date(const char *value) {
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return 0;
+    }
+    return timegm(&tm);
+}
+
+/*
+ * directive_value - return the number given to a Cache-Control directive
+ *                   such as "max-age=60", or -1 if it is not listed
+ */
+static long directive_value(const char *value, const char *name) {
+    int len = strlen(name);
+    const char *p = value;
+
+    while (*p != '\0' && *p != '\r' && *p != '\n') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (strncasecmp(p, name, len) == 0 && p[len] == '=') {
+            p += len + 1;
+            if (*p == '"') {
+                p++;
+            }
+            return isdigit((unsigned char)*p) ? atol(p) : -1;
+        }
+        while (*p != '\0' && *p != ',' && *p != '\r' && *p != '\n') {
+            p++;
+        }
+    }
+    return -1;
+}
+
+/*
+ * value_slice - record where a header value lands in the kept header,
+ *               without its line end
+ */
+static void value_slice(response_t *r, slice_t *s, const char *line,
+                        const char *value, int len) {
+    s->off = r->header_len + (value - line);
+    s->len = line + len - value;
+    while (s->len > 0 &&
+           (value[s->len - 1] == '\n' || value[s->len - 1] == '\r' ||
+            value[s->len - 1] == ' ')) {
+        s->len--;
+    }
+}
+
+/*
+ * parse_encoding - return the ENCODING_* a Content-Encoding value names
+ */
+static int parse_encoding(const char *value) {
+    int len = strcspn(value, ", \t\r\n");
+    const char *rest = value + len + strspn(value + len, " \t");
+
+    if (*rest != '\0' && *rest != '\r' && *rest != '\n') {
+        return ENCODING_OTHER;  /* more than one coding */
+    }
+    if ((len == 4 && strncasecmp(value, "gzip", 4) == 0) ||
+        (len == 6 && strncasecmp(value, "x-gzip", 6) == 0)) {
+        return ENCODING_GZIP;
+    }
+    if (len == 0 || (len == 8 && strncasecmp(value, "identity", 8) == 0)) {
+        return ENCODING_IDENTITY;
+    }
+    return ENCODING_OTHER;
+}
+
+/*
+ * varies_on_other - test if a Vary value lists anything but
+ *                   Accept-Encoding, which the cache keys variants on
+ */
+static int varies_on_other(const char *value) {
+    const char *p = value;
+    int len;
+
+    while (*p != '\0' && *p != '\r' && *p != '\n') {
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        len = strcspn(p, ", \t\r\n");
+        if (len > 0 &&
+            !(len == 15 && strncasecmp(p, "Accept-Encoding", 15) == 0)) {
+            return 1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+/*
+ * parse_cache_line - act on a kept header line about freshness or about
+ *                    the variant the response is
+ */
+static void parse_cache_line(response_t *r, const char *line, int len) {
+    const char *value;
+    long n;
+
+    switch (line[0] | 0x20) {
+    case 'a':
+        if ((value = header_is(line, "Age")) != NULL) {
+            r->age = atol(value);
+        }
+        break;
+    case 'c':
+        if ((value = header_is(line, "Cache-Control")) != NULL) {
+            if (has_token(value, "no-store") || has_token(value, "private")) {
+                r->no_store = 1;
+            }
+            if (has_token(value, "no-cache")) {
+                r->no_cache = 1;
+            }
+            if (has_token(value, "must-revalidate") ||
+                has_token(value, "proxy-revalidate")) {
+                r->must_revalidate = 1;
+            }
+            if ((n = directive_value(value, "s-maxage")) >= 0 ||
+                (n = directive_value(value, "max-age")) >= 0) {
+                r->max_age = n;
+            }
+        } else if ((value = header_is(line, "Content-Encoding")) != NULL) {
+            r->encoding = parse_encoding(value);
+        }
+        break;
+    case 'd':
+        if ((value = header_is(line, "Date")) != NULL) {
+            r->date = parse_date(value);
+        }
+        break;
+    case 'e':
+        if ((value = header_is(line, "ETag")) != NULL) {
+            value_slice(r, &r->etag, line, value, len);
+        } else if ((value = header_is(line, "Expires")) != NULL &&
+                   (r->expires = parse_date(value)) == 0) {
+            r->expires = 1;
+        }
+        break;
+    case 'l':
+        if ((value = header_is(line, "Last-Modified")) != NULL) {
+            r->last_modified = parse_date(value);
+            value_slice(r, &r->modified, line, value, len);
+        }
+        break;
+    case 'v':
+        if ((value = header_is(line, "Vary")) != NULL &&
+            varies_on_other(value)) {
+            r->vary_other = 1;
+        }
+        break;
+    }
+}
+
+/*
+ * response_add_line - parse one line of a response header; the first line
+ *                     is the status line
+ *                     return 1 for more lines, 0 after the blank line,
+ *                     -1 if the status line is not HTTP
+ */
+int response_add_line(response_t *r, const char *line, int len) {
+    const char *value;
+
+    if (r->status == 0) {
+        if (sscanf(line, "HTTP/1.%d %d", &r->minor, &r->status) != 2 ||
+            r->status <= 0) {
+            r->status = 0;
+            return -1;
+        }
+        r->keep_alive = (r->minor >= 1);
+        append_header(r, line, len);
+        return 1;
+    }
+    if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+        return 0;
+    }
+    if ((value = header_is(line, "Connection")) != NULL ||
+        (value = header_is(line, "Proxy-Connection")) != NULL) {
+        if (has_token(value, "close")) {
+            r->close = 1;
+        }
+        if (has_token(value, "keep-alive")) {
+            r->keep_alive = 1;
+        }
+        return 1;
+    }
+    if (header_is(line, "Keep-Alive") != NULL) {
+        return 1;
+    }
+    if ((value = header_is(line, "Transfer-Encoding")) != NULL &&
+        has_token(value, "chunked")) {
+        r->chunked = 1;
+        return 1;
+    }
+    if ((value = header_is(line, "Content-Length")) != NULL) {
+        r->content_length = atol(value);
+    }
+    parse_cache_line(r, line, len);
+    append_header(r, line, len);
+    return 1;
+}
+
+/*
+ * response_parse - parse a response header held in buf
+ *                  return the bytes through the blank line, 0 if buf holds
+ *                  no complete header yet, -1 if it is not HTTP
+ */
+int response_parse(response_t *r, const char *buf, int len) {
+    char line[MAXLINE];
+    const char *p = buf, *nl;
+    int line_len, rc;
+
+    while ((nl = memchr(p, '\n', buf + len - p)) != NULL) {
+        line_len = nl + 1 - p;
+        if (line_len >= MAXLINE) {
+            return -1;
+        }
+        memcpy(line, p, line_len);
+        line[line_len] = '\0';
+        p = nl + 1;
+        if ((rc = response_add_line(r, line, line_len)) <= 0) {
+            return rc < 0 ? -1 : p - buf;
+        }
+    }
+    return 0;
+}
+
+/*
+ * frames_body - test if a header line describes how a stored body is
+ *               framed or encoded, which a 304 for it may not change
+ */
+static int frames_body(const char *line) {
+    return header_is(line, "Content-Length") != NULL ||
+           header_is(line, "Content-Encoding") != NULL ||
+           header_is(line, "Content-Range") != NULL ||
+           header_is(line, "Transfer-Encoding") != NULL;
+}
+
+/*
+ * stored_line_kept - test if a stored header line survives a 304 that
+ *                    updates the header: not if the 304 sends a line of
+ *                    the same name, or if it is the stored Age
+ */
+static int stored_line_kept(const char *line, const response_t *update) {
+    char name[MAXLINE];
+    const char *colon = strchr(line, ':');
+    int len;
+
+    if (colon == NULL || frames_body(line)) {
+        return 1;
+    }
+    if (header_is(line, "Age") != NULL) {
+        return 0;
+    }
+    len = colon - line;
+    memcpy(name, line, len);
+    name[len] = '\0';
+    return header_value(update->header, update->header_len, name,
+                        &len) == NULL;
+}
+
+/*
+ * response_merge - parse into out, which response_init prepared, a stored
+ *                  header updated by a 304 for it: its status line, the
+ *                  stored lines the 304 does not replace, then the 304's
+ *                  lines, except those that would reframe the stored body
+ *                  return 0, or -1 if a line does not parse
+ */
+int response_merge(response_t *out, const char *stored, int stored_len,
+                   const response_t *update) {
+    char line[MAXLINE];
+    const char *p, *end, *nl;
+    int from_update, first, len, keep;
+
+    for (from_update = 0; from_update < 2; from_update++) {
+        p = from_update ? update->header : stored;
+        end = from_update ? update->header + update->header_len
+                          : stored + stored_len;
+        for (first = 1; p < end && (nl = memchr(p, '\n', end - p)) != NULL;
+             first = 0) {
+            len = nl + 1 - p;
+            if (len >= MAXLINE) {
+                return -1;
+            }
+            memcpy(line, p, len);
+            line[len] = '\0';
+            p = nl + 1;
+            if (from_update) {
+                keep = !first && !frames_body(line);
+            } else {
+                keep = first || stored_line_kept(line, update);
+            }
+            if (keep && response_add_line(out, line, len) < 0) {
+                return -1;
+            }
+        }
+    }
+    return response_add_line(out, "\r\n", 2) == 0 ? 0 : -1;
+}
+
+/*
+ * response_has_body - test if a response to the method carries a body
+ */
+int response_has_body(response_t *r, const char *method) {
+    if (strcasecmp(method, "HEAD") == 0) {
+        return 0;
+    }
+    return !((r->status >= 100 && r->status < 200) ||
+             r->status == 204 || r->status == 304);
+}
+
+/*
+ * response_framed - test if the end of the body is known without EOF
+ */
+int response_framed(response_t *r, const char *method) {
+    return !response_has_body(r, method) || r->chunked ||
+           r->content_length >= 0;
+}
+
+/*
+ * response_reusable - test if the server connection can carry another
+ *                     request after this response
+ */
+int response_reusable(response_t *r, const char *method) {
+    return r->keep_alive && !r->close && response_framed(r, method);
+}
+
+/*
+ * response_storable - test if the response may be stored: a status that
+ *                     is cacheable by default, no no-store or private, and
+ *                     a variant the cache can tell apart
+ */
+int response_storable(response_t *r) {
+    switch (r->status) {
+    case 200: case 203: case 204: case 300: case 301:
+    case 404: case 405: case 410: case 414: case 501:
+        return !r->no_store && r->encoding != ENCODING_OTHER &&
+               !r->vary_other;
+    }
+    return 0;
+}
+
+/*
+ * response_explicit - test if the response says how long it is fresh
+ */
+int response_explicit(response_t *r) {
+    return r->no_cache || r->max_age >= 0 || r->expires != 0;
+}
+
+/*
+ * response_fresh_for - return how many more seconds a response received
+ *                      at now may be used without revalidation; 0 or
+ *                      less if it must be revalidated already
+ */
+long response_fresh_for(response_t *r, time_t now) {
+    time_t date = r->date != 0 ? r->date : now;
+    long lifetime, age;
+
+    if (r->no_cache) {
+        lifetime = 0;
+    } else if (r->max_age >= 0) {
+        lifetime = r->max_age;
+    } else if (r->expires != 0) {
+        lifetime = r->expires - date;
+    } else if (r->last_modified != 0 && r->last_modified < date) {
+        lifetime = (date - r->last_modified) / 10;
+        if (lifetime > FRESHNESS_HEURISTIC_MAX) {
+            lifetime = FRESHNESS_HEURISTIC_MAX;
+        }
+    } else {
+        lifetime = FRESHNESS_DEFAULT;
+    }
+    age = now - date > r->age ? now - date : r->age;
+    return lifetime - (age > 0 ? age : 0);
+}
+
+/*
+ * response_validators - write the conditional header lines that
+ *                       revalidate a stored copy of the response into buf,
+ *                       which needs etag.len + modified.len +
+ *                       VALIDATORS_EXTRA bytes
+ *                       return their length, 0 if it has no validators
+ */
+int response_validators(response_t *r, char *buf) {
+    int len = 0;
+
+    buf[0] = '\0';
+    if (r->etag.len > 0) {
+        len += sprintf(buf + len, "If-None-Match: %.*s\r\n", r->etag.len,
+                       r->header + r->etag.off);
+    }
+    if (r->modified.len > 0) {
+        len += sprintf(buf + len, "If-Modified-Since: %.*s\r\n",
+                       r->modified.len, r->header + r->modified.off);
+    }
+    return len;
+}
+
+/*
+ * response_header - build the header sent to the client: the kept lines,
+ *                   the framing the body arrives in and our own Connection
+ *                   return its length
+ */
+int response_header(response_t *r, char *buf, int persistent) {
+    int len = r->header_len;
+
+    memcpy(buf, r->header, len);
+    if (r->chunked) {
+        len += sprintf(buf + len, "Transfer-Encoding: chunked\r\n");
+    }
+    len += sprintf(buf + len, "Connection: %s\r\n\r\n",
+                   persistent ? "keep-alive" : "close");
+    return len;
+}
+
+/*
+ * connection_end - describe the Connection line and the blank line that
+ *                  end a cached header sent to a client
+ */
+void connection_end(struct iovec *iov, int persistent) {
+    static char keep_alive[] = "Connection: keep-alive\r\n\r\n";
+    static char closing[] = "Connection: close\r\n\r\n";
+
+    iov->iov_base = persistent ? keep_alive : closing;
+    iov->iov_len = persistent ? sizeof(keep_alive) - 1 : sizeof(closing) - 1;
+}
+
+/*
+ * header_value - find a line by name in a block of header lines
+ *                return its value without surrounding blanks, or NULL;
+ *                *len is set to the value's length
+ */
+const char *header_value(const char *header, int header_len,
+                         const char *name, int *len) {
+    const char *p = header, *end = header + header_len, *nl, *v, *e;
+    int name_len = strlen(name);
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (nl - p > name_len && strncasecmp(p, name, name_len) == 0 &&
+            p[name_len] == ':') {
+            for (v = p + name_len + 1; v < nl && (*v == ' ' || *v == '\t');
+                 v++)
+                ;
+            for (e = nl; e > v && (e[-1] == '\r' || e[-1] == ' ' ||
+                                   e[-1] == '\t'); e--)
+                ;
+            *len = e - v;
+            return v;
+        }
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+/*
+ * writev_n - write every byte described by iov, robustly
+ *            return the bytes written, or -1 on error
+ */
+ssize_t writev_n(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t rc, total = 0;
+
+    while (iovcnt > 0) {
+        if ((rc = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += rc;
+        iov_consume(&iov, &iovcnt, rc);
+    }
+    return total;
+}
+
+/*
+ * iov_consume - advance an iovec array past n written bytes
+ */
+void iov_consume(struct iovec **iov, int *iovcnt, size_t n) {
+    while (*iovcnt > 0 && n >= (*iov)->iov_len) {
+        n -= (*iov)->iov_len;
+        (*iov)++;
+        (*iovcnt)--;
+    }
+    if (*iovcnt > 0) {
+        (*iov)->iov_base = (char *)(*iov)->iov_base + n;
+        (*iov)->iov_len -= n;
+    }
+}
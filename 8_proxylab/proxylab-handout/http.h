@@ -0,0 +1,101 @@
+/*
+ * http.h - HTTP helpers shared by the threaded and event proxies
+ *
+ * Responses are parsed for the freshness rules of RFC 7234: how long a
+ * stored response may be used (Cache-Control max-age and s-maxage,
+ * Expires against Date, or a tenth of the time since Last-Modified),
+ * whether it may be stored at all, and the ETag and Last-Modified
+ * validators a stale copy is revalidated with.
+ *
+ * The client's Accept-Encoding is narrowed to gzip or identity before it
+ * is forwarded, and a response's Content-Encoding names the variant it
+ * is cached as; a response that varies on anything else is not stored.
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <sys/uio.h>
+#include <time.h>
+#include "request.h"
+
+/* room response_header needs beyond the kept header lines */
+#define RESPONSE_HEADER_EXTRA 64
+
+/* iovecs build_request may use */
+#define REQUEST_IOV_MAX (REQUEST_MAX_HEADERS + 10)
+
+/* freshness of responses that give none, in seconds */
+#define FRESHNESS_DEFAULT 300       /* no validators either */
+#define FRESHNESS_HEURISTIC_MAX 86400   /* cap of the Last-Modified rule */
+
+/* room response_validators needs beyond the two values */
+#define VALIDATORS_EXTRA 40
+
+/* content codings of a response body */
+#define ENCODING_IDENTITY 0
+#define ENCODING_GZIP 1
+#define ENCODING_OTHER 2        /* anything else: never cached */
+
+/* a parsed response header */
+typedef struct {
+    int minor;              /* HTTP/1.minor */
+    int status;
+    long content_length;    /* -1 if absent */
+    int chunked;
+    int keep_alive;         /* the server offers to reuse the connection */
+    int close;              /* the server will close the connection */
+    char *header;           /* status line and end-to-end header lines */
+    int header_len;
+    int header_size;
+
+    /* freshness */
+    int no_store;           /* no-store or private: never cached */
+    int no_cache;           /* stored, but revalidated before every use */
+    int must_revalidate;    /* must- or proxy-revalidate: never used stale */
+    long max_age;           /* s-maxage, else max-age; -1 if absent */
+    time_t date;            /* 0 if absent */
+    time_t expires;         /* 0 if absent, 1 if invalid (already expired) */
+    time_t last_modified;   /* 0 if absent */
+    long age;               /* Age header */
+    slice_t etag;           /* validator values in header, len 0 if absent */
+    slice_t modified;
+
+    /* variant */
+    int encoding;           /* ENCODING_* of the body */
+    int vary_other;         /* Vary names more than Accept-Encoding */
+} response_t;
+
+/* requests */
+int parse_uri(char *uri, char *host, int *port, char *file);
+int build_request(struct iovec *iov, const request_t *r,
+                  const char *host, const char *file,
+                  int persistent, int minor, const char *validators,
+                  int whole);
+
+/* responses */
+void response_init(response_t *r);
+void response_free(response_t *r);
+int response_add_line(response_t *r, const char *line, int len);
+int response_parse(response_t *r, const char *buf, int len);
+int response_merge(response_t *out, const char *stored, int stored_len,
+                   const response_t *update);
+int response_has_body(response_t *r, const char *method);
+int response_framed(response_t *r, const char *method);
+int response_reusable(response_t *r, const char *method);
+int response_storable(response_t *r);
+int response_explicit(response_t *r);
+long response_fresh_for(response_t *r, time_t now);
+int response_validators(response_t *r, char *buf);
+int response_header(response_t *r, char *buf, int persistent);
+void connection_end(struct iovec *iov, int persistent);
+
+/* header blocks */
+const char *header_value(const char *header, int header_len,
+                         const char *name, int *len);
+
+/* I/O */
+ssize_t writev_n(int fd, struct iovec *iov, int iovcnt);
+void iov_consume(struct iovec **iov, int *iovcnt, size_t n);
+int iov_gather(char *buf, const struct iovec *iov, int iovcnt);
+
+#endif /* __HTTP_H__ */
@@ -0,0 +1,472 @@
+/*
+ * loadgen.c - HTTP load generator for benchmarking the proxy
+ *
+ * usage: loadgen [-p proxy_port] -o origin_port [-c connections] [-t seconds]
+ *                [-w warmup_seconds] [-r rate] [-n objects] [-z zipf_s]
+ *                [-s scan_fraction] [-S min_size:max_size] [-d docroot]
+ *                [-k]
+ *
+ * Each of c threads sends requests for http://localhost:<origin>/bench/oI
+ * through the proxy, or for /bench/oI straight from the origin if no
+ * proxy port is given, to measure the origin itself. Objects are picked
+ * with Zipf popularity (exponent s, 0 for uniform) and have log-uniform
+ * sizes between min and max bytes; with -d the objects are first written
+ * under docroot/bench so an origin such as tiny can serve them. Sizes are
+ * drawn from a fixed seed, so every run sees the same objects.
+ *
+ * With -s a fraction of the requests is a scan instead: the threads
+ * walk through another n objects, oN to o(2n-1), in order, so each is
+ * requested once per pass. This is the pattern that flushes a recency
+ * cache, and shows what an admission policy keeps out.
+ *
+ * Without -r the load is closed-loop: each thread sends its next
+ * request when the last one is answered. With -r the load is open-loop
+ * at that many requests per second in total, with Poisson arrivals, and
+ * latency is measured from when a request was due, so a stalled proxy
+ * is not hidden by the generator slowing down. -k reuses connections.
+ *
+ * After the warmup, requests are timed into a histogram for t seconds.
+ * The cache hit ratio of the run is read from the proxy's
+ * /__proxy/stats before and after, with the objects its admission
+ * policy rejected, when there is a proxy. One JSON object is printed.
+ */
+#include "csapp.h"
+#include "metrics.h"
+
+#define RESPONSE_BUF 65536
+#define SIZE_SEED 12345
+#define IO_TIMEOUT 10           /* seconds before a request counts as lost */
+
+typedef struct {
+    int id;
+    unsigned int seed;
+    int fd;                     /* kept-alive connection, or -1 */
+    long long requests;
+    long long errors;
+    long long bytes;
+    histogram_t hist;
+} loadgen_thread_t;
+
+/* options */
+static int proxy_port, origin_port;
+static int conn_sum = 8;
+static int seconds = 10;
+static int warmup;
+static double rate;             /* requests/s in total, 0 for closed-loop */
+static int object_sum = 1000;
+static double zipf_s = 0.99;
+static double scan_fraction;
+static long min_size = 1024, max_size = 64 * 1024;
+static char *docroot;
+static int keep_alive;
+
+/* proxy counters read around the run */
+#define HITS 0
+#define MISSES 1
+#define REVALIDATED 2
+#define REJECTED 3
+#define COUNTER_SUM 4
+static const char *counter_names[COUNTER_SUM] = {
+    "proxy_requests_total{outcome=\"hit\"}",
+    "proxy_requests_total{outcome=\"miss\"}",
+    "proxy_requests_total{outcome=\"revalidated\"}",
+    "proxy_cache_admissions_total{result=\"rejected\"}"
+};
+
+static double *zipf_cdf;
+static int scan_next;           /* next scan object, shared by the threads */
+static volatile int running = 1;
+static volatile int recording;
+
+/*
+ * usage - print the command line format and exit
+ */
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p proxy_port] -o origin_port "
+            "[-c connections] [-t seconds]\n"
+            "       [-w warmup_seconds] [-r rate] [-n objects] [-z zipf_s]\n"
+            "       [-s scan_fraction] [-S min_size:max_size] [-d docroot] "
+            "[-k]\n", name);
+    exit(1);
+}
+
+/*
+ * object_size - return the size of object i, log-uniform in
+ *               [min_size, max_size] and the same on every run
+ */
+static long object_size(int i) {
+    unsigned int seed = SIZE_SEED + i;
+    double u = (double)rand_r(&seed) / RAND_MAX;
+
+    return (long)(min_size * pow((double)max_size / min_size, u));
+}
+
+/*
+ * make_objects - write the objects, and the scan's, under docroot/bench
+ */
+static void make_objects(void) {
+    char path[MAXLINE], buf[8192];
+    long left, n;
+    int i, fd;
+
+    memset(buf, 'x', sizeof(buf));
+    sprintf(path, "%s/bench", docroot);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        unix_error("mkdir error");
+    }
+    for (i = 0; i < (scan_fraction > 0 ? 2 : 1) * object_sum; i++) {
+        sprintf(path, "%s/bench/o%d", docroot, i);
+        fd = Open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        for (left = object_size(i); left > 0; left -= n) {
+            n = left < (long)sizeof(buf) ? left : (long)sizeof(buf);
+            Rio_writen(fd, buf, n);
+        }
+        Close(fd);
+    }
+}
+
+/*
+ * make_zipf - build the cumulative popularity of the objects
+ */
+static void make_zipf(void) {
+    double sum = 0;
+    int i;
+
+    zipf_cdf = Malloc(object_sum * sizeof(double));
+    for (i = 0; i < object_sum; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < object_sum; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+/*
+ * pick_object - draw an object by popularity, or the scan's next one
+ */
+static int pick_object(unsigned int *seed) {
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    int lo = 0, hi = object_sum - 1, mid;
+
+    if (scan_fraction > 0 && u < scan_fraction) {
+        return object_sum +
+            (int)((unsigned int)__sync_fetch_and_add(&scan_next, 1) %
+                  object_sum);
+    }
+    u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] <= u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * connect_proxy - open a connection to the proxy, or the origin if there
+ *                 is none, with I/O timeouts
+ *                 return the socket, or -1
+ */
+static int connect_proxy(void) {
+    struct timeval timeout;
+    int fd;
+
+    if ((fd = open_clientfd("localhost",
+                            proxy_port ? proxy_port : origin_port)) < 0) {
+        return -1;
+    }
+    timeout.tv_sec = IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/*
+ * fetch - send one request on fd and read the whole response into buf
+ *         return the bytes read, or -1 on error or a non-2xx status;
+ *         *reusable tells if fd can carry another request
+ */
+static long fetch(int fd, const char *request, char *buf, int *reusable) {
+    long total = 0, length = -1, got;
+    char *end = NULL, *p;
+    int n, status;
+
+    *reusable = 0;
+    if (rio_writen(fd, (char *)request, strlen(request)) < 0) {
+        return -1;
+    }
+
+    /* header */
+    while (end == NULL) {
+        if (total == RESPONSE_BUF - 1 ||
+            (n = read(fd, buf + total, RESPONSE_BUF - 1 - total)) <= 0) {
+            return -1;
+        }
+        total += n;
+        buf[total] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+    }
+    if (sscanf(buf, "HTTP/1.%*d %d", &status) != 1 ||
+        status < 200 || status >= 300) {
+        return -1;
+    }
+    *end = '\0';
+    for (p = buf; (p = strchr(p, '\n')) != NULL; ) {
+        p++;
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            length = atol(p + 15);
+        }
+        if (strncasecmp(p, "Connection: keep-alive", 22) == 0) {
+            *reusable = 1;
+        }
+    }
+    got = total - (end + 4 - buf);
+
+    /* body: up to its length, or to EOF */
+    while (length < 0 || got < length) {
+        if ((n = read(fd, buf, RESPONSE_BUF)) < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            if (length >= 0) {
+                return -1;
+            }
+            break;
+        }
+        got += n;
+        total += n;
+    }
+    if (length < 0 || got > length) {
+        *reusable = 0;
+    }
+    return total;
+}
+
+/*
+ * pause_until - sleep until a metrics_now() time
+ */
+static void pause_until(long long when) {
+    struct timespec ts;
+    long long usec = when - metrics_now();
+
+    if (usec > 0) {
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * load_thread - send requests until told to stop
+ */
+static void *load_thread(void *vargp) {
+    loadgen_thread_t *t = vargp;
+    char *buf = Malloc(RESPONSE_BUF), request[MAXLINE], prefix[32];
+    double thread_rate = rate / conn_sum, u;
+    long long due = metrics_now(), done;
+    long n;
+    int reusable;
+
+    /* a proxy needs the absolute form, an origin the path alone */
+    sprintf(prefix, "http://localhost:%d", origin_port);
+    while (running) {
+        if (rate > 0) { /* Poisson arrivals */
+            u = ((double)rand_r(&t->seed) + 1) / ((double)RAND_MAX + 2);
+            due += (long long)(-log(u) / thread_rate * 1e6);
+            pause_until(due);
+        } else {
+            due = metrics_now();
+        }
+        sprintf(request, "GET %s/bench/o%d HTTP/1.%d\r\n"
+                "Host: localhost:%d\r\n%s\r\n", proxy_port ? prefix : "",
+                pick_object(&t->seed), keep_alive, origin_port,
+                keep_alive ? "Connection: keep-alive\r\n" : "");
+
+        n = -1;
+        reusable = 0;
+        if (t->fd < 0) {
+            t->fd = connect_proxy();
+        }
+        if (t->fd >= 0) {
+            n = fetch(t->fd, request, buf, &reusable);
+        }
+        if (t->fd >= 0 && !(keep_alive && reusable && n >= 0)) {
+            close(t->fd);
+            t->fd = -1;
+        }
+
+        done = metrics_now();
+        if (recording && running) {
+            t->requests++;
+            if (n < 0) {
+                t->errors++;
+            } else {
+                t->bytes += n;
+                histogram_add(&t->hist, done - due);
+            }
+        }
+    }
+    if (t->fd >= 0) {
+        close(t->fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * proxy_counters - read the COUNTER_SUM counters the run reports from
+ *                  the proxy's stats
+ *                  return 0 on success, -1 if the proxy has none
+ */
+static int proxy_counters(long long *counters) {
+    static char request[] = "GET " METRICS_PATH " HTTP/1.0\r\n\r\n";
+    char *buf = Malloc(RESPONSE_BUF), *p;
+    int fd, n, len = 0, rc = -1, i;
+
+    if ((fd = connect_proxy()) >= 0 &&
+        rio_writen(fd, request, strlen(request)) > 0) {
+        /* the proxy closes after an HTTP/1.0 answer */
+        while (len < RESPONSE_BUF - 1 &&
+               (n = read(fd, buf + len, RESPONSE_BUF - 1 - len)) > 0) {
+            len += n;
+        }
+        buf[len] = '\0';
+        rc = 0;
+        for (i = 0; i < COUNTER_SUM; i++) {
+            counters[i] = 0;
+            if ((p = strstr(buf, counter_names[i])) == NULL ||
+                sscanf(p + strlen(counter_names[i]), " %lld",
+                       &counters[i]) != 1) {
+                rc = (i == HITS || i == MISSES) ? -1 : rc;
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    loadgen_thread_t *threads;
+    pthread_t *tids;
+    histogram_t total;
+    long long requests = 0, errors = 0, bytes = 0;
+    long long before[COUNTER_SUM], after[COUNTER_SUM], hits, misses;
+    long long revalidated;
+    int stats_ok, opt, i;
+
+    while ((opt = getopt(argc, argv, "p:o:c:t:w:r:n:z:s:S:d:k")) != -1) {
+        switch (opt) {
+        case 'p':
+            proxy_port = atoi(optarg);
+            break;
+        case 'o':
+            origin_port = atoi(optarg);
+            break;
+        case 'c':
+            conn_sum = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'n':
+            object_sum = atoi(optarg);
+            break;
+        case 'z':
+            zipf_s = atof(optarg);
+            break;
+        case 's':
+            scan_fraction = atof(optarg);
+            break;
+        case 'S':
+            if (sscanf(optarg, "%ld:%ld", &min_size, &max_size) != 2) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            docroot = optarg;
+            break;
+        case 'k':
+            keep_alive = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (proxy_port < 0 || origin_port <= 0 || conn_sum <= 0 ||
+        seconds <= 0 || warmup < 0 || rate < 0 || object_sum <= 0 ||
+        zipf_s < 0 || scan_fraction < 0 || scan_fraction >= 1 || min_size <= 0 || max_size < min_size) {
+        usage(argv[0]);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+    if (docroot != NULL) {
+        make_objects();
+    }
+    make_zipf();
+
+    threads = Calloc(conn_sum, sizeof(loadgen_thread_t));
+    tids = Calloc(conn_sum, sizeof(pthread_t));
+    for (i = 0; i < conn_sum; i++) {
+        threads[i].id = i;
+        threads[i].seed = i + 1;
+        threads[i].fd = -1;
+        Pthread_create(&tids[i], NULL, load_thread, &threads[i]);
+    }
+    sleep(warmup);
+    stats_ok = proxy_port && proxy_counters(before) == 0;
+    recording = 1;
+    sleep(seconds);
+    running = 0;
+    stats_ok = stats_ok && proxy_counters(after) == 0;
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < conn_sum; i++) {
+        Pthread_join(tids[i], NULL);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        bytes += threads[i].bytes;
+        histogram_merge(&total, &threads[i].hist);
+    }
+
+    printf("{\"connections\": %d, \"seconds\": %d, \"rate\": %.0f, "
+           "\"keep_alive\": %d, \"objects\": %d, \"zipf\": %.2f, "
+           "\"scan\": %.2f, \"min_size\": %ld, \"max_size\": %ld, ",
+           conn_sum, seconds, rate, keep_alive, object_sum, zipf_s,
+           scan_fraction, min_size, max_size);
+    printf("\"requests\": %lld, \"errors\": %lld, \"rps\": %.1f, "
+           "\"mbytes_per_s\": %.2f, ", requests, errors,
+           (double)requests / seconds, bytes / 1e6 / seconds);
+    printf("\"latency_ms\": {\"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+           "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}, ",
+           total.count ? total.sum / 1e3 / total.count : 0.0,
+           histogram_quantile(&total, 0.5) / 1e3,
+           histogram_quantile(&total, 0.9) / 1e3,
+           histogram_quantile(&total, 0.99) / 1e3,
+           histogram_quantile(&total, 0.999) / 1e3,
+           histogram_quantile(&total, 1.0) / 1e3);
+    hits = after[HITS] - before[HITS];
+    misses = after[MISSES] - before[MISSES];
+    revalidated = after[REVALIDATED] - before[REVALIDATED];
+    if (stats_ok && hits + misses + revalidated > 0) {
+        printf("\"hit_ratio\": %.4f, \"revalidated\": %lld, "
+               "\"admission_rejects\": %lld}\n",
+               (double)hits / (hits + misses + revalidated), revalidated,
+               after[REJECTED] - before[REJECTED]);
+    } else {
+        printf("\"hit_ratio\": null, \"revalidated\": null, "
+               "\"admission_rejects\": null}\n");
+    }
+    return 0;
+}
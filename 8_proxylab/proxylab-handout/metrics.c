@@ -0,0 +1,293 @@
+/*
+ * metrics.c - request counters and latency histograms
+ *
+ * A thread's block is only written by that thread, with relaxed atomic
+ * stores, and read by others with relaxed atomic loads: a reader may
+ * see a request counted in one field and not yet in another, but never
+ * a torn value. Blocks are created on a thread's first request and
+ * live as long as the process, like the threads themselves.
+ */
+#include "csapp.h"
+#include "metrics.h"
+#include "cache.h"
+#include "disk.h"
+#include "dns.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define BUMP(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+#define METRICS_HEADER_ROOM 256
+
+static metrics_t *blocks;
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread metrics_t *local;
+
+static const char *hist_names[HIST_SUM] = {
+    "proxy_ttfb_seconds", "proxy_response_seconds",
+    "proxy_response_seconds", "proxy_response_seconds"
+};
+static const char *hist_labels[HIST_SUM] = {
+    "", "cache=\"all\",", "cache=\"hit\",", "cache=\"miss\","
+};
+static const char *outcome_names[OUTCOME_ERROR + 1] = {
+    "hit", "miss", "pass", "revalidated", "stale", "error"
+};
+
+/*
+ * metrics_now - return a monotonic time in microseconds
+ */
+long long metrics_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * metrics_local - return the calling thread's block, creating it once
+ */
+metrics_t *metrics_local(void) {
+    if (local == NULL) {
+        local = Calloc(1, sizeof(metrics_t));
+        pthread_mutex_lock(&blocks_mutex);
+        local->next = blocks;
+        blocks = local;
+        pthread_mutex_unlock(&blocks_mutex);
+    }
+    return local;
+}
+
+/*
+ * bucket_of - return the histogram bucket of a latency: exact below
+ *             2 * HIST_SUB, then HIST_SUB buckets per power of two
+ */
+static int bucket_of(long long usec) {
+    int shift;
+
+    if (usec < 2 * HIST_SUB) {
+        return usec < 0 ? 0 : usec;
+    }
+    if (usec >= (1LL << HIST_MAX_BITS)) {
+        usec = (1LL << HIST_MAX_BITS) - 1;
+    }
+    shift = 63 - __builtin_clzll(usec) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(usec >> shift) - HIST_SUB;
+}
+
+/*
+ * bucket_high - return the largest latency that falls in a bucket
+ */
+static long long bucket_high(int i) {
+    int shift;
+
+    if (i < 2 * HIST_SUB) {
+        return i;
+    }
+    shift = i / HIST_SUB - 1;
+    return ((long long)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * histogram_add - record one latency; only the owning thread may call it
+ */
+void histogram_add(histogram_t *h, long long usec) {
+    BUMP(h->buckets[bucket_of(usec)], 1);
+    BUMP(h->sum, usec);
+    BUMP(h->count, 1);
+}
+
+/*
+ * histogram_merge - add the counts of h into total
+ */
+void histogram_merge(histogram_t *total, histogram_t *h) {
+    int i;
+
+    total->count += LOAD(h->count);
+    total->sum += LOAD(h->sum);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total->buckets[i] += LOAD(h->buckets[i]);
+    }
+}
+
+/*
+ * histogram_quantile - return the latency below which a fraction q of a
+ *                      histogram falls, in microseconds
+ */
+long long histogram_quantile(const histogram_t *h, double q) {
+    long long target = (long long)(q * h->count + 0.999999), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target && seen > 0) {
+            return bucket_high(i);
+        }
+    }
+    return 0;
+}
+
+/*
+ * metrics_latency - record one latency in a histogram of block m
+ */
+void metrics_latency(metrics_t *m, int hist, long long usec) {
+    histogram_add(&m->hist[hist], usec);
+}
+
+/*
+ * metrics_request - record a request answered with the given outcome,
+ *                   read at start, first answered at first_byte (0 if
+ *                   the answer was written at once) and sent bytes long
+ */
+void metrics_request(metrics_t *m, int outcome, long long start,
+                     long long first_byte, long long sent) {
+    long long total = metrics_now() - start;
+
+    BUMP(m->requests, 1);
+    BUMP(m->outcomes[outcome], 1);
+    BUMP(m->sent_bytes, sent);
+    if (outcome == OUTCOME_ERROR) {
+        return;
+    }
+    metrics_latency(m, HIST_TTFB, first_byte ? first_byte - start : total);
+    metrics_latency(m, HIST_TOTAL, total);
+    if (outcome == OUTCOME_HIT) {
+        metrics_latency(m, HIST_HIT, total);
+    } else if (outcome == OUTCOME_MISS) {
+        metrics_latency(m, HIST_MISS, total);
+    }
+}
+
+/*
+ * metrics_fetched - count response body bytes read from a server
+ */
+void metrics_fetched(metrics_t *m, long long bytes) {
+    BUMP(m->fetched_bytes, bytes);
+}
+
+/*
+ * sum_blocks - add every thread's block into total
+ */
+static void sum_blocks(metrics_t *total) {
+    metrics_t *m;
+    int i, j;
+
+    memset(total, 0, sizeof(metrics_t));
+    pthread_mutex_lock(&blocks_mutex);
+    for (m = blocks; m != NULL; m = m->next) {
+        total->requests += LOAD(m->requests);
+        for (i = 0; i <= OUTCOME_ERROR; i++) {
+            total->outcomes[i] += LOAD(m->outcomes[i]);
+        }
+        total->sent_bytes += LOAD(m->sent_bytes);
+        total->fetched_bytes += LOAD(m->fetched_bytes);
+        for (j = 0; j < HIST_SUM; j++) {
+            histogram_merge(&total->hist[j], &m->hist[j]);
+        }
+    }
+    pthread_mutex_unlock(&blocks_mutex);
+}
+
+/*
+ * render - write the metrics in the Prometheus text format
+ *          return their length, at most size - 1
+ */
+static int render(char *buf, int size) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    metrics_t *total = Malloc(sizeof(metrics_t));
+    cache_stats_t cs;
+    disk_stats_t ds;
+    dns_stats_t ns;
+    long long lookups;
+    int len = 0, i, j;
+
+#define OUT(...) \
+    do { \
+        if (len < size) { \
+            len += snprintf(buf + len, size - len, __VA_ARGS__); \
+        } \
+    } while (0)
+
+    sum_blocks(total);
+    OUT("# TYPE proxy_requests_total counter\n");
+    for (i = 0; i <= OUTCOME_ERROR; i++) {
+        OUT("proxy_requests_total{outcome=\"%s\"} %lld\n", outcome_names[i],
+            total->outcomes[i]);
+    }
+    lookups = total->outcomes[OUTCOME_HIT] + total->outcomes[OUTCOME_MISS] +
+        total->outcomes[OUTCOME_REVALIDATED];
+    OUT("# TYPE proxy_cache_hit_ratio gauge\n");
+    OUT("proxy_cache_hit_ratio %.4f\n",
+        lookups ? (double)total->outcomes[OUTCOME_HIT] / lookups : 0.0);
+    OUT("# TYPE proxy_sent_bytes_total counter\n");
+    OUT("proxy_sent_bytes_total %lld\n", total->sent_bytes);
+    OUT("# TYPE proxy_fetched_bytes_total counter\n");
+    OUT("proxy_fetched_bytes_total %lld\n", total->fetched_bytes);
+
+    for (j = 0; j < HIST_SUM; j++) {
+        if (j <= HIST_TOTAL) {
+            OUT("# TYPE %s summary\n", hist_names[j]);
+        }
+        for (i = 0; i < 4; i++) {
+            OUT("%s{%squantile=\"%g\"} %.6f\n", hist_names[j], hist_labels[j],
+                quantiles[i],
+                histogram_quantile(&total->hist[j], quantiles[i]) / 1e6);
+        }
+        if (hist_labels[j][0] == '\0') {
+            OUT("%s_sum %.6f\n%s_count %lld\n", hist_names[j],
+                total->hist[j].sum / 1e6, hist_names[j],
+                total->hist[j].count);
+        } else {
+            OUT("%s_sum{%.*s} %.6f\n%s_count{%.*s} %lld\n", hist_names[j],
+                (int)strlen(hist_labels[j]) - 1, hist_labels[j],
+                total->hist[j].sum / 1e6, hist_names[j],
+                (int)strlen(hist_labels[j]) - 1, hist_labels[j],
+                total->hist[j].count);
+        }
+    }
+
+    cache_stats(&cs);
+    OUT("# TYPE proxy_cache_objects gauge\n");
+    OUT("proxy_cache_objects %d\n", cs.objects);
+    OUT("# TYPE proxy_cache_bytes gauge\n");
+    OUT("proxy_cache_bytes %d\n", cs.bytes);
+    OUT("# TYPE proxy_cache_admissions_total counter\n");
+    OUT("proxy_cache_admissions_total{result=\"admitted\"} %lld\n",
+        cs.admitted);
+    OUT("proxy_cache_admissions_total{result=\"rejected\"} %lld\n",
+        cs.rejected);
+    OUT("# TYPE proxy_cache_evictions_total counter\n");
+    OUT("proxy_cache_evictions_total %lld\n", cs.evicted);
+    OUT("# TYPE proxy_cache_compressions_total counter\n");
+    OUT("proxy_cache_compressions_total %lld\n", cs.compressed);
+    disk_stats(&ds);
+    OUT("# TYPE proxy_disk_hits_total counter\n");
+    OUT("proxy_disk_hits_total %lld\n", ds.hits);
+    OUT("# TYPE proxy_disk_objects gauge\n");
+    OUT("proxy_disk_objects %d\n", ds.objects);
+    dns_stats(&ns);
+    OUT("# TYPE proxy_dns_lookups_total counter\n");
+    OUT("proxy_dns_lookups_total %lld\n", ns.lookups);
+    OUT("# TYPE proxy_dns_failures_total counter\n");
+    OUT("proxy_dns_failures_total %lld\n", ns.failures);
+#undef OUT
+
+    free(total);
+    return len < size ? len : size - 1;
+}
+
+/*
+ * metrics_response - build the whole HTTP response for METRICS_PATH
+ *                    return its length
+ */
+int metrics_response(char *buf, int size, int persistent) {
+    char *body = Malloc(size);
+    int body_len = render(body, size - METRICS_HEADER_ROOM), len;
+
+    len = sprintf(buf, "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: %d\r\n"
+                  "Connection: %s\r\n\r\n", body_len,
+                  persistent ? "keep-alive" : "close");
+    memcpy(buf + len, body, body_len);
+    free(body);
+    return len + body_len;
+}
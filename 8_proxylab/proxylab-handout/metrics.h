@@ -0,0 +1,65 @@
+/*
+ * metrics.h - request counters and latency histograms
+ *
+ * Every worker thread or event loop records into its own block of
+ * counters, so recording takes no lock and shares no cache line; a
+ * reader sums the blocks. Latencies go into log-linear histograms in
+ * the style of HdrHistogram: 16 buckets per power of two of
+ * microseconds, so quantiles are within about 6%.
+ *
+ * GET /__proxy/stats returns everything in the Prometheus text format.
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#define METRICS_PATH "/__proxy/stats"
+#define METRICS_RESPONSE_SIZE 8192
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        /* about 12 days in microseconds */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* histograms */
+#define HIST_TTFB 0             /* request read to first response byte */
+#define HIST_TOTAL 1            /* request read to response written */
+#define HIST_HIT 2              /* HIST_TOTAL of cache hits */
+#define HIST_MISS 3             /* HIST_TOTAL of cache misses */
+#define HIST_SUM 4
+
+/* how a request was answered */
+#define OUTCOME_HIT 0           /* from memory or disk */
+#define OUTCOME_MISS 1          /* cacheable, fetched from the server */
+#define OUTCOME_PASS 2          /* not cacheable, relayed */
+#define OUTCOME_REVALIDATED 3   /* stale, confirmed by a 304 and sent */
+#define OUTCOME_STALE 4         /* stale, sent as the server was unreachable */
+#define OUTCOME_ERROR 5         /* nothing useful reached the client */
+
+typedef struct {
+    long long count;
+    long long sum;              /* microseconds */
+    long long buckets[HIST_BUCKETS];
+} histogram_t;
+
+typedef struct metrics {
+    long long requests;
+    long long outcomes[OUTCOME_ERROR + 1];
+    long long sent_bytes;       /* to clients */
+    long long fetched_bytes;    /* response bodies from servers */
+    histogram_t hist[HIST_SUM];
+    struct metrics *next;       /* all blocks, for readers */
+} metrics_t;
+
+void histogram_add(histogram_t *h, long long usec);
+void histogram_merge(histogram_t *total, histogram_t *h);
+long long histogram_quantile(const histogram_t *h, double q);
+
+long long metrics_now(void);
+metrics_t *metrics_local(void);
+void metrics_latency(metrics_t *m, int hist, long long usec);
+void metrics_request(metrics_t *m, int outcome, long long start,
+                     long long first_byte, long long sent);
+void metrics_fetched(metrics_t *m, long long bytes);
+int metrics_response(char *buf, int size, int persistent);
+
+#endif /* __METRICS_H__ */
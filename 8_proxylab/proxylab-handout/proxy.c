@@ -1,36 +1,47 @@
+#define _GNU_SOURCE         /* splice */
 #include <stdio.h>
-#include <limits.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "csapp.h"
+#include "proxy.h"
+#include "http.h"
+#include "cache.h"
+#include "disk.h"
+#include "dns.h"
+#include "metrics.h"
+#include "sbuf.h"
+#include "upool.h"
+#include "event.h"
+#include "config.h"
 
-#define MAX_CACHE_SIZE (1024*1024)
-#define MAX_OBJECT_SIZE (100*1024)
-#define MAX_OBJECT_SUM 10
+#define SPLICE_CHUNK (64*1024)  /* bytes moved through the pipe at a time */
 
-#define MAX_HEADER_SUM 42
+/* connected descriptors waiting for a worker */
+static sbuf_t sbuf;
 
-#define DEBUG
-#ifdef DEBUG
-# define dbg_printf(...) printf(__VA_ARGS__)
-#else
-# define dbg_printf(...)
-#endif
+/* settings: the command line's, the ones read with the config file, and
+   the ones in force; once the signal thread runs, only it touches them,
+   except that main reads the drain settings of config under config_mutex */
+static config_t base_config;
+static config_t loaded_config;
+static config_t config;
+static pthread_mutex_t config_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *config_path;
+static long cores;
+static int worker_sum;
 
-/* request headers */
-static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
-static const char *accept_type = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8";
-static const char *accept_encoding = "Accept-Encoding: gzip, deflate";
+/* read by the workers */
+static int client_timeout = CLIENT_IDLE_TIMEOUT;
+static int draining;            /* SIGTERM arrived: finish and exit */
+static int drain_pipe[2];       /* wakes main for the drain */
 
-/* cache */
-char cache[MAX_OBJECT_SUM][MAX_OBJECT_SIZE];
-char cache_host[MAX_OBJECT_SUM][MAXLINE];
-int cache_port[MAX_OBJECT_SUM];
-char cache_file[MAX_OBJECT_SUM][MAXLINE];
-int cache_object_size[MAX_OBJECT_SUM];
-int timestamp[MAX_OBJECT_SUM];
-volatile int timer;
+/* body bytes relayed through user space and with splice() */
+static long long buffered_bytes;
+static long long spliced_bytes;
 
-/* synchronization */
-sem_t mutex;
+/* each worker's pipe for splice(), created on first use */
+static __thread int relay_pipe[2] = {-1, -1};
 
 /*
  * error - print error information
@@ -44,234 +55,850 @@ void error(const char *type, const char *detail) {
 }
 
 /*
- * parse_uri - parse URI into host:port/file
+ * relay_t - one response on its way from server to client
  */
-int parse_uri(char *uri, char *host, int *port, char *file) {
-    char *p;
-    char st[MAXLINE];
-    
-    /* initialize */
-    host[0] = '\0';
-    *port = 80;
-    file[0] = '\0';
-    
-    /* skip http:// */
-    strncpy(st, uri, 7);
-    st[7] = '\0';
-    if (strcmp(st, "http://") == 0) {
-        uri += 7;
+typedef struct {
+    int connfd;
+    int client_ok;      /* the client still takes writes */
+    int capturing;      /* the body may still fit in the cache */
+    int holding;        /* the client gets ranges of the body once read */
+    chunk_list_t body;  /* body captured for the cache */
+    int splice_ok;      /* splice() works on these descriptors */
+    long long buffered; /* body bytes copied through user space */
+    long long spliced;  /* body bytes moved with splice() */
+} relay_t;
+
+/*
+ * relay_write - pass bytes to the client; after a failed write keep
+ *               reading the response so it can still be cached
+ */
+static void relay_write(relay_t *rl, char *buf, int len) {
+    if (rl->client_ok && !rl->holding &&
+        rio_writen(rl->connfd, buf, len) != len) {
+        rl->client_ok = 0;
+    }
+}
+
+/*
+ * relay_capture - keep body bytes for the cache while the object fits
+ */
+static void relay_capture(relay_t *rl, const char *buf, int len) {
+    if (!rl->capturing) {
+        return;
+    }
+    if (rl->body.len + len > MAX_OBJECT_SIZE ||
+        chunk_append(&rl->body, buf, len) < 0) {
+        rl->capturing = 0;
+        chunk_list_free(&rl->body);
     }
-    
-    /* parse */
-    if (sscanf(uri, "%*[^:]:%d", port) != EOF) {
-        sscanf(uri, "%[^:]:%*d%s", host, file);
-        if (file[0] == '\0') { /* host:port */
-            strcpy(file, "/");
+}
+
+/*
+ * close_relay_pipe - drop a pipe that may still hold bytes
+ */
+static void close_relay_pipe(void) {
+    close(relay_pipe[0]);
+    close(relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/*
+ * relay_splice - relay *n body bytes, or up to EOF if *n < 0, moving them
+ *                socket -> pipe -> socket with splice() so they are never
+ *                copied to user space; only for bodies not being captured
+ *                *n counts down as bytes go out
+ *                return 0 on success, -1 on error, 1 if splice() cannot be
+ *                used on these descriptors
+ */
+static int relay_splice(rio_t *rp, relay_t *rl, long *n) {
+    ssize_t in, out;
+    int len, more;
+
+    /* bytes rio already read past the header go out first */
+    if (rp->rio_cnt > 0 && *n != 0) {
+        len = (*n >= 0 && *n < rp->rio_cnt) ? *n : rp->rio_cnt;
+        relay_write(rl, rp->rio_bufptr, len);
+        rl->buffered += len;
+        rp->rio_bufptr += len;
+        rp->rio_cnt -= len;
+        if (*n > 0) {
+            *n -= len;
         }
-    } else {
-        p = strchr(uri, '/');
-        if (p == NULL) { /* host */
-            sscanf(uri, "%s", host);
-            strcpy(file, "/");
-        } else { /* host/file */
-            *p = '\0';
-            sscanf(uri, "%s", host);
-            *p = '/';
-            sscanf(p, "%s", file);
-        }
-    }
-    
-    if (host[0] == '\0' || file[0] == '\0') {
+    }
+    if (relay_pipe[0] < 0 && pipe(relay_pipe) < 0) {
+        relay_pipe[0] = relay_pipe[1] = -1;
+        rl->splice_ok = 0;
+        return 1;
+    }
+
+    while (*n != 0) {
+        in = splice(rp->rio_fd, NULL, relay_pipe[1], NULL,
+                    (*n < 0 || *n > SPLICE_CHUNK) ? SPLICE_CHUNK : *n,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL) {
+                rl->splice_ok = 0;
+                return 1;
+            }
+            return -1;
+        }
+        if (in == 0) {  /* EOF */
+            return *n < 0 ? 0 : -1;
+        }
+        if (*n > 0) {
+            *n -= in;
+        }
+        /* cork only while more of the body is known to follow, so the
+           tail is not held back from a kept-alive client */
+        more = *n > 0 ? SPLICE_F_MORE : 0;
+        while (in > 0) {
+            out = splice(relay_pipe[0], NULL, rl->connfd, NULL, in,
+                         SPLICE_F_MOVE | more);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                rl->client_ok = 0;
+                close_relay_pipe();
+                return -1;
+            }
+            in -= out;
+            rl->spliced += out;
+        }
+    }
+    return 0;
+}
+
+/*
+ * relay_length - relay n body bytes
+ *                return 0 on success, -1 if the server stopped early
+ */
+static int relay_length(rio_t *rp, relay_t *rl, long n) {
+    char buf[MAXLINE];
+    int len;
+
+    while (n > 0) {
+        if (!rl->capturing && !rl->holding && rl->client_ok &&
+            rl->splice_ok) {
+            if ((len = relay_splice(rp, rl, &n)) <= 0) {
+                return len;
+            }
+            continue;   /* splice() refused, n may already be 0 */
+        }
+        len = rio_readnb(rp, buf, n < MAXLINE ? n : MAXLINE);
+        if (len <= 0) {
+            return -1;
+        }
+        relay_capture(rl, buf, len);
+        relay_write(rl, buf, len);
+        rl->buffered += len;
+        n -= len;
+    }
+    return 0;
+}
+
+/*
+ * relay_skip - read and drop n body bytes the client did not ask for
+ *              return 0 on success, -1 if the server stopped early
+ */
+static int relay_skip(rio_t *rp, long n) {
+    char buf[MAXLINE];
+    int len;
+
+    while (n > 0) {
+        if ((len = rio_readnb(rp, buf, n < MAXLINE ? n : MAXLINE)) <= 0) {
+            return -1;
+        }
+        n -= len;
+    }
+    return 0;
+}
+
+/*
+ * relay_held - read a body small enough to cache whole, then send the
+ *              client the ranges it asked for, cut from it
+ *              *sent is set to the bytes written
+ *              return 0 on success, -1 if the server stopped early
+ */
+static int relay_held(rio_t *rp, relay_t *rl, response_t *r,
+                      const range_set_t *rs, int persistent, long *sent) {
+    struct iovec *iov;
+    char *buf;
+    long n = -1;
+    int iov_sum;
+
+    rl->capturing = 1;
+    rl->holding = 1;
+    if (relay_length(rp, rl, r->content_length) < 0 || !rl->capturing) {
+        return -1;
+    }
+    iov_sum = range_iov(rs, r->header, r->header_len, &rl->body, persistent,
+                        &iov, &buf);
+    if (iov_sum > 0) {
+        n = writev_n(rl->connfd, iov, iov_sum);
+        free(iov);
+        free(buf);
+    }
+    if (n < 0) {
+        rl->client_ok = 0;
+        n = 0;
+    }
+    *sent = n;
+    return 0;
+}
+
+/*
+ * relay_range - send the client one range of a body too big to cache, or
+ *               only a 416 header if range is NULL, leaving the rest of
+ *               the body unread
+ *               *sent is set to the header bytes written
+ *               return 0 on success, -1 if the server stopped early
+ */
+static int relay_range(rio_t *rp, relay_t *rl, response_t *r,
+                       const byte_range_t *range, int persistent,
+                       long *sent) {
+    char *head = Malloc(r->header_len + RANGE_HEADER_EXTRA);
+    int len;
+
+    len = range_header(head, r->header, r->header_len, range,
+                       r->content_length, persistent);
+    relay_write(rl, head, len);
+    free(head);
+    *sent = len;
+    if (range == NULL) {
+        return 0;
+    }
+    if (relay_skip(rp, range->first) < 0) {
         return -1;
     }
-    return 1;
+    return relay_length(rp, rl, range->last - range->first + 1);
 }
 
 /*
- * header_exist - test if the header is existed
+ * relay_chunked - relay a chunked body as is, capturing the decoded data
+ *                 return 0 on success, -1 on a broken body
  */
-int header_exist(const char *header) {
-    char st[MAXLINE];
-    sscanf(header, "%s", st);
-    if (strcmp(st, "Host:") == 0 ||
-        strcmp(st, "User-Agent:") == 0 ||
-        strcmp(st, "Accept:") == 0 ||
-        strcmp(st, "Accept-Encoding:") == 0 ||
-        strcmp(st, "Connection:") == 0 ||
-        strcmp(st, "Proxy-Connection:") == 0)
+static int relay_chunked(rio_t *rp, relay_t *rl) {
+    char line[MAXLINE];
+    long size;
+    int len;
+
+    while (1) {
+        if ((len = rio_readlineb(rp, line, MAXLINE)) <= 0) {
+            return -1;
+        }
+        relay_write(rl, line, len);
+        size = strtol(line, NULL, 16);
+        if (size < 0) {
+            return -1;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (relay_length(rp, rl, size) < 0) {
+            return -1;
+        }
+        if ((len = rio_readlineb(rp, line, MAXLINE)) <= 0) { /* CRLF */
+            return -1;
+        }
+        relay_write(rl, line, len);
+    }
+    /* trailer */
+    do {
+        if ((len = rio_readlineb(rp, line, MAXLINE)) <= 0) {
+            return -1;
+        }
+        relay_write(rl, line, len);
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    return 0;
+}
+
+/*
+ * relay_eof - relay a body that ends when the server closes
+ *             return 0 on success, -1 on a read error
+ */
+static int relay_eof(rio_t *rp, relay_t *rl) {
+    char buf[MAXLINE];
+    long n = -1;
+    int len;
+
+    while (1) {
+        if (!rl->capturing && rl->client_ok && rl->splice_ok) {
+            if ((len = relay_splice(rp, rl, &n)) <= 0) {
+                return len;
+            }
+        }
+        if ((len = rio_readnb(rp, buf, MAXLINE)) <= 0) {
+            return len;
+        }
+        relay_capture(rl, buf, len);
+        relay_write(rl, buf, len);
+        rl->buffered += len;
+    }
+}
+
+/*
+ * client_t - a client connection and the request bytes read from it
+ */
+typedef struct client {
+    int fd;
+    int len;                        /* bytes in buf */
+    int used;                       /* bytes of buf the current request took */
+    int kept;                       /* a request was served: keep-alive */
+    int idle;                       /* waiting for the next request */
+    long long idle_seq;             /* idle_clock when it went idle */
+    int shut;                       /* closed to free its worker */
+    struct client *prev;            /* on the list of open clients */
+    struct client *next;
+    char buf[MAX_REQUEST_SIZE];
+} client_t;
+
+/* clients accepted and not yet closed, for the drain */
+static client_t *clients;
+static int open_sum;            /* also counts those still queued */
+static int held_sum;            /* on the list, each held by a worker */
+static int shut_sum;            /* of those, shut by reclaim_idle */
+static long long idle_clock;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * reclaim_idle - while queued connections outnumber the free workers,
+ *                shut the client that has idled longest, so its worker
+ *                takes one of them; caller holds clients_mutex
+ */
+static void reclaim_idle(void) {
+    client_t *cl, *oldest;
+    int free_sum;
+
+    free_sum = __atomic_load_n(&worker_sum, __ATOMIC_RELAXED) - held_sum +
+        shut_sum;
+    while (open_sum - held_sum > free_sum) {
+        oldest = NULL;
+        for (cl = clients; cl != NULL; cl = cl->next) {
+            if (__atomic_load_n(&cl->idle, __ATOMIC_SEQ_CST) && !cl->shut &&
+                (oldest == NULL || cl->idle_seq < oldest->idle_seq)) {
+                oldest = cl;
+            }
+        }
+        if (oldest == NULL) {
+            return;
+        }
+        oldest->shut = 1;
+        shut_sum++;
+        free_sum++;
+        shutdown(oldest->fd, SHUT_RD);      /* its read returns 0 */
+    }
+}
+
+/*
+ * set_idle - mark a kept-alive client as waiting for its next request,
+ *            or as busy again; the drain closes idle clients, and so
+ *            does reclaim_idle when connections wait for a worker
+ *            return 0 if the client should be closed instead of waited
+ *            for
+ */
+static int set_idle(client_t *cl, int idle) {
+    int shut;
+
+    if (!idle) {
+        __atomic_store_n(&cl->idle, 0, __ATOMIC_SEQ_CST);
         return 1;
+    }
+    pthread_mutex_lock(&clients_mutex);
+    __atomic_store_n(&cl->idle, 1, __ATOMIC_SEQ_CST);
+    cl->idle_seq = ++idle_clock;
+    reclaim_idle();
+    shut = cl->shut;
+    pthread_mutex_unlock(&clients_mutex);
+    return !shut && !__atomic_load_n(&draining, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * read_request - read from the client until buf holds a whole request header
+ *                return its length, 0 if the client closed or idled out,
+ *                -1 if the request is malformed or too large
+ */
+static int read_request(client_t *cl, request_t *req) {
+    int rc, n, idle;
+
+    request_init(req);
+    while ((rc = request_parse(req, cl->buf, cl->len)) == 0) {
+        if (cl->len == MAX_REQUEST_SIZE) {
+            return -1;
+        }
+        idle = cl->kept && cl->len == 0;
+        if (idle && !set_idle(cl, 1)) {
+            set_idle(cl, 0);
+            return 0;
+        }
+        n = read(cl->fd, cl->buf + cl->len, MAX_REQUEST_SIZE - cl->len);
+        if (idle) {
+            set_idle(cl, 0);
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        cl->len += n;
+    }
+    if (rc > 0) {
+        cl->used = rc;
+    }
+    return rc;
+}
+
+/*
+ * next_request - drop the bytes of the request just served, keeping any
+ *                the client already sent for the next one
+ */
+static void next_request(client_t *cl) {
+    memmove(cl->buf, cl->buf + cl->used, cl->len - cl->used);
+    cl->len -= cl->used;
+    cl->used = 0;
+}
+
+/*
+ * forward_body - pass a request body of n bytes from client to server,
+ *                first the part read along with the header
+ *                return 0 on success, -1 on error
+ */
+static int forward_body(client_t *cl, int clientfd, long n) {
+    char buf[MAXLINE];
+    int len;
+
+    len = cl->len - cl->used;
+    if (len > n) {
+        len = n;
+    }
+    if (len > 0 && rio_writen(clientfd, cl->buf + cl->used, len) != len) {
+        return -1;
+    }
+    cl->used += len;
+    n -= len;
+    while (n > 0) {
+        len = rio_readn(cl->fd, buf, n < MAXLINE ? n : MAXLINE);
+        if (len <= 0 || rio_writen(clientfd, buf, len) != len) {
+            return -1;
+        }
+        n -= len;
+    }
     return 0;
 }
 
 /*
- * proxy_thread - main proxy routine
- * client -> proxy -> server -> proxy -> client  
+ * serve_metrics - answer a request for METRICS_PATH
+ *                 return 1 if the client connection stays open
  */
-void *proxy_thread(void *vargp) {
+static int serve_metrics(int connfd, int persistent) {
+    char *buf = Malloc(METRICS_RESPONSE_SIZE);
+    int len = metrics_response(buf, METRICS_RESPONSE_SIZE, persistent);
+    int ok = (rio_writen(connfd, buf, len) == len);
+
+    free(buf);
+    return ok && persistent;
+}
+
+/*
+ * serve_request - proxy one request read from a client connection
+ * client -> proxy -> server -> proxy -> client
+ * return 1 if the client connection stays open for another request
+ */
+static int serve_request(client_t *cl) {
     /**************** var ****************/
-    /* proxy as server */
-    rio_t rio_to_client;
-    int connfd;
     /* request information */
-    char request_line[MAXLINE];
-    char method[MAXLINE], uri[MAXLINE], version[MAXLINE]; /* request line */
+    request_t request;
+    char method[MAXLINE], uri[MAXLINE];
     char host[MAXLINE], file[MAXLINE];
-    int port;
-    char request_header[MAX_HEADER_SUM][MAXLINE]; /* request header */
-    int header_sum, i;
+    int connfd = cl->fd, port;
+    char line[MAXLINE];
+    int header_len, persistent, cacheable, i;
+    long body_len;
+    range_set_t ranges;
+    byte_range_t resolved[RANGE_MAX];
+    int fill, plan, range_sum;
 
     /* proxy as client */
     rio_t rio_to_server;
-    int clientfd, len;
-    char forward_request[MAXLINE];
+    int clientfd, reused, iov_sum, len, rc;
+    struct iovec forward_request[REQUEST_IOV_MAX];
     /* response information */
-    char response[MAXLINE];
+    response_t response;
+    char *response_head;
 
     /* for cache */
-    char *buffer;
-    int object_size;  
-    int min_timestamp, min_pos; 
+    relay_t relay;
+    flight_t *flight;
+    cache_object_t *stale;
+    struct iovec stale_iov[CACHE_IOV_MAX];
+    int keep, revalidated;
 
-    /**************** client -> proxy ****************/
-    connfd = *(int *)vargp;
-    free(vargp);
-    pthread_detach(pthread_self());
-    rio_readinitb(&rio_to_client, connfd);
+    /* for metrics */
+    metrics_t *m;
+    long long start, first_byte;
+    long sent;
+    int outcome;
 
-    /* read request line */
-    rio_readlineb(&rio_to_client, request_line, MAXLINE);
+    /**************** client -> proxy ****************/
+    /* read request line and header */
+    if ((header_len = read_request(cl, &request)) <= 0) {
+        if (header_len < 0) {
+            error("read_request", "malformed or too large request");
+        }
+        return 0;
+    }
+    m = metrics_local();
+    start = metrics_now();
+    first_byte = 0;
+    sent = 0;
+    outcome = OUTCOME_ERROR;
     dbg_printf("----- proxy debug info: client -> proxy -----\n");
-    dbg_printf("%s", request_line);
-    sscanf(request_line, "%s %s %s", method, uri, version);
-
-    /* read request header */
-    header_sum = 0;
-    rio_readlineb(&rio_to_client, request_header[header_sum++], MAXLINE);
-    while (strcmp(request_header[header_sum - 1], "\r\n") != 0) {
-        dbg_printf("%s", request_header[header_sum - 1]);
-        rio_readlineb(&rio_to_client, request_header[header_sum++], MAXLINE);
+    dbg_printf("%.*s", header_len, cl->buf);
+    if (slice_copy(&request, request.method, method, MAXLINE) < 0 ||
+        slice_copy(&request, request.uri, uri, MAXLINE) < 0) {
+        error("read_request", "request line too long");
+        metrics_request(m, OUTCOME_ERROR, start, 0, 0);
+        return 0;
+    }
+    persistent = request_persistent(&request) &&
+                 !__atomic_load_n(&draining, __ATOMIC_RELAXED);
+    if (strcmp(uri, METRICS_PATH) == 0) {
+        return serve_metrics(connfd, persistent);
+    }
+    if (request.chunked) {
+        error("read_request", "chunked request body not supported");
+        metrics_request(m, OUTCOME_ERROR, start, 0, 0);
+        return 0;
     }
-    header_sum--;
+    body_len = request.content_length;
+    cacheable = (strcasecmp(method, "GET") == 0 && body_len == 0 &&
+                 !request.no_store);
 
     /* parse URI */
     dbg_printf("uri: %s\n", uri);
     if (parse_uri(uri, host, &port, file) < 0) {
         error("parse_uri", "cannot parse URI");
-        if (close(connfd) < 0) {
-            error("close", "cannot close connfd");
-            return NULL;
-        }
-        return NULL;
+        metrics_request(m, OUTCOME_ERROR, start, 0, 0);
+        return 0;
     }
     dbg_printf("host: %s, port: %d, file: %s\n", host, port, file);
     dbg_printf("---------------------------------------------\n");
 
+    /* ranges that may lie in a small object are cut from the whole one */
+    range_parse(&ranges, &request);
+    fill = cacheable && range_start(&ranges) >= 0 &&
+           range_start(&ranges) < MAX_OBJECT_SIZE;
+
     /* send the cached web objected without connecting to server if possible */
-    dbg_printf("timestamp: ");
-    for (i = 0; i < MAX_OBJECT_SUM; i++) {
-        dbg_printf("%d ", timestamp[i]);
-    }
-    dbg_printf("\n");
-    for (i = 0; i < MAX_OBJECT_SUM; i++) {
-        if (timestamp != 0) {
-            if (strcmp(cache_host[i], host) == 0 &&
-                cache_port[i] == port &&
-                strcmp(cache_file[i], file) == 0) {
-                dbg_printf("cache hit!\n");
-                P(&mutex);
-                timer++;
-                timestamp[i] = timer;
-                rio_writen(connfd, cache[i], cache_object_size[i]);
-                if (close(connfd) < 0) {
-                    error("close", "cannot close connfd");
-                    return NULL;
-                }
-                V(&mutex);
-                return NULL;
+    stale = NULL;
+    revalidated = 0;
+    if (cacheable && (sent = cache_send(connfd, host, port, file, persistent,
+                                        cache_flags(&request), &ranges,
+                                        &stale))) {
+        dbg_printf("cache hit!\n");
+        metrics_request(m, sent > 0 ? OUTCOME_HIT : OUTCOME_ERROR, start, 0,
+                        sent > 0 ? sent : 0);
+        return sent > 0 && persistent;
+    }
+
+    /* let one miss on the object fetch it while the others wait for it */
+    flight = NULL;
+    if (cacheable) {
+        /* look again: the flight waited for, or one that ended just
+           before this one began, may have cached or revalidated it */
+        flight = cache_flight_begin(host, port, file);
+        if (stale != NULL) {
+            cache_put(stale);
+            stale = NULL;
+        }
+        if ((sent = cache_send(connfd, host, port, file, persistent,
+                               cache_flags(&request), &ranges, &stale))) {
+            dbg_printf("cache hit after waiting!\n");
+            if (flight != NULL) {
+                cache_flight_end(flight);
             }
+            metrics_request(m, sent > 0 ? OUTCOME_HIT : OUTCOME_ERROR, start,
+                            0, sent > 0 ? sent : 0);
+            return sent > 0 && persistent;
         }
     }
+    if (stale != NULL && stale->validators == NULL) { /* fetch it again */
+        cache_put(stale);
+        stale = NULL;
+    }
 
     /**************** proxy -> server ****************/
-    clientfd = open_clientfd(host, port);
-    if (clientfd < 0) {
-        error("open_clientfd", "cannot connect to host");
-        if (close(connfd) < 0) {
-            error("close", "cannot close connfd");
-            return NULL;
-        }
-        return NULL;
-    }
-    /* forward request */
-    sprintf(forward_request, "%s %s HTTP/1.0\r\n", method, file);
-    sprintf(forward_request, "%sHost: %s\r\n", forward_request, host);
-    sprintf(forward_request, "%s%s\r\n", forward_request, user_agent);
-    sprintf(forward_request, "%s%s\r\n", forward_request, accept_type);
-    sprintf(forward_request, "%s%s\r\n", forward_request, accept_encoding);
-    sprintf(forward_request, "%sConnection: close\r\nProxy-Connection: close\r\n", forward_request);
-    for (i = 0; i < header_sum; i++) {
-        if (!header_exist(request_header[i])) {
-            sprintf(forward_request, "%s%s", forward_request, request_header[i]);
-        }
-    }
-    sprintf(forward_request, "%s\r\n", forward_request);
+    /* forward request, keeping the server connection for reuse */
+    iov_sum = build_request(forward_request, &request, host, file, 1,
+                            request.minor,
+                            stale != NULL ? stale->validators : NULL, fill);
     dbg_printf("----- proxy debug info: proxy -> server -----\n");
-    dbg_printf("%s", forward_request);
+    for (i = 0; i < iov_sum; i++) {
+        dbg_printf("%.*s", (int)forward_request[i].iov_len,
+                   (char *)forward_request[i].iov_base);
+    }
     dbg_printf("---------------------------------------------\n");
-    rio_readinitb(&rio_to_server, clientfd);
-    rio_writen(clientfd, forward_request, sizeof(forward_request));
+    for (i = 0; ; i++) {
+        clientfd = upool_get(host, port, &reused);
+        if (clientfd < 0) {
+            error("open_clientfd", "cannot connect to host");
+            goto unreachable;
+        }
+        rio_readinitb(&rio_to_server, clientfd);
+        if (i > 0) { /* writev_n consumed the iovecs */
+            iov_sum = build_request(forward_request, &request, host, file, 1,
+                                    request.minor,
+                                    stale != NULL ? stale->validators : NULL,
+                                    fill);
+        }
+        if (writev_n(clientfd, forward_request, iov_sum) >= 0) {
+            if (body_len > 0 &&
+                forward_body(cl, clientfd, body_len) < 0) {
+                close(clientfd);
+                keep = 0;
+                goto done;
+            }
+            if ((len = rio_readlineb(&rio_to_server, line, MAXLINE)) > 0) {
+                break;
+            }
+        }
+        /* a pooled connection may have been closed by the server */
+        close(clientfd);
+        if (!reused || body_len > 0 || i > 0) {
+            error("forward", "no response from server");
+            goto unreachable;
+        }
+    }
 
     /**************** server -> proxy -> client ****************/
-    buffer = (char *)calloc(MAX_OBJECT_SIZE, sizeof(char));
-    if (buffer == NULL) {
-        error("malloc", "cannot malloc buffer");
-        if (close(connfd) < 0) {
-            error("close", "cannot close connfd");
-            return NULL;
-        }
-        return NULL;
-    }
-    object_size = 0;
-    while ((len = rio_readnb(&rio_to_server, response, MAXLINE)) != 0) {
-        if (object_size + len <= MAX_OBJECT_SIZE) {
-            memcpy(buffer + object_size, response, len);
-        }
-        object_size += len;
-        rio_writen(connfd, response, len);
-    }
-    /* cache the web object using LRU if possible */
-    if (object_size < MAX_OBJECT_SIZE) { 
-        P(&mutex);
-        timer++;
-        min_timestamp = INT_MAX;
-        min_pos = -1;
-        for (i = 0; i < MAX_OBJECT_SUM; i++) {
-            if (min_timestamp > timestamp[i]) {
-                min_timestamp = timestamp[i];
-                min_pos = i;
+    relay.connfd = connfd;
+    relay.client_ok = 1;
+    relay.capturing = 0;
+    relay.holding = 0;
+    chunk_list_init(&relay.body);
+    plan = FILL_WHOLE;
+    relay.splice_ok = 1;
+    relay.buffered = relay.spliced = 0;
+
+    /* read response header */
+    response_init(&response);
+    rc = response_add_line(&response, line, len);
+    while (rc > 0 && (len = rio_readlineb(&rio_to_server, line, MAXLINE)) > 0) {
+        rc = response_add_line(&response, line, len);
+    }
+    if (rc < 0) { /* not HTTP: pass it through until the server closes */
+        relay.capturing = 0;
+        first_byte = metrics_now();
+        relay_write(&relay, line, len);
+        sent = len;
+        relay_eof(&rio_to_server, &relay);
+        persistent = 0;
+    } else if (rc > 0) { /* the server closed inside the header */
+        persistent = 0;
+        rc = -1;
+    } else if (stale != NULL && response.status == 304) {
+        /* the stale copy is still good: refresh it and send it instead */
+        dbg_printf("cache revalidated!\n");
+        stale = cache_refresh(stale, &response);
+        first_byte = metrics_now();
+        if ((sent = cache_write(connfd, stale, &ranges, persistent)) < 0) {
+            relay.client_ok = 0;
+            sent = 0;
+        }
+        revalidated = 1;
+    } else if (fill && (plan = cache_plan_fill(&response, &ranges, resolved,
+                                               &range_sum)) != FILL_WHOLE) {
+        /* the client's ranges are cut from the whole response */
+        first_byte = metrics_now();
+        if (plan == FILL_HOLD) {
+            rc = relay_held(&rio_to_server, &relay, &response, &ranges,
+                            persistent, &sent);
+            if (rc == 0) {
+                dbg_printf("web object is cached, size %d\n",
+                           relay.body.len);
+                cache_insert(host, port, file, &response, &relay.body);
             }
+        } else {
+            rc = relay_range(&rio_to_server, &relay, &response,
+                             range_sum == 1 ? &resolved[0] : NULL,
+                             persistent, &sent);
         }
-        timestamp[min_pos] = timer;
-        strcpy(cache_host[min_pos], host);
-        cache_port[min_pos] = port;
-        strcpy(cache_file[min_pos], file);
-        cache_object_size[min_pos] = object_size;
-        memcpy(cache[min_pos], buffer, MAX_OBJECT_SIZE);
-        V(&mutex);
-        dbg_printf("web object is cached in pos %d at time %d\n", min_pos, timer);
+    } else {
+        relay.capturing = cacheable && response_storable(&response);
+        if (!response_framed(&response, method)) {
+            persistent = 0;
+        }
+        response_head = Malloc(response.header_len + RESPONSE_HEADER_EXTRA);
+        len = response_header(&response, response_head, persistent);
+        first_byte = metrics_now();
+        relay_write(&relay, response_head, len);
+        free(response_head);
+        sent = len;
+
+        if (!response_has_body(&response, method)) {
+            rc = 0;
+        } else if (response.chunked) {
+            rc = relay_chunked(&rio_to_server, &relay);
+        } else if (response.content_length >= 0) {
+            rc = relay_length(&rio_to_server, &relay, response.content_length);
+        } else {
+            rc = relay_eof(&rio_to_server, &relay);
+        }
+
+        /* cache the web object using LRU if possible */
+        if (rc == 0 && relay.capturing) {
+            dbg_printf("web object is cached, size %d\n", relay.body.len);
+            cache_insert(host, port, file, &response, &relay.body);
+        }
+    }
+
+    /* park the server connection or close it; a slice leaves body unread */
+    if (rc == 0 && plan != FILL_SLICE && response_reusable(&response, method)) {
+        upool_put(host, port, clientfd);
+    } else if (close(clientfd) < 0) {
+        error("close", "cannot close clientfd");
+    }
+    response_free(&response);
+    chunk_list_free(&relay.body);
+    __sync_fetch_and_add(&buffered_bytes, relay.buffered);
+    __sync_fetch_and_add(&spliced_bytes, relay.spliced);
+    metrics_fetched(m, relay.buffered + relay.spliced);
+    if (!relay.holding) {
+        sent += relay.buffered + relay.spliced;
+    }
+    if (rc == 0 && relay.client_ok) {
+        outcome = revalidated ? OUTCOME_REVALIDATED :
+                  cacheable ? OUTCOME_MISS : OUTCOME_PASS;
+    }
+    keep = rc == 0 && relay.client_ok && persistent;
+    goto done;
+
+unreachable:
+    /* better a stale copy than no answer, if it may be used stale; it is
+       sent whole, with a Warning that says so */
+    keep = 0;
+    if (stale != NULL && cache_stale_ok(stale, cache_flags(&request)) &&
+        (sent = writev_n(connfd, stale_iov,
+                         cache_iov(stale, persistent, 1, stale_iov))) > 0) {
+        dbg_printf("stale copy sent!\n");
+        outcome = OUTCOME_STALE;
+        keep = persistent;
     }
+    sent = sent > 0 ? sent : 0;
 
-    /* close connect */
-    if (close(clientfd) < 0) {
-        error("close", "cannot close clentfd");
-        return NULL;
+done:
+    if (stale != NULL) {
+        cache_put(stale);
+    }
+    if (flight != NULL) {
+        cache_flight_end(flight);
+    }
+    metrics_request(m, outcome, start, first_byte, sent);
+    return keep;
+}
+
+/*
+ * do_proxy - main proxy routine for one client connection, serving its
+ *            requests one after another until it closes or idles out,
+ *            or reclaim_idle wants its worker back
+ */
+void do_proxy(int connfd) {
+    client_t *cl = Malloc(sizeof(client_t));
+    struct timeval timeout;
+
+    timeout.tv_sec = __atomic_load_n(&client_timeout, __ATOMIC_RELAXED);
+    timeout.tv_usec = 0;
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    cl->fd = connfd;
+    cl->len = cl->used = 0;
+    cl->kept = cl->idle = cl->shut = 0;
+    cl->prev = NULL;
+    pthread_mutex_lock(&clients_mutex);
+    if ((cl->next = clients) != NULL) {
+        clients->prev = cl;
+    }
+    clients = cl;
+    held_sum++;
+    pthread_mutex_unlock(&clients_mutex);
+
+    while (serve_request(cl)) {
+        cl->kept = 1;
+        next_request(cl);
+    }
+
+    /* off the list before the descriptor can be reused */
+    pthread_mutex_lock(&clients_mutex);
+    if (cl->prev != NULL) {
+        cl->prev->next = cl->next;
+    } else {
+        clients = cl->next;
+    }
+    if (cl->next != NULL) {
+        cl->next->prev = cl->prev;
+    }
+    held_sum--;
+    shut_sum -= cl->shut;
+    if (--open_sum == 0) {
+        pthread_cond_signal(&clients_cond);
     }
+    pthread_mutex_unlock(&clients_mutex);
+    free(cl);
     if (close(connfd) < 0) {
         error("close", "cannot close connfd");
-        return NULL;
     }
-    free(buffer);
-    return NULL;
+}
+
+/*
+ * add_client - count a connection accepted for the workers, freeing one
+ *              held by an idle client if none is free
+ */
+static void add_client(int connfd) {
+    pthread_mutex_lock(&clients_mutex);
+    open_sum++;
+    reclaim_idle();
+    pthread_mutex_unlock(&clients_mutex);
+    sbuf_insert(&sbuf, connfd);
+}
+
+/*
+ * drain_workers - take the connections already queued on listenfd, close
+ *                 it, close the idle keep-alive clients, and wait up to
+ *                 timeout seconds for the requests in flight
+ *                 return the number of connections still open
+ */
+static int drain_workers(int listenfd, int timeout) {
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    struct timespec deadline;
+    client_t *cl;
+    int connfd, left;
+
+    while ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) >= 0) {
+        add_client(connfd);
+        clientlen = sizeof(clientaddr);
+    }
+    close(listenfd);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&clients_mutex);
+    for (cl = clients; cl != NULL; cl = cl->next) {
+        if (__atomic_load_n(&cl->idle, __ATOMIC_SEQ_CST)) {
+            shutdown(cl->fd, SHUT_RD);      /* its read returns 0 */
+        }
+    }
+    while (open_sum > 0 &&
+           pthread_cond_timedwait(&clients_cond, &clients_mutex,
+                                  &deadline) == 0)
+        ;
+    left = open_sum;
+    pthread_mutex_unlock(&clients_mutex);
+    return left;
 }
 
 /*
@@ -281,47 +908,393 @@ void SIGPIPE_handler(int sig) {
     return;
 }
 
+/*
+ * worker_thread - serve connections taken from the queue, until it hands
+ *                 out -1 to stop one worker
+ */
+void *worker_thread(void *vargp) {
+    int connfd;
+
+    Pthread_detach(pthread_self());
+    while ((connfd = sbuf_remove(&sbuf)) >= 0) {
+        do_proxy(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * set_workers - start or stop workers until n are running
+ */
+static void set_workers(int n) {
+    pthread_t tid;
+
+    /* reclaim_idle reads worker_sum in other threads */
+    while (worker_sum < n) {
+        Pthread_create(&tid, NULL, worker_thread, NULL);
+        __atomic_add_fetch(&worker_sum, 1, __ATOMIC_RELAXED);
+    }
+    while (worker_sum > n) {
+        sbuf_insert(&sbuf, -1);
+        __atomic_sub_fetch(&worker_sum, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * print_stats - print the queue, relay, cache, disk and DNS counters
+ */
+static void print_stats(void) {
+    sbuf_stats_t st;
+    cache_stats_t cs;
+    disk_stats_t ds;
+    dns_stats_t ns;
+
+    if (!config.event_mode) {   /* the event loops have no queue */
+        sbuf_stats(&sbuf, &st);
+        fprintf(stderr, "queue: depth %d, max depth %d, accepted %lld, "
+                "blocked on full %lld, avg wait %lld us, "
+                "max wait %lld us\n", st.depth, st.max_depth, st.inserted,
+                st.full_waits, st.inserted > st.depth ?
+                st.wait_usec / (st.inserted - st.depth) : 0,
+                st.max_wait_usec);
+    }
+    fprintf(stderr, "relay: buffered %lld bytes, spliced %lld bytes\n",
+            buffered_bytes, spliced_bytes);
+    cache_stats(&cs);
+    fprintf(stderr, "cache: %d objects, %d bytes, %lld admitted, "
+            "%lld rejected, %lld evicted, %lld sketch agings, "
+            "%lld compressed\n", cs.objects, cs.bytes, cs.admitted,
+            cs.rejected, cs.evicted, cs.agings, cs.compressed);
+    disk_stats(&ds);
+    fprintf(stderr, "disk: %d objects, %lld bytes, %lld hits, "
+            "%lld stores, %lld recycles\n", ds.objects, ds.bytes,
+            ds.hits, ds.stores, ds.recycles);
+    dns_stats(&ns);
+    fprintf(stderr, "dns: %d hosts, %lld hits, %lld stale hits, "
+            "%lld negative hits, %lld misses, %lld lookups, "
+            "%lld failed\n", ns.entries, ns.hits, ns.stale_hits,
+            ns.negative_hits, ns.misses, ns.lookups, ns.failures);
+}
+
+/*
+ * restart_only - warn that a setting the file changed cannot change live
+ *                return 1 if it changed
+ */
+static int restart_only(int changed, const char *name) {
+    if (changed) {
+        fprintf(stderr, "reload: %s changes at the next restart\n", name);
+    }
+    return changed;
+}
+
+/*
+ * reload - read the config file again and apply what can change live:
+ *          the cache size, the worker count, the timeouts and whether
+ *          a drain snapshots the cache
+ */
+static void reload(void) {
+    config_t cf = base_config;
+
+    if (config_path == NULL) {
+        fprintf(stderr, "reload: no config file\n");
+        return;
+    }
+    if (config_load(&cf, config_path) < 0) {
+        fprintf(stderr, "reload: keeping the current settings\n");
+        return;
+    }
+    if (restart_only(cf.event_mode != loaded_config.event_mode, "event")) {
+        cf.event_mode = loaded_config.event_mode;
+    }
+    if (restart_only(cf.reuseport != loaded_config.reuseport, "reuseport")) {
+        cf.reuseport = loaded_config.reuseport;
+    }
+    if (restart_only(cf.queue_size != loaded_config.queue_size, "queue")) {
+        cf.queue_size = loaded_config.queue_size;
+    }
+    if (restart_only(cf.admission != loaded_config.admission, "admission")) {
+        cf.admission = loaded_config.admission;
+    }
+    if (restart_only(strcmp(cf.disk_path, loaded_config.disk_path) != 0 ||
+                     cf.disk_size != loaded_config.disk_size,
+                     "disk cache")) {
+        strcpy(cf.disk_path, loaded_config.disk_path);
+        cf.disk_size = loaded_config.disk_size;
+    }
+    loaded_config = cf;
+    config_finish(&cf, cores);
+    cf.queue_size = config.queue_size;
+    if (cf.event_mode &&
+        restart_only(cf.threads != config.threads, "event loop count")) {
+        cf.threads = config.threads;
+    }
+
+    if (cf.cache_size != config.cache_size) {
+        cache_resize(cf.cache_size);
+    }
+    if (!cf.event_mode) {
+        set_workers(cf.threads);
+    }
+    __atomic_store_n(&client_timeout, cf.client_timeout, __ATOMIC_RELAXED);
+    upool_set_timeout(cf.server_timeout);
+    pthread_mutex_lock(&config_mutex);
+    config = cf;
+    pthread_mutex_unlock(&config_mutex);
+    fprintf(stderr, "reload: cache %d KiB, %d threads, client timeout %d s, "
+            "server timeout %d s, drain timeout %d s, snapshot %s\n",
+            config.cache_size / 1024, config.threads, config.client_timeout,
+            config.server_timeout, config.drain_timeout,
+            config.snapshot ? "on" : "off");
+}
+
+/*
+ * drain_settings - read the drain settings in force, which a reload may
+ *                  be changing
+ */
+static void drain_settings(int *timeout, int *snapshot) {
+    pthread_mutex_lock(&config_mutex);
+    *timeout = config.drain_timeout;
+    *snapshot = config.snapshot;
+    pthread_mutex_unlock(&config_mutex);
+}
+
+/*
+ * signal_thread - take the signals the proxy acts on: SIGUSR1 prints the
+ *                 counters, SIGHUP reloads the config file and SIGTERM
+ *                 wakes main to drain
+ */
+void *signal_thread(void *vargp) {
+    sigset_t *mask = (sigset_t *)vargp;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    while (sigwait(mask, &sig) == 0) {
+        if (sig == SIGUSR1) {
+            print_stats();
+        } else if (sig == SIGHUP) {
+            reload();
+        } else if (sig == SIGTERM &&
+                   !__atomic_exchange_n(&draining, 1, __ATOMIC_SEQ_CST)) {
+            if (write(drain_pipe[1], "", 1) < 0) {
+                error("write", "cannot wake main for the drain");
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * open_listener - open a listening socket on port, shared with other
+ *                 proxies that set SO_REUSEPORT too if reuseport is set
+ *                 return -1 and set errno on error
+ */
+static int open_listener(int port, int reuseport) {
+    struct sockaddr_in serveraddr;
+    int listenfd, optval = 1;
+
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                   sizeof(optval)) < 0 ||
+        (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                 &optval, sizeof(optval)) < 0)) {
+        close(listenfd);
+        return -1;
+    }
+    memset(&serveraddr, 0, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+    if (bind(listenfd, (SA *)&serveraddr, sizeof(serveraddr)) < 0 ||
+        listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/*
+ * usage - print the command line format and exit
+ */
+void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-t threads] [-q queue_size] [--event] "
+            "[--config file] [option...] <port>\n", name);
+    fprintf(stderr, "  -t threads         worker threads, or event loops "
+            "with --event\n");
+    fprintf(stderr, "  -q queue_size      connections waiting for a "
+            "worker\n");
+    fprintf(stderr, "  --event            serve with non-blocking epoll "
+            "loops\n");
+    fprintf(stderr, "  --config file      read these options from file, "
+            "one \"name value\" per line,\n"
+            "                     and again on SIGHUP\n");
+    fprintf(stderr, "  --cache-size KiB   bound of the memory cache, "
+            "default %d KiB\n", MAX_CACHE_SIZE / 1024);
+    fprintf(stderr, "  --admission all|tinylfu\n"
+            "                     what may enter a full cache: everything "
+            "(default),\n"
+            "                     or only objects more popular than they "
+            "evict\n");
+    fprintf(stderr, "  --disk-cache path  keep evicted objects in path.0 "
+            "and path.1\n");
+    fprintf(stderr, "  --disk-size MiB    bound of the disk cache, default "
+            "%d MiB\n", DISK_CACHE_SIZE);
+    fprintf(stderr, "  --client-timeout s idle time before a client is "
+            "closed, default %d s\n", CLIENT_IDLE_TIMEOUT);
+    fprintf(stderr, "  --server-timeout s idle time before a server "
+            "connection is closed, default %d s\n", UPOOL_IDLE_TIMEOUT);
+    fprintf(stderr, "  --drain-timeout s  time SIGTERM waits for requests "
+            "in flight, default %d s\n", DRAIN_TIMEOUT);
+    fprintf(stderr, "  --snapshot         on SIGTERM, copy the memory cache "
+            "to the disk cache\n");
+    fprintf(stderr, "  --reuseport        let a new proxy bind the port "
+            "before this one exits\n");
+    exit(1);
+}
+
 int main(int argc, char **argv) {
-    int listenfd, proxy_port;
+    int listenfd, proxy_port, connfd, left, c, i;
+    int event_mode, use_disk, drain_timeout, snapshot;
     int clientlen;
-    int *connfd_p;
     struct sockaddr_in clientaddr;
+    struct pollfd fds[2];
     pthread_t tid;
+    sigset_t mask;
+    char byte;
+    static struct option long_options[] = {
+        {"event", no_argument, NULL, 0},
+        {"reuseport", no_argument, NULL, 0},
+        {"snapshot", no_argument, NULL, 0},
+        {"admission", required_argument, NULL, 0},
+        {"cache-size", required_argument, NULL, 0},
+        {"disk-cache", required_argument, NULL, 0},
+        {"disk-size", required_argument, NULL, 0},
+        {"client-timeout", required_argument, NULL, 0},
+        {"server-timeout", required_argument, NULL, 0},
+        {"drain-timeout", required_argument, NULL, 0},
+        {"config", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
 
-    /* parse arguments */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    /* parse arguments: the command line, then the config file */
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        cores = 1;
+    }
+    config_init(&base_config);
+    config_path = NULL;
+    while ((c = getopt_long(argc, argv, "t:q:e", long_options, &i)) != -1) {
+        if ((c == 0 && config_set(&base_config, long_options[i].name,
+                                  optarg) < 0) ||
+            (c == 't' && config_set(&base_config, "threads", optarg) < 0) ||
+            (c == 'q' && config_set(&base_config, "queue", optarg) < 0) ||
+            (c == 'e' && config_set(&base_config, "event", NULL) < 0) ||
+            c == '?') {
+            usage(argv[0]);
+        }
+        if (c == 'c') {
+            config_path = optarg;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    proxy_port = atoi(argv[optind]);
+    loaded_config = base_config;
+    if (config_path != NULL && config_load(&loaded_config, config_path) < 0) {
         exit(1);
     }
-    proxy_port = atoi(argv[1]);
+    config = loaded_config;
+    config_finish(&config, cores);
+    client_timeout = config.client_timeout;
 
-    /* SIGPIPE handler */
+    /* SIGUSR1, SIGHUP and SIGTERM go to the signal thread only, so they
+       are blocked before any other thread starts */
     Signal(SIGPIPE, SIGPIPE_handler);
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGUSR1);
+    Sigaddset(&mask, SIGHUP);
+    Sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (pipe(drain_pipe) < 0) {
+        unix_error("pipe error");
+    }
 
     /* main proxy routine */
-    timer = 0;
-    memset(cache, 0, sizeof(cache));
-    memset(cache_host, 0, sizeof(cache_host));
-    memset(cache_port, 0, sizeof(cache_port));
-    memset(cache_file, 0, sizeof(cache_file));
-    memset(cache_object_size, 0, sizeof(cache_object_size));
-    memset(timestamp, 0, sizeof(timestamp));
-    Sem_init(&mutex, 0, 1);
-    listenfd = Open_listenfd(proxy_port);
-    while (1) {
-        /* wait for request from client */
-        clientlen = sizeof(clientaddr);
-        connfd_p = malloc(sizeof(int));
-        *connfd_p = accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        if (*connfd_p < 0) {
-            error("accept", "");
-            continue;
+    cache_init(config.cache_size, config.admission);
+    if (config.disk_path[0] != '\0' &&
+        disk_init(config.disk_path, config.disk_size << 20) < 0) {
+        fprintf(stderr, "cannot use disk cache %s: %s\n", config.disk_path,
+                strerror(errno));
+        exit(1);
+    }
+    upool_init(UPOOL_MAX_IDLE_PER_HOST, config.server_timeout);
+    dns_init();
+    if ((listenfd = open_listener(proxy_port, config.reuseport)) < 0) {
+        unix_error("open_listener error");
+    }
+
+    /* a reload prints the queue and changes the workers, so the signal
+       thread starts once they are there; what main needs of config
+       later, a reload either cannot change or changes under the lock */
+    event_mode = config.event_mode;
+    use_disk = config.disk_path[0] != '\0';
+    if (event_mode) {
+        event_run(listenfd, config.threads);
+    } else {
+        sbuf_init(&sbuf, config.queue_size);
+        set_workers(config.threads);
+    }
+    Pthread_create(&tid, NULL, signal_thread, &mask);
+
+    if (event_mode) {
+        while (read(drain_pipe[0], &byte, 1) < 0 && errno == EINTR)
+            ;
+        drain_settings(&drain_timeout, &snapshot);
+        left = event_drain(listenfd, drain_timeout);
+    } else {
+        if (fcntl(listenfd, F_SETFL, O_NONBLOCK) < 0) {
+            unix_error("fcntl error");
         }
-        if (pthread_create(&tid, NULL, proxy_thread, connfd_p) != 0) {
-            error("pthread_create", "cannot create a new pthread");
-            continue;
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = drain_pipe[0];
+        fds[1].events = POLLIN;
+        while (1) {
+            /* wait for request from client, or for the drain */
+            if (poll(fds, 2, -1) < 0) {
+                if (errno != EINTR) {
+                    error("poll", strerror(errno));
+                }
+                continue;
+            }
+            if (fds[1].revents != 0) {
+                break;
+            }
+            clientlen = sizeof(clientaddr);
+            connfd = accept(listenfd, (SA *)&clientaddr,
+                            (socklen_t *)&clientlen);
+            if (connfd < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != EINTR) {
+                    error("accept", strerror(errno));
+                }
+                continue;
+            }
+            add_client(connfd);
         }
+        drain_settings(&drain_timeout, &snapshot);
+        left = drain_workers(listenfd, drain_timeout);
+    }
+
+    /* drained: whatever is still open is cut off by the exit */
+    if (left > 0) {
+        fprintf(stderr, "drain: %d %s still busy after %d s\n", left,
+                event_mode ? "event loops" : "connections", drain_timeout);
+    }
+    if (snapshot && use_disk) {
+        fprintf(stderr, "drain: %d objects snapshotted to the disk cache\n",
+                cache_snapshot());
     }
     return 0;
 }
-
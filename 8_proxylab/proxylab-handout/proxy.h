@@ -0,0 +1,16 @@
+/*
+ * proxy.h - declarations shared by the proxy's modules
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+/* #define DEBUG */            /* trace every request on stdout */
+#ifdef DEBUG
+# define dbg_printf(...) printf(__VA_ARGS__)
+#else
+# define dbg_printf(...)
+#endif
+
+void error(const char *type, const char *detail);
+
+#endif /* __PROXY_H__ */
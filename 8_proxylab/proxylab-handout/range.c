@@ -0,0 +1,350 @@
+/*
+ * range.c - byte-range requests answered from whole objects
+ *
+ * Replies are built without copying the body: a malloc'd buffer holds
+ * the new header and the part headers of a multipart body, and the
+ * iovecs point into it and into the object's chunks. The header keeps
+ * the object's lines except its framing, which the reply replaces.
+ */
+#include <limits.h>
+#include "csapp.h"
+#include "http.h"
+#include "range.h"
+
+#define BOUNDARY "PROXYLAB_BYTERANGES_3f8a61d2c07e94b5"
+#define VERSION_MAX 16
+#define PART_EXTRA 160              /* part header bytes beyond its type */
+#define CLOSING_EXTRA 16            /* closing delimiter beyond BOUNDARY */
+
+/*
+ * parse_number - parse the decimal digits at *p, advancing past them
+ *                return the number, or -1 if there are none or too many
+ */
+static long parse_number(const char **p, const char *end) {
+    long n = 0;
+    const char *start = *p;
+
+    while (*p < end && isdigit((unsigned char)**p)) {
+        if (n > (LONG_MAX - 9) / 10) {
+            return -1;
+        }
+        n = n * 10 + (**p - '0');
+        (*p)++;
+    }
+    return *p == start ? -1 : n;
+}
+
+/*
+ * parse_ranges - parse "bytes=spec, spec..." into rs
+ *                return 0 on success, -1 if the value is not one
+ */
+static int parse_ranges(range_set_t *rs, const char *p, int len) {
+    const char *end = p + len;
+    byte_range_t *br;
+
+    if (len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+    p += 6;
+    while (1) {
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (rs->sum == RANGE_MAX) {
+            return -1;
+        }
+        br = &rs->ranges[rs->sum++];
+        if (p < end && *p == '-') {     /* suffix: the last n bytes */
+            p++;
+            br->first = -1;
+            if ((br->last = parse_number(&p, end)) < 0) {
+                return -1;
+            }
+        } else {
+            if ((br->first = parse_number(&p, end)) < 0 ||
+                p == end || *p++ != '-') {
+                return -1;
+            }
+            br->last = -1;
+            if (p < end && isdigit((unsigned char)*p) &&
+                ((br->last = parse_number(&p, end)) < br->first)) {
+                return -1;
+            }
+        }
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        if (p == end) {
+            return 0;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+/*
+ * range_parse - record the Range and If-Range headers of a request
+ *               an absent or invalid Range leaves rs->sum 0
+ */
+void range_parse(range_set_t *rs, const request_t *r) {
+    const request_header_t *h;
+    int i;
+
+    rs->sum = 0;
+    rs->conditional = 0;
+    rs->if_range[0] = '\0';
+    for (i = 0; i < r->header_sum; i++) {
+        h = &r->headers[i];
+        if (h->id == HDR_RANGE && rs->sum == 0 &&
+            parse_ranges(rs, SLICE_PTR(r, h->value), h->value.len) < 0) {
+            rs->sum = 0;
+        } else if (h->id == HDR_IF_RANGE) {
+            rs->conditional = 1;
+            slice_copy(r, h->value, rs->if_range, RANGE_IF_MAX);
+        }
+    }
+}
+
+/*
+ * range_start - return the lowest first byte asked for, or -1 if there
+ *               are no ranges or one counts from the end
+ */
+long range_start(const range_set_t *rs) {
+    long start = -1;
+    int i;
+
+    for (i = 0; i < rs->sum; i++) {
+        if (rs->ranges[i].first < 0) {
+            return -1;
+        }
+        if (start < 0 || rs->ranges[i].first < start) {
+            start = rs->ranges[i].first;
+        }
+    }
+    return start;
+}
+
+/*
+ * if_range_holds - test if the If-Range value names this object: its
+ *                  strong ETag or its exact Last-Modified date
+ */
+static int if_range_holds(const range_set_t *rs, const char *header,
+                          int header_len) {
+    const char *v;
+    int len;
+
+    if (!rs->conditional) {
+        return 1;
+    }
+    if (rs->if_range[0] == '"') {
+        v = header_value(header, header_len, "ETag", &len);
+    } else {
+        v = header_value(header, header_len, "Last-Modified", &len);
+    }
+    return v != NULL && len == (int)strlen(rs->if_range) &&
+           memcmp(v, rs->if_range, len) == 0;
+}
+
+/*
+ * range_resolve - resolve the ranges against an object of size body bytes
+ *                 with this header, dropping those past its end
+ *                 return the number of ranges left in out, 0 if none can
+ *                 be satisfied, or -1 if the whole object is to be sent
+ */
+int range_resolve(const range_set_t *rs, const char *header, int header_len,
+                  long size, byte_range_t *out) {
+    const byte_range_t *br;
+    const char *sp;
+    int i, n = 0;
+
+    if (rs->sum == 0 ||
+        (sp = memchr(header, ' ', header_len)) == NULL ||
+        header + header_len - sp < 4 || strncmp(sp + 1, "200", 3) != 0 ||
+        !if_range_holds(rs, header, header_len)) {
+        return -1;
+    }
+    for (i = 0; i < rs->sum; i++) {
+        br = &rs->ranges[i];
+        if (br->first < 0) {            /* the last br->last bytes */
+            if (br->last == 0 || size == 0) {
+                continue;
+            }
+            out[n].first = br->last < size ? size - br->last : 0;
+            out[n].last = size - 1;
+        } else {
+            if (br->first >= size) {
+                continue;
+            }
+            out[n].first = br->first;
+            out[n].last = (br->last < 0 || br->last >= size) ? size - 1
+                                                              : br->last;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * status_line - write the object's HTTP version and a new status
+ *               return its length
+ */
+static int status_line(char *buf, const char *header, int header_len,
+                       const char *status) {
+    const char *sp = memchr(header, ' ', header_len);
+    int len = sp != NULL ? sp - header : 0;
+
+    if (len == 0 || len > VERSION_MAX) {
+        return sprintf(buf, "HTTP/1.0 %s\r\n", status);
+    }
+    return sprintf(buf, "%.*s %s\r\n", len, header, status);
+}
+
+/*
+ * copy_lines - copy the object's header lines after its status line,
+ *              leaving out its framing, and its type if multipart
+ *              return the bytes copied
+ */
+static int copy_lines(char *buf, const char *header, int header_len,
+                      int multipart) {
+    const char *p = header, *end = header + header_len, *nl;
+    int len = 0, first = 1;
+
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        nl++;
+        if (!first && strncasecmp(p, "Content-Length:", 15) != 0 &&
+            strncasecmp(p, "Content-Range:", 14) != 0 &&
+            !(multipart && strncasecmp(p, "Content-Type:", 13) == 0)) {
+            memcpy(buf + len, p, nl - p);
+            len += nl - p;
+        }
+        first = 0;
+        p = nl;
+    }
+    return len;
+}
+
+/*
+ * range_header - build the header answering with one range of an object
+ *                of size body bytes, or with a 416 if range is NULL;
+ *                buf needs header_len + RANGE_HEADER_EXTRA bytes
+ *                return its length, through the blank line
+ */
+int range_header(char *buf, const char *header, int header_len,
+                 const byte_range_t *range, long size, int persistent) {
+    int len;
+
+    if (range == NULL) {
+        len = status_line(buf, header, header_len,
+                          "416 Range Not Satisfiable");
+        len += copy_lines(buf + len, header, header_len, 0);
+        len += sprintf(buf + len, "Content-Range: bytes */%ld\r\n"
+                       "Content-Length: 0\r\n", size);
+    } else {
+        len = status_line(buf, header, header_len, "206 Partial Content");
+        len += copy_lines(buf + len, header, header_len, 0);
+        len += sprintf(buf + len, "Content-Range: bytes %ld-%ld/%ld\r\n"
+                       "Content-Length: %ld\r\n", range->first, range->last,
+                       size, range->last - range->first + 1);
+    }
+    len += sprintf(buf + len, "Connection: %s\r\n\r\n",
+                   persistent ? "keep-alive" : "close");
+    return len;
+}
+
+/*
+ * slice_iov - describe body bytes [first, last] as iovecs into its chunks
+ *             return the number of iovecs
+ */
+static int slice_iov(chunk_list_t *body, const byte_range_t *range,
+                     struct iovec *iov) {
+    chunk_t *c;
+    long pos = 0, from, to;
+    int n = 0;
+
+    for (c = body->head; c != NULL && pos <= range->last; c = c->next) {
+        from = range->first > pos ? range->first - pos : 0;
+        to = range->last < pos + c->len ? range->last - pos + 1 : c->len;
+        if (from < to) {
+            iov[n].iov_base = c->data + from;
+            iov[n].iov_len = to - from;
+            n++;
+        }
+        pos += c->len;
+    }
+    return n;
+}
+
+/*
+ * range_iov - describe the reply to a range request for an object with
+ *             this header and body: a 206 or 416 header, then the body
+ *             slices, in multipart form for several ranges
+ *             *iov and *buf are malloc'd for the caller to free
+ *             return the number of iovecs, or 0 if the whole object is
+ *             to be sent instead
+ */
+int range_iov(const range_set_t *rs, const char *header, int header_len,
+              chunk_list_t *body, int persistent, struct iovec **iov,
+              char **buf) {
+    byte_range_t ranges[RANGE_MAX];
+    const char *type;
+    char *p;
+    long size = body->len, total;
+    int n, i, k, len, type_len;
+
+    if ((n = range_resolve(rs, header, header_len, size, ranges)) < 0) {
+        return 0;
+    }
+    if ((type = header_value(header, header_len, "Content-Type",
+                             &type_len)) == NULL) {
+        type_len = 0;
+    }
+    *buf = malloc(header_len + RANGE_HEADER_EXTRA +
+                  n * (type_len + PART_EXTRA) + sizeof(BOUNDARY) +
+                  CLOSING_EXTRA);
+    *iov = malloc((2 + n * (1 + body->count)) * sizeof(struct iovec));
+    if (*buf == NULL || *iov == NULL) {
+        free(*buf);
+        free(*iov);
+        return 0;
+    }
+    if (n <= 1) {
+        (*iov)[0].iov_base = *buf;
+        (*iov)[0].iov_len = range_header(*buf, header, header_len,
+                                         n == 1 ? &ranges[0] : NULL, size,
+                                         persistent);
+        return 1 + (n == 1 ? slice_iov(body, &ranges[0], *iov + 1) : 0);
+    }
+
+    /* parts go after the room left for the header */
+    p = *buf + header_len + RANGE_HEADER_EXTRA;
+    total = 0;
+    k = 1;
+    for (i = 0; i < n; i++) {
+        len = sprintf(p, "\r\n--" BOUNDARY "\r\n");
+        if (type != NULL) {
+            len += sprintf(p + len, "Content-Type: %.*s\r\n", type_len, type);
+        }
+        len += sprintf(p + len, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                       ranges[i].first, ranges[i].last, size);
+        (*iov)[k].iov_base = p;
+        (*iov)[k++].iov_len = len;
+        p += len;
+        k += slice_iov(body, &ranges[i], *iov + k);
+        total += len + ranges[i].last - ranges[i].first + 1;
+    }
+    len = sprintf(p, "\r\n--" BOUNDARY "--\r\n");
+    (*iov)[k].iov_base = p;
+    (*iov)[k++].iov_len = len;
+    total += len;
+
+    len = status_line(*buf, header, header_len, "206 Partial Content");
+    len += copy_lines(*buf + len, header, header_len, 1);
+    len += sprintf(*buf + len, "Content-Type: multipart/byteranges; "
+                   "boundary=" BOUNDARY "\r\nContent-Length: %ld\r\n"
+                   "Connection: %s\r\n\r\n", total,
+                   persistent ? "keep-alive" : "close");
+    (*iov)[0].iov_base = *buf;
+    (*iov)[0].iov_len = len;
+    return k;
+}
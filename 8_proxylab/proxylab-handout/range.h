@@ -0,0 +1,50 @@
+/*
+ * range.h - byte-range requests answered from whole objects
+ *
+ * A client's Range header is parsed once into a range set; the ranges
+ * are resolved against an object only when its header and length are
+ * known, so one parse serves a cache hit, a revalidated copy or a
+ * response the proxy fetched whole. A resolved set is answered with a
+ * 206 holding one range, a 206 multipart/byteranges body for several,
+ * or a 416 when none overlaps the object, as RFC 7233 describes.
+ *
+ * Only 200 responses are sliced. A set the proxy does not handle (an
+ * invalid header, more than RANGE_MAX ranges, an If-Range that does not
+ * match the object's ETag or Last-Modified) gets the whole object, which
+ * a server is always allowed to send instead.
+ */
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include <sys/uio.h>
+#include "request.h"
+#include "chunk.h"
+
+#define RANGE_MAX 8                 /* ranges in one request */
+#define RANGE_IF_MAX 128            /* longest If-Range value compared */
+#define RANGE_HEADER_EXTRA 256      /* room range_header needs */
+
+/* bytes [first, last] of an object */
+typedef struct {
+    long first;                     /* -1 for the last `last` bytes */
+    long last;                      /* -1 for up to the end */
+} byte_range_t;
+
+typedef struct {
+    int sum;                        /* ranges asked for, 0 if none */
+    byte_range_t ranges[RANGE_MAX];
+    int conditional;                /* If-Range was sent */
+    char if_range[RANGE_IF_MAX];    /* its value, "" if too long */
+} range_set_t;
+
+void range_parse(range_set_t *rs, const request_t *r);
+long range_start(const range_set_t *rs);
+int range_resolve(const range_set_t *rs, const char *header, int header_len,
+                  long size, byte_range_t *out);
+int range_header(char *buf, const char *header, int header_len,
+                 const byte_range_t *range, long size, int persistent);
+int range_iov(const range_set_t *rs, const char *header, int header_len,
+              chunk_list_t *body, int persistent, struct iovec **iov,
+              char **buf);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,337 @@
+/*
+ * request.c - incremental HTTP request header parser
+ *
+ * request_parse looks at each byte of a header once: r->pos marks the
+ * end of the last complete line, and a call with more bytes picks up
+ * from there. Slices store offsets, so the buffer may be reallocated
+ * between calls as long as the parsed bytes stay where they were.
+ */
+#include "csapp.h"
+#include "request.h"
+
+#define NAME_IS(name, str) (strncasecmp(name, str, sizeof(str) - 1) == 0)
+
+/*
+ * header_id - recognize the name of a header the proxy acts on,
+ *             switching on its length and then on its first letter
+ */
+static int header_id(const char *name, int len) {
+    switch (len) {
+    case 4:
+        return NAME_IS(name, "Host") ? HDR_HOST : HDR_OTHER;
+    case 5:
+        return NAME_IS(name, "Range") ? HDR_RANGE : HDR_OTHER;
+    case 6:
+        switch (name[0] | 0x20) {
+        case 'a':
+            return NAME_IS(name, "Accept") ? HDR_ACCEPT : HDR_OTHER;
+        case 'p':
+            return NAME_IS(name, "Pragma") ? HDR_PRAGMA : HDR_OTHER;
+        }
+        return HDR_OTHER;
+    case 8:
+        return NAME_IS(name, "If-Range") ? HDR_IF_RANGE : HDR_OTHER;
+    case 10:
+        switch (name[0] | 0x20) {
+        case 'c':
+            return NAME_IS(name, "Connection") ? HDR_CONNECTION : HDR_OTHER;
+        case 'k':
+            return NAME_IS(name, "Keep-Alive") ? HDR_KEEP_ALIVE : HDR_OTHER;
+        case 'u':
+            return NAME_IS(name, "User-Agent") ? HDR_USER_AGENT : HDR_OTHER;
+        }
+        return HDR_OTHER;
+    case 13:
+        switch (name[0] | 0x20) {
+        case 'c':
+            return NAME_IS(name, "Cache-Control") ? HDR_CACHE_CONTROL
+                                                  : HDR_OTHER;
+        case 'i':
+            return NAME_IS(name, "If-None-Match") ? HDR_IF_NONE_MATCH
+                                                  : HDR_OTHER;
+        }
+        return HDR_OTHER;
+    case 14:
+        return NAME_IS(name, "Content-Length") ? HDR_CONTENT_LENGTH : HDR_OTHER;
+    case 15:
+        return NAME_IS(name, "Accept-Encoding") ? HDR_ACCEPT_ENCODING
+                                                : HDR_OTHER;
+    case 16:
+        return NAME_IS(name, "Proxy-Connection") ? HDR_PROXY_CONNECTION
+                                                 : HDR_OTHER;
+    case 17:
+        switch (name[0] | 0x20) {
+        case 't':
+            return NAME_IS(name, "Transfer-Encoding") ? HDR_TRANSFER_ENCODING
+                                                      : HDR_OTHER;
+        case 'i':
+            return NAME_IS(name, "If-Modified-Since") ? HDR_IF_MODIFIED_SINCE
+                                                      : HDR_OTHER;
+        }
+        return HDR_OTHER;
+    }
+    return HDR_OTHER;
+}
+
+/*
+ * value_has_token - test if a comma-separated value of len bytes lists
+ *                   the token, ignoring case
+ */
+static int value_has_token(const char *p, int len, const char *token) {
+    int token_len = strlen(token), n;
+    const char *end = p + len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        for (n = 0; p + n < end && p[n] != ','; n++)
+            ;
+        while (n > 0 && (p[n - 1] == ' ' || p[n - 1] == '\t')) {
+            n--;
+        }
+        if (n == token_len && strncasecmp(p, token, n) == 0) {
+            return 1;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * accepts_gzip - test if an Accept-Encoding value of len bytes takes gzip:
+ *                listed, or matched by "*", without q=0
+ */
+static int accepts_gzip(const char *p, int len) {
+    const char *end = p + len, *q;
+    int n, star = 0;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        for (n = 0; p + n < end && p[n] != ',' && p[n] != ';' &&
+             p[n] != ' ' && p[n] != '\t'; n++)
+            ;
+        /* a weight of zero refuses the coding */
+        for (q = p + n; q < end && *q != ',' && *q != '='; q++)
+            ;
+        if ((n == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+            (n == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            return q == end || *q == ',' || atof(q + 1) > 0;
+        }
+        if (n == 1 && *p == '*') {
+            star = q == end || *q == ',' || atof(q + 1) > 0;
+        }
+        while (p < end && *p != ',') {
+            p++;
+        }
+    }
+    return star;
+}
+
+/*
+ * content_of - return the length of a line without its line end
+ */
+static int content_of(const char *line, int len) {
+    len--;                      /* '\n' */
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    return len;
+}
+
+/*
+ * parse_request_line - split "method uri version" into slices
+ *                      return 0 on success, -1 if malformed
+ */
+static int parse_request_line(request_t *r, int off, int len) {
+    const char *line = r->buf + off;
+    int end = content_of(line, len), i = 0, start;
+
+    start = i;
+    while (i < end && line[i] != ' ') {
+        i++;
+    }
+    r->method.off = off + start;
+    r->method.len = i - start;
+    while (i < end && line[i] == ' ') {
+        i++;
+    }
+    start = i;
+    while (i < end && line[i] != ' ') {
+        i++;
+    }
+    r->uri.off = off + start;
+    r->uri.len = i - start;
+    while (i < end && line[i] == ' ') {
+        i++;
+    }
+    r->version.off = off + i;
+    r->version.len = end - i;
+    while (r->version.len > 0 &&
+           line[i + r->version.len - 1] == ' ') {
+        r->version.len--;
+    }
+
+    if (r->method.len == 0 || r->uri.len == 0) {
+        return -1;
+    }
+    r->minor = slice_is(r, r->version, "HTTP/1.1");
+    return 0;
+}
+
+/*
+ * add_header - record one header line and act on the ones that matter
+ *              return 0 on success, -1 if malformed or one too many
+ */
+static int add_header(request_t *r, int off, int len) {
+    const char *line = r->buf + off, *colon, *value;
+    int end = content_of(line, len), v, e;
+    request_header_t *h;
+
+    if (r->header_sum == REQUEST_MAX_HEADERS) {
+        return -1;
+    }
+    h = &r->headers[r->header_sum++];
+    h->line.off = off;
+    h->line.len = len;
+    if ((colon = memchr(line, ':', end)) == NULL) { /* passed on as is */
+        h->id = HDR_OTHER;
+        h->value.off = off + end;
+        h->value.len = 0;
+        return 0;
+    }
+    h->id = header_id(line, colon - line);
+    for (v = colon + 1 - line; v < end && (line[v] == ' ' || line[v] == '\t');
+         v++)
+        ;
+    for (e = end; e > v && (line[e - 1] == ' ' || line[e - 1] == '\t'); e--)
+        ;
+    h->value.off = off + v;
+    h->value.len = e - v;
+    value = line + v;
+
+    switch (h->id) {
+    case HDR_CONTENT_LENGTH:
+        r->content_length = atol(value);
+        if (r->content_length < 0) {
+            return -1;
+        }
+        break;
+    case HDR_TRANSFER_ENCODING:
+        r->chunked = value_has_token(value, e - v, "chunked");
+        break;
+    case HDR_CONNECTION:
+    case HDR_PROXY_CONNECTION:
+        if (value_has_token(value, e - v, "close")) {
+            r->close = 1;
+        }
+        if (value_has_token(value, e - v, "keep-alive")) {
+            r->keep_alive = 1;
+        }
+        break;
+    case HDR_CACHE_CONTROL:
+        if (value_has_token(value, e - v, "no-cache") ||
+            value_has_token(value, e - v, "max-age=0")) {
+            r->no_cache = 1;
+        }
+        if (value_has_token(value, e - v, "no-store")) {
+            r->no_store = 1;
+        }
+        break;
+    case HDR_PRAGMA:
+        if (value_has_token(value, e - v, "no-cache")) {
+            r->no_cache = 1;
+        }
+        break;
+    case HDR_ACCEPT_ENCODING:
+        r->gzip = accepts_gzip(value, e - v);
+        break;
+    }
+    return 0;
+}
+
+/*
+ * request_init - prepare to parse a new request header
+ */
+void request_init(request_t *r) {
+    r->buf = NULL;
+    r->pos = 0;
+    r->method.off = r->method.len = 0;
+    r->uri.off = r->uri.len = 0;
+    r->version.off = r->version.len = 0;
+    r->minor = 0;
+    r->header_sum = 0;
+    r->content_length = 0;
+    r->chunked = 0;
+    r->close = 0;
+    r->keep_alive = 0;
+    r->no_cache = 0;
+    r->no_store = 0;
+    r->gzip = 0;
+}
+
+/*
+ * request_parse - parse the lines of buf[0, len) not parsed before
+ *                 return the bytes through the blank line, 0 if buf holds
+ *                 no complete header yet, -1 if it is malformed
+ */
+int request_parse(request_t *r, const char *buf, int len) {
+    const char *line, *nl;
+    int line_len;
+
+    r->buf = buf;
+    while (r->pos < len &&
+           (nl = memchr(buf + r->pos, '\n', len - r->pos)) != NULL) {
+        line = buf + r->pos;
+        line_len = nl + 1 - line;
+        r->pos += line_len;
+        if (content_of(line, line_len) == 0) {
+            if (r->method.len == 0) { /* blank lines before a request */
+                continue;
+            }
+            return r->pos;
+        }
+        if (r->method.len == 0) {
+            if (parse_request_line(r, line - buf, line_len) < 0) {
+                return -1;
+            }
+        } else if (add_header(r, line - buf, line_len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * request_persistent - test if the client wants to keep its connection
+ *                      HTTP/1.1 persists unless told to close, HTTP/1.0
+ *                      only when it asks for keep-alive
+ */
+int request_persistent(const request_t *r) {
+    return !r->close && (r->minor || r->keep_alive);
+}
+
+/*
+ * slice_is - test if a slice holds the string, ignoring case
+ */
+int slice_is(const request_t *r, slice_t s, const char *str) {
+    return s.len == (int)strlen(str) &&
+           strncasecmp(SLICE_PTR(r, s), str, s.len) == 0;
+}
+
+/*
+ * slice_copy - copy a slice into dst as a string
+ *              return its length, or -1 if it does not fit in size bytes
+ */
+int slice_copy(const request_t *r, slice_t s, char *dst, int size) {
+    if (s.len >= size) {
+        return -1;
+    }
+    memcpy(dst, SLICE_PTR(r, s), s.len);
+    dst[s.len] = '\0';
+    return s.len;
+}
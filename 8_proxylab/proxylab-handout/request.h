@@ -0,0 +1,77 @@
+/*
+ * request.h - incremental HTTP request header parser
+ *
+ * The parser never copies or allocates: the request line and each
+ * header are recorded as slices, offsets and lengths into the caller's
+ * buffer. Offsets rather than pointers let the caller grow or move the
+ * buffer between reads. request_parse is called again whenever more
+ * bytes arrive and resumes after the last complete line it saw.
+ *
+ * Headers the proxy acts on are recognized by a switch on the name's
+ * length and first letter, so most names cost one comparison at most.
+ */
+#ifndef __REQUEST_H__
+#define __REQUEST_H__
+
+#define MAX_REQUEST_SIZE 8192       /* request line plus headers */
+#define REQUEST_MAX_HEADERS 100
+
+/* header names the proxy acts on */
+#define HDR_OTHER 0
+#define HDR_HOST 1
+#define HDR_USER_AGENT 2
+#define HDR_ACCEPT 3
+#define HDR_ACCEPT_ENCODING 4
+#define HDR_CONNECTION 5
+#define HDR_PROXY_CONNECTION 6
+#define HDR_KEEP_ALIVE 7
+#define HDR_CONTENT_LENGTH 8
+#define HDR_TRANSFER_ENCODING 9
+#define HDR_CACHE_CONTROL 10
+#define HDR_PRAGMA 11
+#define HDR_IF_NONE_MATCH 12
+#define HDR_IF_MODIFIED_SINCE 13
+#define HDR_RANGE 14
+#define HDR_IF_RANGE 15
+
+/* bytes buf[off, off + len) of the parsed buffer */
+typedef struct {
+    int off;
+    int len;
+} slice_t;
+
+typedef struct {
+    int id;                     /* HDR_* */
+    slice_t line;               /* the whole line with its line end */
+    slice_t value;              /* without surrounding blanks */
+} request_header_t;
+
+typedef struct {
+    const char *buf;            /* buffer of the last request_parse call */
+    int pos;                    /* bytes of complete lines parsed */
+
+    slice_t method;
+    slice_t uri;
+    slice_t version;
+    int minor;                  /* 1 for HTTP/1.1, else 0 */
+    request_header_t headers[REQUEST_MAX_HEADERS];
+    int header_sum;
+
+    long content_length;        /* body bytes, 0 if none */
+    int chunked;                /* chunked request body, not supported */
+    int close;                  /* Connection: close */
+    int keep_alive;             /* Connection: keep-alive */
+    int no_cache;               /* a cached copy must be revalidated */
+    int no_store;               /* nothing may be cached */
+    int gzip;                   /* Accept-Encoding takes gzip */
+} request_t;
+
+#define SLICE_PTR(r, s) ((r)->buf + (s).off)
+
+void request_init(request_t *r);
+int request_parse(request_t *r, const char *buf, int len);
+int request_persistent(const request_t *r);
+int slice_is(const request_t *r, slice_t s, const char *str);
+int slice_copy(const request_t *r, slice_t s, char *dst, int size);
+
+#endif /* __REQUEST_H__ */
@@ -0,0 +1,102 @@
+/*
+ * sbuf.c - bounded producer/consumer queue of connected descriptors
+ *
+ * This is the sbuf package from the CS:APP text, extended with queue
+ * depth and queueing delay counters.
+ */
+#include "sbuf.h"
+
+/*
+ * now_usec - return the current time in microseconds
+ */
+static long long now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * sbuf_init - create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(long long));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+    sp->depth = sp->max_depth = 0;
+    sp->inserted = sp->full_waits = 0;
+    sp->wait_usec = sp->max_wait_usec = 0;
+}
+
+/*
+ * sbuf_deinit - clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+/*
+ * sbuf_insert - insert item onto the rear of shared buffer sp,
+ *               blocking while the buffer is full
+ */
+void sbuf_insert(sbuf_t *sp, int item) {
+    int full = 0;
+    int i;
+
+    if (sem_trywait(&sp->slots) < 0) {
+        full = 1;
+        P(&sp->slots);
+    }
+    P(&sp->mutex);
+    i = (++sp->rear) % (sp->n);
+    sp->buf[i] = item;
+    sp->stamp[i] = now_usec();
+    sp->inserted++;
+    sp->full_waits += full;
+    if (++sp->depth > sp->max_depth) {
+        sp->max_depth = sp->depth;
+    }
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/*
+ * sbuf_remove - remove and return the first item from buffer sp,
+ *               blocking while the buffer is empty
+ */
+int sbuf_remove(sbuf_t *sp) {
+    int item, i;
+    long long wait;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    i = (++sp->front) % (sp->n);
+    item = sp->buf[i];
+    wait = now_usec() - sp->stamp[i];
+    sp->wait_usec += wait;
+    if (wait > sp->max_wait_usec) {
+        sp->max_wait_usec = wait;
+    }
+    sp->depth--;
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/*
+ * sbuf_stats - take a consistent snapshot of the queue counters
+ */
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st) {
+    P(&sp->mutex);
+    st->depth = sp->depth;
+    st->max_depth = sp->max_depth;
+    st->inserted = sp->inserted;
+    st->full_waits = sp->full_waits;
+    st->wait_usec = sp->wait_usec;
+    st->max_wait_usec = sp->max_wait_usec;
+    V(&sp->mutex);
+}
@@ -0,0 +1,46 @@
+/*
+ * sbuf.h - bounded producer/consumer queue of connected descriptors
+ *
+ * The accept loop inserts descriptors and the worker threads remove
+ * them. A full queue blocks the producer, which pushes back on accept.
+ */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct {
+    int *buf;               /* buffer array */
+    long long *stamp;       /* time each item was inserted, in usec */
+    int n;                  /* maximum number of slots */
+    int front;              /* buf[(front+1)%n] is first item */
+    int rear;               /* buf[rear%n] is last item */
+    sem_t mutex;            /* protects accesses to buf and counters */
+    sem_t slots;            /* counts available slots */
+    sem_t items;            /* counts available items */
+
+    /* counters, read with sbuf_stats */
+    int depth;              /* items in the queue now */
+    int max_depth;          /* highest depth seen */
+    long long inserted;     /* items ever inserted */
+    long long full_waits;   /* inserts that blocked on a full queue */
+    long long wait_usec;    /* total time items spent queued */
+    long long max_wait_usec;
+} sbuf_t;
+
+typedef struct {
+    int depth;
+    int max_depth;
+    long long inserted;
+    long long full_waits;
+    long long wait_usec;
+    long long max_wait_usec;
+} sbuf_stats_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_stats(sbuf_t *sp, sbuf_stats_t *st);
+
+#endif /* __SBUF_H__ */
@@ -0,0 +1,89 @@
+/*
+ * sketch.c - count-min sketch of recent access frequencies
+ *
+ * Counters are bytes updated with relaxed atomics, so concurrent
+ * lookups count without a lock; an increment racing with aging may be
+ * lost, which only makes an estimate a little lower. The thread whose
+ * increment completes a sample period halves every counter.
+ */
+#include "csapp.h"
+#include "sketch.h"
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static const unsigned long long seeds[SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+};
+
+/*
+ * counter_of - return the counter of a key's hash in row i
+ */
+static inline unsigned char *counter_of(sketch_t *s, unsigned int hash,
+                                        int i) {
+    unsigned long long h = (hash + seeds[i]) * seeds[(i + 1) % SKETCH_DEPTH];
+
+    return &s->counters[i * s->width + (unsigned int)(h >> 32) % s->width];
+}
+
+/*
+ * age - halve every counter
+ */
+static void age(sketch_t *s) {
+    unsigned int i;
+
+    for (i = 0; i < SKETCH_DEPTH * s->width; i++) {
+        STORE(s->counters[i], LOAD(s->counters[i]) >> 1);
+    }
+    __sync_fetch_and_add(&s->agings, 1);
+}
+
+/*
+ * sketch_init - initialize an empty sketch with width counters per row,
+ *               rounded up to a power of two
+ */
+void sketch_init(sketch_t *s, unsigned int width) {
+    s->width = 1;
+    while (s->width < width) {
+        s->width <<= 1;
+    }
+    s->counters = Calloc(SKETCH_DEPTH * s->width, 1);
+    s->additions = 0;
+    s->sample_size = (long long)SKETCH_SAMPLE_FACTOR * s->width;
+    s->agings = 0;
+}
+
+/*
+ * sketch_increment - count one access to the key with this hash
+ */
+void sketch_increment(sketch_t *s, unsigned int hash) {
+    unsigned char *c;
+    int i;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        c = counter_of(s, hash, i);
+        if (LOAD(*c) < SKETCH_COUNTER_MAX) {
+            STORE(*c, LOAD(*c) + 1);
+        }
+    }
+    if (__sync_add_and_fetch(&s->additions, 1) == s->sample_size) {
+        age(s);
+        __sync_fetch_and_sub(&s->additions, s->sample_size / 2);
+    }
+}
+
+/*
+ * sketch_estimate - return the estimated recent accesses to a key
+ */
+int sketch_estimate(sketch_t *s, unsigned int hash) {
+    int i, n, min = SKETCH_COUNTER_MAX;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        n = LOAD(*counter_of(s, hash, i));
+        if (n < min) {
+            min = n;
+        }
+    }
+    return min;
+}
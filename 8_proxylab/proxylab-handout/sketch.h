@@ -0,0 +1,31 @@
+/*
+ * sketch.h - count-min sketch of recent access frequencies
+ *
+ * The sketch estimates how often a key was seen lately in a fixed
+ * amount of memory: SKETCH_DEPTH rows of small saturating counters,
+ * each row indexed by a different hash of the key, and the estimate is
+ * the smallest of the key's counters. After every SKETCH_SAMPLE_FACTOR
+ * times width increments all counters are halved, so old popularity
+ * fades and the sketch follows the current workload. The cache's
+ * TinyLFU admission compares these estimates.
+ */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#define SKETCH_DEPTH 4
+#define SKETCH_COUNTER_MAX 15        /* counters saturate like 4-bit ones */
+#define SKETCH_SAMPLE_FACTOR 10      /* aging period, in multiples of width */
+
+typedef struct {
+    unsigned char *counters;         /* SKETCH_DEPTH rows of width */
+    unsigned int width;              /* a power of two */
+    long long additions;             /* increments since the last aging */
+    long long sample_size;
+    long long agings;
+} sketch_t;
+
+void sketch_init(sketch_t *s, unsigned int width);
+void sketch_increment(sketch_t *s, unsigned int hash);
+int sketch_estimate(sketch_t *s, unsigned int hash);
+
+#endif /* __SKETCH_H__ */
@@ -1,35 +1,103 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Run by tiny with TINY_CGI_WORKER set, it stays running as a worker:
+ * it says hello on stdin, a Unix socket, then answers request frames
+ * there until tiny closes it (see tiny.c for the protocol).
  */
 /* $begin adder */
 #include "csapp.h"
 
-int main(void) {
-    char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
-    int n1=0, n2=0;
+#define HELLO "TINY-CGI/1"
+
+/*
+ * respond - make the output for one query: CGI headers and body
+ *     return its length
+ */
+int respond(char *buf, char *out) {
+    char *p, content[MAXLINE];
+    int n1=0, n2=0, n;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
+    if (buf != NULL) {
+	n1 = atoi(buf);
+	if ((p = strchr(buf, '&')) != NULL)
+	    n2 = atoi(p+1);
     }
 
-    /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
+    /* Make the response body, each part after the last */
+    n = sprintf(content, "Welcome to add.com: ");
+    n += sprintf(content + n, "THE Internet addition portal.\r\n<p>");
+    n += sprintf(content + n, "The answer is: %d + %d = %d\r\n<p>",
+		 n1, n2, n1 + n2);
+    n += sprintf(content + n, "Thanks for visiting!\r\n");
+
     /* Generate the HTTP response */
-    printf("Content-length: %d\r\n", strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
+    return sprintf(out, "Content-length: %d\r\n"
+		   "Content-type: text/html\r\n\r\n%s", n, content);
+}
+
+/*
+ * io - read or write all n bytes on fd
+ *     return 0, or -1 on error or end of file
+ */
+int io(int fd, void *buf, size_t n, int writing) {
+    ssize_t done;
+
+    while (n > 0) {
+	done = writing ? write(fd, buf, n) : read(fd, buf, n);
+	if (done < 0 && errno == EINTR)
+	    continue;
+	if (done <= 0)
+	    return -1;
+	buf = (char *)buf + done;
+	n -= done;
+    }
+    return 0;
+}
+
+/*
+ * put_frame - write one length-prefixed frame to fd
+ */
+int put_frame(int fd, char *buf, uint32_t n) {
+    uint32_t len = htonl(n);
+
+    return (io(fd, &len, 4, 1) < 0 || io(fd, buf, n, 1) < 0) ? -1 : 0;
+}
+
+/*
+ * worker - answer request frames on stdin until it closes
+ */
+void worker(void) {
+    char req[MAXLINE], out[2 * MAXLINE], *query, *p;
+    uint32_t len;
+
+    if (put_frame(STDIN_FILENO, HELLO, strlen(HELLO)) < 0)
+	exit(1);
+    while (io(STDIN_FILENO, &len, 4, 0) == 0) {
+	if ((len = ntohl(len)) >= sizeof(req) ||
+	    io(STDIN_FILENO, req, len, 0) < 0)
+	    exit(1);
+	req[len] = '\0';
+
+	/* Variables are "NAME=value" strings, each ending in a NUL */
+	query = NULL;
+	for (p = req; p < req + len; p += strlen(p) + 1)
+	    if (!strncmp(p, "QUERY_STRING=", 13))
+		query = p + 13;
+	if (put_frame(STDIN_FILENO, out, respond(query, out)) < 0)
+	    exit(1);
+    }
+    exit(0);
+}
+
+int main(void) {
+    char out[2 * MAXLINE];
+
+    if (getenv("TINY_CGI_WORKER") != NULL)
+	worker();
+    respond(getenv("QUERY_STRING"), out);
+    printf("%s", out);
     fflush(stdout);
     exit(0);
 }
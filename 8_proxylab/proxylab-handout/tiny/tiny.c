@@ -1,8 +1,48 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.1 Web server that uses the GET method to
+ *     serve static and dynamic content.
+ *
+ * A connection stays open for more requests unless the client asks
+ * otherwise, for up to KEEPALIVE_MAX requests and KEEPALIVE_TIMEOUT
+ * seconds of idling. Pipelined requests are read from what is left in
+ * the connection's buffer, and their answers are gathered into one
+ * write once no whole request is left.
+ *
+ * A worker polls the listening socket and the connections it accepted
+ * that are waiting for a request, up to IDLE_MAX of them, and serves
+ * whichever has one; a worker whose set is full closes its oldest idle
+ * connection to take a new one. So an idle connection costs a slot in
+ * a poll set, not a worker. By default tiny is iterative: it is one
+ * worker, so a slow client or CGI program holds up everyone else. With
+ * -m prefork it forks a pool of worker processes, and with -m threads
+ * it starts a pool of worker threads, all polling the shared listening
+ * socket; -n sets the size of the pool.
+ *
+ * Static files are served with sendfile from a bounded cache of open
+ * descriptors, so a hot file costs no open, stat or mmap; inotify tells
+ * which entries went stale, or, without it, a stat on each hit does.
+ * An entry keeps its header fields, built when the file is opened,
+ * and a small file's contents, so a hot small file is one writev.
+ *
+ * A CGI program named with -w can stay running between requests: tiny
+ * starts it with TINY_CGI_WORKER=1 in its environment and a Unix socket
+ * on stdin, and a program that speaks the worker protocol writes a
+ * hello frame there, then answers request frames with response frames
+ * until the socket closes. A frame is a 4-byte length in network order
+ * and that many bytes; the hello is "TINY-CGI/1", a request is the CGI
+ * variables as "NAME=value" strings each ending in a NUL, and a response
+ * is what the program would write to stdout as plain CGI. Other
+ * programs, and a named one that does not say hello, are run with fork
+ * and exec per request, as before, so no program is started just to
+ * see if it speaks the protocol unless -w asks for it.
  */
+#define _GNU_SOURCE             /* for close_range */
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 
 #define DEBUG
@@ -12,104 +52,957 @@
 # define dbg_printf(...)
 #endif
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+#define DEFAULT_WORKERS 8       /* processes or threads in a pool */
+
+#define FCACHE_MAX 128          /* open files the file cache keeps */
+#define FCACHE_BUCKETS 256
+#define FCACHE_INLINE_MAX 16384 /* largest file kept in memory */
+#define FHEADER_MAX 256         /* room for a static response header */
+#define MIME_BUCKETS 64         /* hash table of file name extensions */
+#define MIME_EXT_MAX 8
+#define CGI_HELLO "TINY-CGI/1"  /* a worker's first frame */
+#define CGI_HELLO_TIMEOUT 1     /* seconds a new worker has to say hello */
+#define CGI_TIMEOUT 30          /* seconds a worker has to answer */
+#define CGI_SCRIPTS_MAX 16      /* scripts -w may name */
+#define KEEPALIVE_TIMEOUT 5     /* seconds a kept connection may idle */
+#define KEEPALIVE_MAX 100       /* requests served on one connection */
+#define BATCH_MAX 16            /* pipelined answers written together */
+#define IDLE_MAX 32             /* idle connections one worker polls */
+
+/* concurrency modes */
+#define MODE_ITERATIVE 0
+#define MODE_PREFORK 1
+#define MODE_THREADS 2
+
+/*
+ * An open static file. Entries are reference counted, so one thread can
+ * send from an entry while another drops it from the cache; the table
+ * holds one reference, and the last one closes the file.
+ */
+typedef struct fentry {
+    char *name;
+    int fd;
+    off_t size;
+    ino_t ino;
+    struct timespec mtime;
+    int wd;                     /* inotify watch, or -1 */
+    char header[FHEADER_MAX];   /* the response's header fields */
+    int header_len;
+    char *body;                 /* a small file's contents, or NULL */
+    int refcnt;
+    struct fentry *hnext;       /* hash chain */
+    struct fentry *prev, *next; /* LRU list, most recent first */
+} fentry_t;
+
+/* A persistent CGI worker, and the workers of one script */
+typedef struct cgi_worker {
+    int fd;                     /* our end of its socket */
+    pid_t pid;
+    int gen;                    /* the pool's gen when it started */
+    struct cgi_pool *pool;
+    struct cgi_worker *next;    /* idle list */
+} cgi_worker_t;
+
+typedef struct cgi_pool {
+    char *name;
+    ino_t ino;                  /* the script the workers run */
+    struct timespec mtime;
+    int plain;                  /* it does not speak the protocol */
+    int gen;                    /* bumped when the script changes */
+    int nworkers;               /* idle or busy */
+    cgi_worker_t *idle;
+    struct cgi_pool *next;
+} cgi_pool_t;
+
+int cgi_workers = 1;            /* workers per script: 1 per thread */
+char *cgi_scripts[CGI_SCRIPTS_MAX]; /* URIs of scripts that may keep them */
+int cgi_nscripts;
+
+/* A client connection, and the answers waiting to be written to it */
+typedef struct {
+    int fd;
+    rio_t rio;
+    int minor;                  /* the request's version is HTTP/1.minor */
+    int keep;                   /* keep it open after this answer */
+    struct iovec iov[4 * BATCH_MAX];
+    int iovcnt;
+    fentry_t *held[BATCH_MAX];  /* files the waiting answers point into */
+    int nheld;
+    int served;                 /* requests answered on it */
+    time_t since;               /* idle since */
+} conn_t;
+
+void serve_forever(int listenfd);
+void prefork(int listenfd, int workers);
+void *worker_thread(void *vargp);
+fentry_t *fcache_get(char *name);
+void fcache_put(fentry_t *e);
+conn_t *conn_accept(int listenfd);
+int serve_conn(conn_t *c);
+void conn_close(conn_t *c);
+int pipelined(conn_t *c);
+void conn_flush(conn_t *c, int flags);
+void doit(conn_t *c);
+int read_requesthdrs(conn_t *c);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
+void serve_static(conn_t *c, fentry_t *f);
+int sendn(int fd, char *buf, size_t n, int flags);
+void mime_init(void);
+const char *get_filetype(char *filename);
+int writevn(int fd, struct iovec *iov, int cnt, int flags);
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs,
+		   struct stat *sbuf);
+char **cgi_env(char *var);
+int serve_worker(conn_t *c, char *filename, char *cgiargs,
+		 struct stat *sbuf);
+int cgi_has_length(char *buf, int n);
+void clienterror(conn_t *c, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
 
+/*
+ * usage - print the command line format and exit
+ */
+void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-m iterative|prefork|threads] "
+            "[-n workers] [-w /cgi-bin/script]... <port>\n", name);
+    exit(1);
+}
+
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd, port, clientlen;
-    struct sockaddr_in clientaddr;
+    int listenfd, port, mode, workers, c, i;
+    pthread_t tid;
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    mode = MODE_ITERATIVE;
+    workers = DEFAULT_WORKERS;
+    while ((c = getopt(argc, argv, "m:n:w:")) != -1) {
+        if (c == 'm' && strcmp(optarg, "iterative") == 0)
+            mode = MODE_ITERATIVE;
+        else if (c == 'm' && strcmp(optarg, "prefork") == 0)
+            mode = MODE_PREFORK;
+        else if (c == 'm' && strcmp(optarg, "threads") == 0)
+            mode = MODE_THREADS;
+        else if (c == 'n' && (workers = atoi(optarg)) > 0)
+            ;
+        else if (c == 'w' && cgi_nscripts < CGI_SCRIPTS_MAX)
+            cgi_scripts[cgi_nscripts++] = optarg;
+        else
+            usage(argv[0]);
     }
-    port = atoi(argv[1]);
+    if (optind != argc - 1)
+        usage(argv[0]);
+    port = atoi(argv[optind]);
+
+    /* a client that leaves early only fails a write */
+    Signal(SIGPIPE, SIG_IGN);
 
+    mime_init();
     listenfd = Open_listenfd(port);
-    while (1) {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen); //line:netp:tiny:accept
-        doit(connfd);                                             //line:netp:tiny:doit
-        Close(connfd);                                            //line:netp:tiny:close
+    /* every worker polls it, and those that lose the race must not block */
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if (mode == MODE_PREFORK)
+        prefork(listenfd, workers);
+    if (mode == MODE_THREADS) {
+        cgi_workers = workers;
+        for (i = 1; i < workers; i++)
+            Pthread_create(&tid, NULL, worker_thread, &listenfd);
     }
+    serve_forever(listenfd);    /* the last thread of the pool */
+    return 0;
 }
 /* $end tinymain */
 
+/*
+ * serve_forever - poll listenfd and this worker's idle connections,
+ *     accept new ones and serve each that has a request; every worker
+ *     of a pool runs this
+ */
+void serve_forever(int listenfd)
+{
+    conn_t *idle[IDLE_MAX], *kept[IDLE_MAX], *c;
+    struct pollfd fds[IDLE_MAX + 1];
+    int nidle = 0, nkept, i, n, wait;
+    time_t now;
+
+    while (1) {
+        /* Close the connections that idled too long; wait for the rest
+           no longer than the first of them may idle */
+        now = time(NULL);
+        wait = -1;
+        for (i = n = 0; i < nidle; i++) {
+            c = idle[i];
+            if (c->since + KEEPALIVE_TIMEOUT <= now) {
+                conn_close(c);
+                continue;
+            }
+            if (wait < 0)       /* the oldest comes first */
+                wait = (c->since + KEEPALIVE_TIMEOUT - now) * 1000;
+            idle[n] = c;
+            fds[n + 1].fd = c->fd;
+            fds[n + 1].events = POLLIN;
+            n++;
+        }
+        nidle = n;
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        if (poll(fds, nidle + 1, wait) < 0) {
+            if (errno != EINTR)
+                unix_error("poll error");
+            continue;
+        }
+
+        /* Serve each connection with a request (or an end); those kept
+           go to the back, as the newest idlers */
+        for (i = n = nkept = 0; i < nidle; i++) {
+            c = idle[i];
+            if (fds[i + 1].revents == 0)
+                idle[n++] = c;
+            else if (serve_conn(c))                               //line:netp:tiny:doit
+                kept[nkept++] = c;
+            else
+                conn_close(c);                                    //line:netp:tiny:close
+        }
+        memcpy(idle + n, kept, nkept * sizeof(conn_t *));
+        nidle = n + nkept;
+
+        if ((fds[0].revents & POLLIN) && (c = conn_accept(listenfd)) != NULL) {
+            if (nidle == IDLE_MAX) {
+                conn_close(idle[0]);
+                memmove(idle, idle + 1, --nidle * sizeof(conn_t *));
+            }
+            idle[nidle++] = c;
+        }
+    }
+}
+
+/*
+ * prefork - fork a pool of worker processes serving listenfd, and start
+ *     a new one whenever one dies; never returns
+ */
+void prefork(int listenfd, int workers)
+{
+    pid_t pid;
+    int i;
+
+    for (i = 0; i < workers; i++) {
+        if (Fork() == 0) {
+            serve_forever(listenfd);
+            exit(0);
+        }
+    }
+    while (1) {
+        if ((pid = wait(NULL)) < 0) {
+            if (errno != EINTR)
+                unix_error("wait error");
+            continue;
+        }
+        fprintf(stderr, "tiny: worker %d exited, starting another\n",
+                (int)pid);
+        if (Fork() == 0) {
+            serve_forever(listenfd);
+            exit(0);
+        }
+    }
+}
+
+/*
+ * worker_thread - one thread of the pool: serve listenfd forever
+ */
+void *worker_thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    serve_forever(*(int *)vargp);
+    return NULL;
+}
+
+/*
+ * conn_accept - accept a connection on listenfd and set it up
+ *     return it, or NULL if there was none to accept
+ */
+conn_t *conn_accept(int listenfd)
+{
+    struct sockaddr_in clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    struct timeval tv;
+    conn_t *c;
+    int fd, on = 1;
+
+    fd = accept(listenfd, (SA *)&clientaddr, &clientlen);  //line:netp:tiny:accept
+    if (fd < 0) {   /* another worker took it, or the client gave up */
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+            errno != ECONNABORTED)
+            perror("accept");
+        return NULL;
+    }
+    /* A request that has begun must arrive within the idle timeout */
+    tv.tv_sec = KEEPALIVE_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    /* Answers are gathered or corked already; Nagle would only delay
+       the last segment of one until the client's delayed ack */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    c = Malloc(sizeof(conn_t));
+    c->fd = fd;
+    rio_readinitb(&c->rio, fd);
+    c->iovcnt = c->nheld = c->served = 0;
+    c->since = time(NULL);
+    return c;
+}
+
+/*
+ * serve_conn - serve the requests that have come on c, and those that
+ *     follow while part of one is buffered
+ *     return 1 if c is kept, idle, or 0 if it is done
+ */
+int serve_conn(conn_t *c)
+{
+    do {
+        c->keep = ++c->served < KEEPALIVE_MAX;
+        doit(c);
+        /* Answers wait while more requests are already here */
+        if (!c->keep || !pipelined(c))
+            conn_flush(c, 0);
+    } while (c->keep && c->rio.rio_cnt > 0);
+    c->since = time(NULL);
+    return c->keep;
+}
+
+/*
+ * conn_close - close c and free it
+ */
+void conn_close(conn_t *c)
+{
+    Close(c->fd);
+    Free(c);
+}
+
+/*
+ * pipelined - test if a whole request is waiting in c's buffer
+ */
+int pipelined(conn_t *c)
+{
+    return memmem(c->rio.rio_bufptr, c->rio.rio_cnt, "\r\n\r\n", 4) ||
+        memmem(c->rio.rio_bufptr, c->rio.rio_cnt, "\n\n", 2);
+}
+
+/*
+ * conn_flush - write the waiting answers with flags, in one call if the
+ *     socket takes them, and release the files they point into
+ */
+void conn_flush(conn_t *c, int flags)
+{
+    if (c->iovcnt > 0 && writevn(c->fd, c->iov, c->iovcnt, flags) < 0)
+        c->keep = 0;
+    while (c->nheld > 0)
+        fcache_put(c->held[--c->nheld]);
+    c->iovcnt = 0;
+}
+
+/*
+ * The file cache: a hash table of fentry_t on an LRU list, one per
+ * process, so prefork workers each have their own
+ */
+static fentry_t *fbuckets[FCACHE_BUCKETS];
+static fentry_t *flru_head, *flru_tail;
+static int fcache_len;
+static int inotify_fd = -1;
+static pthread_mutex_t fcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fcache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * fhash - hash a file name into a bucket
+ */
+static unsigned fhash(char *name)
+{
+    unsigned h = 5381;
+
+    while (*name)
+	h = h * 33 + (unsigned char)*name++;
+    return h % FCACHE_BUCKETS;
+}
+
+/*
+ * fentry_release - drop a reference to e, closing it with the last;
+ *     called with fcache_mutex held
+ */
+static void fentry_release(fentry_t *e)
+{
+    if (--e->refcnt > 0)
+	return;
+    close(e->fd);
+    Free(e->name);
+    Free(e->body);
+    Free(e);
+}
+
+/*
+ * fcache_unlink - take e out of the cache; called with fcache_mutex held
+ */
+static void fcache_unlink(fentry_t *e)
+{
+    fentry_t **pp, *o;
+
+    for (pp = &fbuckets[fhash(e->name)]; *pp != e; pp = &(*pp)->hnext)
+	;
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else flru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else flru_tail = e->prev;
+    fcache_len--;
+
+    /* names of the same file share a watch */
+    for (o = flru_head; o != NULL && o->wd != e->wd; o = o->next)
+	;
+    if (e->wd >= 0 && o == NULL)
+	inotify_rm_watch(inotify_fd, e->wd);
+    fentry_release(e);
+}
+
+/*
+ * fcache_watch - drop the entries of files that change, forever; if
+ *     the event queue overflowed, changes were lost, so drop them all
+ */
+static void *fcache_watch(void *vargp)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    fentry_t *e, *next;
+    ssize_t n;
+    char *p;
+
+    Pthread_detach(pthread_self());
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0 || errno == EINTR) {
+	pthread_mutex_lock(&fcache_mutex);
+	for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+	    ev = (struct inotify_event *)p;
+	    for (e = flru_head; e != NULL; e = next) {
+		next = e->next;
+		if (e->wd == ev->wd || (ev->mask & IN_Q_OVERFLOW))
+		    fcache_unlink(e);
+	    }
+	}
+	pthread_mutex_unlock(&fcache_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * fcache_init - start watching for changes, if inotify works
+ */
+static void fcache_init(void)
+{
+    pthread_t tid;
+
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) >= 0)
+	Pthread_create(&tid, NULL, fcache_watch, NULL);
+}
+
+/*
+ * fcache_changed - test if the file at e's name is no longer e; the
+ *     check on each hit when there is no inotify, and on a new entry
+ *     when there is
+ */
+static int fcache_changed(fentry_t *e)
+{
+    struct stat sbuf;
+
+    return stat(e->name, &sbuf) < 0 || sbuf.st_ino != e->ino ||
+	sbuf.st_size != e->size || sbuf.st_mtim.tv_sec != e->mtime.tv_sec ||
+	sbuf.st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+/*
+ * fcache_get - return the open file name, from the cache if it is there;
+ *     release it with fcache_put. Return NULL with errno ENOENT if there
+ *     is no such file, or EACCES if it is not a readable regular file.
+ */
+fentry_t *fcache_get(char *name)
+{
+    unsigned h = fhash(name);
+    struct stat sbuf;
+    fentry_t *e, *o;
+    int fd, wd = -1;
+
+    pthread_once(&fcache_once, fcache_init);
+    pthread_mutex_lock(&fcache_mutex);
+    for (e = fbuckets[h]; e != NULL && strcmp(e->name, name); e = e->hnext)
+	;
+    if (e != NULL && inotify_fd < 0 && fcache_changed(e)) {
+	fcache_unlink(e);
+	e = NULL;
+    }
+    if (e != NULL) { /* a hit: move it to the front */
+	if (e != flru_head) {
+	    e->prev->next = e->next;
+	    if (e->next) e->next->prev = e->prev; else flru_tail = e->prev;
+	    e->prev = NULL;
+	    e->next = flru_head;
+	    flru_head->prev = e;
+	    flru_head = e;
+	}
+	e->refcnt++;
+	pthread_mutex_unlock(&fcache_mutex);
+	return e;
+    }
+    pthread_mutex_unlock(&fcache_mutex);
+
+    /*
+     * A miss; watch before fstat, so a change after it is not missed.
+     * O_NONBLOCK keeps open from waiting for a writer on a FIFO; it
+     * makes no difference to a regular file.
+     */
+    if ((fd = open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK)) < 0)
+	return NULL;
+    if (inotify_fd >= 0)
+	wd = inotify_add_watch(inotify_fd, name, IN_MODIFY | IN_ATTRIB |
+			       IN_MOVE_SELF | IN_DELETE_SELF);
+    if (fstat(fd, &sbuf) < 0 || !S_ISREG(sbuf.st_mode) ||
+	!(S_IRUSR & sbuf.st_mode)) {
+	if (wd >= 0)            /* cached files are all readable */
+	    inotify_rm_watch(inotify_fd, wd);
+	close(fd);
+	errno = EACCES;
+	return NULL;
+    }
+    e = Malloc(sizeof(fentry_t));
+    e->name = Malloc(strlen(name) + 1);
+    strcpy(e->name, name);
+    e->fd = fd;
+    e->size = sbuf.st_size;
+    e->ino = sbuf.st_ino;
+    e->mtime = sbuf.st_mtim;
+    e->wd = wd;
+    e->refcnt = 1;
+    e->header_len = sprintf(e->header, "Server: Tiny Web Server\r\n"
+			    "Content-length: %lld\r\n"
+			    "Content-type: %s\r\n",
+			    (long long)e->size, get_filetype(name));
+    e->body = NULL;
+    if (e->size > 0 && e->size <= FCACHE_INLINE_MAX) {
+	e->body = Malloc(e->size);
+	if (pread(fd, e->body, e->size, 0) != e->size) {
+	    Free(e->body);      /* it changed under us; send the file */
+	    e->body = NULL;
+	}
+    }
+    if (inotify_fd >= 0 && wd < 0)
+	return e;               /* unwatched, so not cached */
+
+    pthread_mutex_lock(&fcache_mutex);
+    for (o = fbuckets[h]; o != NULL; o = o->hnext) {
+	if (!strcmp(o->name, name)) { /* another thread opened it too */
+	    fcache_unlink(o);
+	    break;
+	}
+    }
+    e->refcnt++;
+    e->hnext = fbuckets[h];
+    fbuckets[h] = e;
+    e->prev = NULL;
+    e->next = flru_head;
+    if (flru_head) flru_head->prev = e; else flru_tail = e;
+    flru_head = e;
+    if (++fcache_len > FCACHE_MAX)
+	fcache_unlink(flru_tail);
+
+    /* A change since the watch was added found no entry to drop */
+    if (inotify_fd >= 0 && fcache_changed(e))
+	fcache_unlink(e);
+    pthread_mutex_unlock(&fcache_mutex);
+    return e;
+}
+
+/*
+ * fcache_put - release a file from fcache_get
+ */
+void fcache_put(fentry_t *e)
+{
+    pthread_mutex_lock(&fcache_mutex);
+    fentry_release(e);
+    pthread_mutex_unlock(&fcache_mutex);
+}
+
+/*
+ * Persistent CGI workers: each process keeps, per script, up to
+ * cgi_workers running copies that speak the worker protocol, idle ones
+ * on a list. A script that fails the hello is plain CGI until it
+ * changes, and a change retires the workers of the old one.
+ */
+static cgi_pool_t *cgi_pools;
+static pthread_mutex_t cgi_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * cgi_env - return a Malloc'ed copy of environ with var, "NAME=value",
+ *     replacing any variable of the same name
+ */
+char **cgi_env(char *var)
+{
+    int i, n, len = strchr(var, '=') - var + 1;
+    char **envp;
+
+    for (n = 0; environ[n] != NULL; n++)
+	;
+    envp = Malloc((n + 2) * sizeof(char *));
+    for (i = n = 0; environ[i] != NULL; i++)
+	if (strncmp(environ[i], var, len))
+	    envp[n++] = environ[i];
+    envp[n++] = var;
+    envp[n] = NULL;
+    return envp;
+}
+
+/*
+ * cgi_kill - stop a worker and free it
+ */
+static void cgi_kill(cgi_worker_t *w)
+{
+    kill(w->pid, SIGKILL);
+    Waitpid(w->pid, NULL, 0);
+    close(w->fd);
+    Free(w);
+}
+
+/*
+ * cgi_timeout - limit how long reads from a worker may block
+ */
+static void cgi_timeout(int fd, int seconds)
+{
+    struct timeval tv;
+
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * cgi_spawn - start a worker running script name
+ *     return it, or NULL if the script does not say hello
+ */
+static cgi_worker_t *cgi_spawn(char *name)
+{
+    char *emptylist[] = { NULL }, **envp, hello[sizeof(CGI_HELLO)];
+    cgi_worker_t *w;
+    uint32_t len;
+    int sv[2], devnull;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	return NULL;
+    envp = cgi_env("TINY_CGI_WORKER=1");
+    if ((pid = Fork()) == 0) { /* child: frames on stdin, stdout unused */
+	Signal(SIGPIPE, SIG_DFL);
+	Dup2(sv[1], STDIN_FILENO);
+	if ((devnull = open("/dev/null", O_WRONLY)) >= 0)
+	    Dup2(devnull, STDOUT_FILENO);
+	close_range(3, ~0U, 0);  /* the clients' sockets above all */
+	Execve(name, emptylist, envp);
+    }
+    Free(envp);
+    close(sv[1]);
+
+    w = Malloc(sizeof(cgi_worker_t));
+    w->fd = sv[0];
+    w->pid = pid;
+    cgi_timeout(w->fd, CGI_HELLO_TIMEOUT);
+    if (rio_readn(w->fd, &len, 4) != 4 || ntohl(len) != strlen(CGI_HELLO) ||
+	rio_readn(w->fd, hello, ntohl(len)) != ntohl(len) ||
+	strncmp(hello, CGI_HELLO, ntohl(len))) {
+	cgi_kill(w);            /* plain CGI exits, or waits on stdin */
+	return NULL;
+    }
+    cgi_timeout(w->fd, CGI_TIMEOUT);
+    return w;
+}
+
+/*
+ * cgi_get - take an idle worker for script name, with sbuf its stat,
+ *     starting one if the pool has room or waiting for one if not
+ *     return the worker, or NULL if the script is plain CGI
+ */
+static cgi_worker_t *cgi_get(char *name, struct stat *sbuf)
+{
+    cgi_worker_t *w;
+    cgi_pool_t *p;
+    int gen;
+    char c;
+
+    pthread_mutex_lock(&cgi_mutex);
+    for (p = cgi_pools; p != NULL && strcmp(p->name, name); p = p->next)
+	;
+    if (p == NULL) {
+	p = Calloc(1, sizeof(cgi_pool_t));
+	p->name = Malloc(strlen(name) + 1);
+	strcpy(p->name, name);
+	p->ino = sbuf->st_ino;
+	p->mtime = sbuf->st_mtim;
+	p->next = cgi_pools;
+	cgi_pools = p;
+    }
+    if (p->ino != sbuf->st_ino || p->mtime.tv_sec != sbuf->st_mtim.tv_sec ||
+	p->mtime.tv_nsec != sbuf->st_mtim.tv_nsec) {
+	/* a new script: retire the old one's workers, busy ones later */
+	while ((w = p->idle) != NULL) {
+	    p->idle = w->next;
+	    p->nworkers--;
+	    cgi_kill(w);
+	}
+	p->ino = sbuf->st_ino;
+	p->mtime = sbuf->st_mtim;
+	p->plain = 0;
+	p->gen++;
+    }
+
+    while (!p->plain) {
+	if ((w = p->idle) != NULL) {
+	    p->idle = w->next;
+	    if (recv(w->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+		p->nworkers--;  /* it died while idle */
+		cgi_kill(w);
+		continue;
+	    }
+	    pthread_mutex_unlock(&cgi_mutex);
+	    return w;
+	}
+	if (p->nworkers < cgi_workers) {
+	    p->nworkers++;
+	    gen = p->gen;
+	    pthread_mutex_unlock(&cgi_mutex);
+	    w = cgi_spawn(name);
+	    pthread_mutex_lock(&cgi_mutex);
+	    if (w != NULL) {
+		w->pool = p;
+		w->gen = gen;
+		pthread_mutex_unlock(&cgi_mutex);
+		return w;
+	    }
+	    p->nworkers--;
+	    if (gen == p->gen)
+		p->plain = 1;
+	    pthread_cond_broadcast(&cgi_cond);
+	    continue;
+	}
+	pthread_cond_wait(&cgi_cond, &cgi_mutex);
+    }
+    pthread_mutex_unlock(&cgi_mutex);
+    return NULL;
+}
+
+/*
+ * cgi_put - give a worker back, or stop it if it failed or its script
+ *     has changed since it started
+ */
+static void cgi_put(cgi_worker_t *w, int failed)
+{
+    cgi_pool_t *p = w->pool;
+
+    pthread_mutex_lock(&cgi_mutex);
+    if (failed || w->gen != p->gen) {
+	p->nworkers--;
+	pthread_cond_signal(&cgi_cond);
+	pthread_mutex_unlock(&cgi_mutex);
+	cgi_kill(w);
+	return;
+    }
+    w->next = p->idle;
+    p->idle = w;
+    pthread_cond_signal(&cgi_cond);
+    pthread_mutex_unlock(&cgi_mutex);
+}
+
+/*
+ * cgi_listed - test if -w named the script at filename, "." and its URI
+ */
+static int cgi_listed(char *filename)
+{
+    int i;
+
+    for (i = 0; i < cgi_nscripts; i++)
+	if (!strcmp(filename + 1, cgi_scripts[i]))
+	    return 1;
+    return 0;
+}
+
+/*
+ * serve_worker - answer a dynamic request with a worker of the script
+ *     return 0 if it did, or -1 if the script is plain CGI or not named
+ *     with -w
+ */
+int serve_worker(conn_t *c, char *filename, char *cgiargs,
+		 struct stat *sbuf)
+{
+    char buf[MAXBUF], status[MAXLINE];
+    struct iovec iov[2];
+    cgi_worker_t *w;
+    uint32_t len, n;
+    int failed;
+
+    if (!cgi_listed(filename) || (w = cgi_get(filename, sbuf)) == NULL)
+	return -1;
+
+    /* The request: its variables, each "NAME=value" and a NUL */
+    n = snprintf(buf, sizeof(buf), "QUERY_STRING=%s%cREQUEST_METHOD=GET%c",
+		 cgiargs, '\0', '\0');
+    if (n >= sizeof(buf)) {     /* cut short: not worth sending */
+	cgi_put(w, 0);
+	clienterror(c, filename, "414", "URI Too Long",
+		    "Tiny's CGI worker cannot take this query");
+	return 0;
+    }
+    len = htonl(n);
+    iov[0].iov_base = &len;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+    failed = writevn(w->fd, iov, 2, 0) < 0 || rio_readn(w->fd, &len, 4) != 4;
+    if (!failed) {              /* the first part of the answer */
+	len = ntohl(len);
+	n = len < sizeof(buf) ? len : sizeof(buf);
+	failed = rio_readn(w->fd, buf, n) != n;
+    }
+    if (failed) {
+	cgi_put(w, 1);
+	clienterror(c, filename, "500", "Internal Server Error",
+		    "Tiny's CGI worker failed");
+	return 0;
+    }
+
+    /* 
+     * The answer: our status line, then the script's output as it
+     * comes; the connection is kept only if the output has a length
+     */
+    if (!cgi_has_length(buf, n))
+	c->keep = 0;
+    sprintf(status, "HTTP/1.%d 200 OK\r\nServer: Tiny Web Server\r\n"
+	    "Connection: %s\r\n", c->minor, c->keep ? "keep-alive" : "close");
+    iov[0].iov_base = status;
+    iov[0].iov_len = strlen(status);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = n;
+    failed = writevn(c->fd, iov, 2, len > n ? MSG_MORE : 0) < 0;
+    for (len -= n; len > 0 && !failed; len -= n) {
+	n = len < sizeof(buf) ? len : sizeof(buf);
+	failed = rio_readn(w->fd, buf, n) != n ||
+	    sendn(c->fd, buf, n, len > n ? MSG_MORE : 0) < 0;
+    }
+    if (failed)
+	c->keep = 0;
+    cgi_put(w, failed);         /* out of step if the frame was cut */
+    return 0;
+}
+
+/*
+ * cgi_has_length - test if the start of a CGI program's output, n bytes
+ *     of buf, has a Content-length header
+ */
+int cgi_has_length(char *buf, int n)
+{
+    char *p = buf, *nl;
+
+    while ((nl = memchr(p, '\n', buf + n - p)) != NULL && nl - p > 1) {
+	if (!strncasecmp(p, "Content-length:", 15))
+	    return 1;
+	p = nl + 1;
+    }
+    return 0;
+}
+
 /*
  * doit - handle one HTTP request/response transaction
  */
 /* $begin doit */
-void doit(int fd) 
+void doit(conn_t *c) 
 {
     int is_static;
     struct stat sbuf;
+    fentry_t *f;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
   
     /* Read request line and headers */
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);                   //line:netp:doit:readrequest
+    if (rio_readlineb(&c->rio, buf, MAXLINE) <= 0) {     //line:netp:doit:readrequest
+        c->keep = 0;            /* closed, or idle too long */
+        return;
+    }
     dbg_printf("----- tiny debug info: receive request -----\n");
     dbg_printf("%s", buf);
+    version[0] = '\0';
     sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    c->minor = !strcmp(version, "HTTP/1.1");
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
-       clienterror(fd, method, "501", "Not Implemented",
+        c->keep = 0;            /* its body, if any, is not read */
+        clienterror(c, method, "501", "Not Implemented",
                 "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    if (read_requesthdrs(c) < 0) {                       //line:netp:doit:readrequesthdrs
+        c->keep = 0;
+        return;
+    }
     dbg_printf("--------------------------------------------\n");
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
+    if (is_static) { /* Serve static content */          
+	if ((f = fcache_get(filename)) == NULL) {
+	    if (errno == EACCES)                         //line:netp:doit:readable
+		clienterror(c, filename, "403", "Forbidden",
+			    "Tiny couldn't read the file");
+	    else
+		clienterror(c, filename, "404", "Not found",
+			    "Tiny couldn't find this file");
+	    return;
+	}
+	serve_static(c, f);                              //line:netp:doit:servestatic
+	return;
+    }
+
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
-	clienterror(fd, filename, "404", "Not found",
+	clienterror(c, filename, "404", "Not found",
 		    "Tiny couldn't find this file");
 	return;
     }                                                    //line:netp:doit:endnotfound
 
-    if (is_static) { /* Serve static content */          
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
-    }
-    else { /* Serve dynamic content */
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
-	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
-	}
-	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+    /* Serve dynamic content */
+    if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
+	clienterror(c, filename, "403", "Forbidden",
+		    "Tiny couldn't run the CGI program");
+	return;
     }
+    serve_dynamic(c, filename, cgiargs, &sbuf);          //line:netp:doit:servedynamic
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read and parse HTTP request headers
+ * read_requesthdrs - read and parse HTTP request headers; a Connection
+ *     header can stop c from being kept
+ *     return 0, or -1 if the connection ended first
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(conn_t *c) 
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *p;
+    int persistent = c->minor;  /* HTTP/1.1 persists unless told not to */
 
-    rio_readlineb(rp, buf, MAXLINE);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-        rio_readlineb(rp, buf, MAXLINE);
+    if (rio_readlineb(&c->rio, buf, MAXLINE) <= 0)
+        return -1;
+    while(strcmp(buf, "\r\n") && strcmp(buf, "\n")) {          //line:netp:readhdrs:checkterm
+        if (!strncasecmp(buf, "Connection:", 11)) {
+            for (p = buf; *p; p++)
+                *p = tolower((unsigned char)*p);
+            if (strstr(buf, "close"))
+                persistent = 0;
+            else if (strstr(buf, "keep-alive"))
+                persistent = 1;
+        }
+        if (rio_readlineb(&c->rio, buf, MAXLINE) <= 0)
+            return -1;
         dbg_printf("%s", buf);
     }
-    return;
+    c->keep = c->keep && persistent;
+    return 0;
 }
 /* $end read_requesthdrs */
 
@@ -146,72 +1039,224 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client; the answer holds the
+ *     file until it is written
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(conn_t *c, fentry_t *f) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
- 
-    /* Send response headers to client */
-    get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
+    static char *status[] = { "HTTP/1.0 200 OK\r\n", "HTTP/1.1 200 OK\r\n" };
+    static char *connection[] = { "Connection: close\r\n\r\n",
+				  "Connection: keep-alive\r\n\r\n" };
+    struct iovec *iov;
+    off_t offset = 0;
+    ssize_t n;
+
+    /* Queue the header, and a small file's body, after waiting answers */
+    if (c->nheld == BATCH_MAX)
+	conn_flush(c, 0);
+    iov = c->iov + c->iovcnt;               //line:netp:servestatic:beginserve
+    iov[0].iov_base = status[c->minor];
+    iov[0].iov_len = strlen(status[c->minor]);
+    iov[1].iov_base = f->header;
+    iov[1].iov_len = f->header_len;
+    iov[2].iov_base = connection[c->keep];
+    iov[2].iov_len = strlen(connection[c->keep]);
+    c->iovcnt += 3;
+    if (f->body != NULL || f->size == 0) {
+	iov[3].iov_base = f->body;
+	iov[3].iov_len = f->size;
+	c->iovcnt++;
+	c->held[c->nheld++] = f;            /* until it is written */
+	return;
+    }
+
+    /* MSG_MORE corks the header until the body joins it in a segment */
+    conn_flush(c, MSG_MORE);                //line:netp:servestatic:endserve
 
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = (char *)Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
-    Close(srcfd);                           //line:netp:servestatic:close
-    rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    /* Send response body to client, from the page cache */
+    while (offset < f->size) {              //line:netp:servestatic:sendfile
+	n = sendfile(c->fd, f->fd, &offset, f->size - offset);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0) {
+	    c->keep = 0;                    /* the client left, or it shrank */
+	    break;
+	}
+    }
+    fcache_put(f);
 }
 
 /*
- * get_filetype - derive file type from file name
+ * sendn - send all n bytes of buf with flags
+ *     return 0, or -1 on error
  */
-void get_filetype(char *filename, char *filetype) 
+int sendn(int fd, char *buf, size_t n, int flags)
 {
-    if (strstr(filename, ".html"))
-        strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-        strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg"))
-        strcpy(filetype, "image/jpeg");
+    ssize_t sent;
+
+    while (n > 0) {
+	if ((sent = send(fd, buf, n, flags)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buf += sent;
+	n -= sent;
+    }
+    return 0;
+}
+
+/*
+ * writevn - send all of the cnt buffers of iov, which it updates, on
+ *     socket fd with flags
+ *     return 0, or -1 on error
+ */
+int writevn(int fd, struct iovec *iov, int cnt, int flags)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    while (cnt > 0) {
+	msg.msg_iov = iov;
+	msg.msg_iovlen = cnt;
+	if ((n = sendmsg(fd, &msg, flags)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	for (; cnt > 0 && n >= (ssize_t)iov->iov_len; iov++, cnt--)
+	    n -= iov->iov_len;
+	if (cnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+/*
+ * File name extensions and their MIME types; mime_table hashes the
+ * extensions to entries, so a lookup costs one hash of the extension
+ */
+static struct {
+    char *ext;
+    char *type;
+} mime_types[] = {
+    { "html", "text/html" },
+    { "htm", "text/html" },
+    { "css", "text/css" },
+    { "txt", "text/plain" },
+    { "js", "application/javascript" },
+    { "json", "application/json" },
+    { "xml", "application/xml" },
+    { "pdf", "application/pdf" },
+    { "gif", "image/gif" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "png", "image/png" },
+    { "svg", "image/svg+xml" },
+    { "ico", "image/x-icon" },
     // HOMEWORK 11.7
-    else if (strstr(filename, ".mpg"))
-        strcpy(filetype, "video/mpeg");
-    else if (strstr(filename, ".mp4"))
-        strcpy(filetype, "video/mp4");
-    else
-        strcpy(filetype, "text/plain");
-}  
+    { "mpg", "video/mpeg" },
+    { "mp4", "video/mp4" },
+};
+static int mime_table[MIME_BUCKETS]; /* index + 1 into mime_types, or 0 */
+
+/*
+ * mime_hash - hash a lower case extension into a bucket
+ */
+static unsigned mime_hash(char *ext)
+{
+    unsigned h = 5381;
+
+    while (*ext)
+	h = h * 33 + (unsigned char)*ext++;
+    return h % MIME_BUCKETS;
+}
+
+/*
+ * mime_init - build mime_table
+ */
+void mime_init(void)
+{
+    unsigned h;
+    int i;
+
+    for (i = 0; i < sizeof(mime_types) / sizeof(mime_types[0]); i++) {
+	for (h = mime_hash(mime_types[i].ext); mime_table[h];
+	     h = (h + 1) % MIME_BUCKETS)
+	    ;
+	mime_table[h] = i + 1;
+    }
+}
+
+/*
+ * get_filetype - derive file type from the extension of file name
+ */
+const char *get_filetype(char *filename) 
+{
+    char ext[MIME_EXT_MAX + 1], *dot;
+    unsigned h;
+    int i;
+
+    /* Only the last component's extension counts */
+    if ((dot = strrchr(filename, '.')) == NULL || strchr(dot, '/') ||
+	strlen(dot + 1) > MIME_EXT_MAX)
+	return "text/plain";
+    for (i = 0; dot[i + 1]; i++)
+	ext[i] = tolower((unsigned char)dot[i + 1]);
+    ext[i] = '\0';
+    for (h = mime_hash(ext); mime_table[h]; h = (h + 1) % MIME_BUCKETS)
+	if (!strcmp(mime_types[mime_table[h] - 1].ext, ext))
+	    return mime_types[mime_table[h] - 1].type;
+    return "text/plain";
+}
+ 
 /* $end serve_static */
 
 /*
  * serve_dynamic - run a CGI program on behalf of the client
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+void serve_dynamic(conn_t *c, char *filename, char *cgiargs,
+		   struct stat *sbuf) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE], query[MAXLINE + 16], *emptylist[] = { NULL };
+    char **envp;
+    pid_t pid;
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    rio_writen(fd, buf, strlen(buf));
+    /* A script that keeps workers running needs no fork */
+    conn_flush(c, 0);           /* earlier answers go first */
+    if (serve_worker(c, filename, cgiargs, sbuf) == 0)
+	return;
+
+    /* Return first part of HTTP response; the output ends it */
+    c->keep = 0;
+    sprintf(buf, "HTTP/1.%d 200 OK\r\n", c->minor); 
+    rio_writen(c->fd, buf, strlen(buf));
+    sprintf(buf, "Server: Tiny Web Server\r\nConnection: close\r\n");
+    rio_writen(c->fd, buf, strlen(buf));
+
+    /* 
+     * Build the child's environment here rather than setenv in the
+     * child: another thread of the pool may hold the environment's lock
+     * at the fork, and the child would wait on it forever
+     */
+    /* Real server would set all CGI vars here */
+    sprintf(query, "QUERY_STRING=%s", cgiargs);
+    envp = cgi_env(query);
   
-    if (Fork() == 0) { /* child */ //line:netp:servedynamic:fork
-	/* Real server would set all CGI vars here */
-	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
-	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
-	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
+    if ((pid = Fork()) == 0) { /* child */ //line:netp:servedynamic:fork
+	Signal(SIGPIPE, SIG_DFL);
+	Dup2(c->fd, STDOUT_FILENO);      /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+	close_range(3, ~0U, 0);          /* other clients' sockets */
+	Execve(filename, emptylist, envp); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    /* Parent waits for and reaps its own child, not another thread's */
+    Waitpid(pid, NULL, 0); //line:netp:servedynamic:wait
+    Free(envp);
 }
 /* $end serve_dynamic */
 
@@ -219,25 +1264,35 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(conn_t *c, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
     char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
+    int n, len;
+
+    /* Build the HTTP response body, each part after the last */
+    len = sprintf(body, "<html><title>Tiny Error</title>");
+    len += sprintf(body + len, "<body bgcolor=""ffffff"">\r\n");
+    len += sprintf(body + len, "%s: %s\r\n", errnum, shortmsg);
+    len += snprintf(body + len, sizeof(body) - len, "<p>%s: %s\r\n",
+		    longmsg, cause);
+    if (len > sizeof(body) - 64)    /* a cause too long is cut */
+	len = sizeof(body) - 64;
+    len += sprintf(body + len, "<hr><em>The Tiny Web server</em>\r\n");
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, body, strlen(body));
+    /* Print the HTTP response, after the answers before it */
+    n = sprintf(buf, "HTTP/1.%d %s %s\r\n", c->minor, errnum, shortmsg);
+    n += sprintf(buf + n, "Content-type: text/html\r\n");
+    n += sprintf(buf + n, "Connection: %s\r\n",
+		 c->keep ? "keep-alive" : "close");
+    n += sprintf(buf + n, "Content-length: %d\r\n\r\n", len);
+    conn_flush(c, 0);
+    iov[0].iov_base = buf;
+    iov[0].iov_len = n;
+    iov[1].iov_base = body;
+    iov[1].iov_len = len;
+    if (writevn(c->fd, iov, 2, 0) < 0)
+	c->keep = 0;
 }
 /* $end clienterror */
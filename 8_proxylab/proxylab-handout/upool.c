@@ -0,0 +1,175 @@
+/*
+ * upool.c - pool of idle connections to upstream servers
+ *
+ * Servers hash into a fixed table of chains. Each server keeps its idle
+ * connections on a stack, most recently parked first, so the freshest
+ * connection is reused and expired ones collect at the bottom.
+ */
+#include "csapp.h"
+#include "upool.h"
+#include "dns.h"
+
+#define UPOOL_BUCKET_SUM 64
+
+typedef struct idle_conn {
+    int fd;
+    time_t since;                 /* when it was parked */
+    struct idle_conn *next;       /* parked earlier */
+} idle_conn_t;
+
+typedef struct upool_host {
+    char *host;
+    int port;
+    idle_conn_t *idle;            /* most recently parked first */
+    int idle_sum;
+    struct upool_host *next;
+} upool_host_t;
+
+static upool_host_t *buckets[UPOOL_BUCKET_SUM];
+static int idle_total;
+static int max_idle_per_host;
+static int idle_timeout;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * find_host - return the entry for host:port, creating it if asked
+ */
+static upool_host_t *find_host(const char *host, int port, int create) {
+    unsigned int h = 2166136261u;
+    const char *p;
+    upool_host_t *uh;
+
+    for (p = host; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 16777619u;
+    }
+    h = (h ^ (unsigned int)port) * 16777619u;
+    for (uh = buckets[h % UPOOL_BUCKET_SUM]; uh != NULL; uh = uh->next) {
+        if (uh->port == port && strcmp(uh->host, host) == 0) {
+            return uh;
+        }
+    }
+    if (!create || (uh = calloc(1, sizeof(upool_host_t))) == NULL) {
+        return NULL;
+    }
+    if ((uh->host = strdup(host)) == NULL) {
+        free(uh);
+        return NULL;
+    }
+    uh->port = port;
+    uh->next = buckets[h % UPOOL_BUCKET_SUM];
+    buckets[h % UPOOL_BUCKET_SUM] = uh;
+    return uh;
+}
+
+/*
+ * expire - close the host's connections parked for too long;
+ *          caller holds the mutex
+ */
+static void expire(upool_host_t *uh, time_t now) {
+    idle_conn_t **pp = &uh->idle, *ic;
+
+    while ((ic = *pp) != NULL) {
+        if (now - ic->since >= idle_timeout) {
+            *pp = NULL;   /* everything below was parked even earlier */
+            while (ic != NULL) {
+                idle_conn_t *next = ic->next;
+                close(ic->fd);
+                free(ic);
+                uh->idle_sum--;
+                idle_total--;
+                ic = next;
+            }
+            return;
+        }
+        pp = &ic->next;
+    }
+}
+
+/*
+ * still_open - test if an idle connection was not closed by the server
+ */
+static int still_open(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upool_init - set the pool limits
+ */
+void upool_init(int max_idle, int timeout) {
+    max_idle_per_host = max_idle;
+    idle_timeout = timeout;
+}
+
+/*
+ * upool_set_timeout - change how long idle connections are kept
+ */
+void upool_set_timeout(int timeout) {
+    pthread_mutex_lock(&mutex);
+    idle_timeout = timeout;
+    pthread_mutex_unlock(&mutex);
+}
+
+/*
+ * upool_get - return a connection to host:port, reusing an idle one if
+ *             possible; *reused tells which
+ *             return -1 if no connection can be made
+ */
+int upool_get(char *host, int port, int *reused) {
+    upool_host_t *uh;
+    idle_conn_t *ic;
+    int fd;
+
+    pthread_mutex_lock(&mutex);
+    if ((uh = find_host(host, port, 0)) != NULL) {
+        expire(uh, time(NULL));
+        while ((ic = uh->idle) != NULL) {
+            uh->idle = ic->next;
+            uh->idle_sum--;
+            idle_total--;
+            fd = ic->fd;
+            free(ic);
+            if (still_open(fd)) {
+                pthread_mutex_unlock(&mutex);
+                *reused = 1;
+                return fd;
+            }
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    *reused = 0;
+    fd = dns_open_clientfd(host, port);
+    return fd < 0 ? -1 : fd;
+}
+
+/*
+ * upool_put - park a reusable connection to host:port, or close it if the
+ *             pool is full
+ */
+void upool_put(const char *host, int port, int fd) {
+    upool_host_t *uh;
+    idle_conn_t *ic;
+
+    pthread_mutex_lock(&mutex);
+    uh = find_host(host, port, 1);
+    if (uh != NULL) {
+        expire(uh, time(NULL));
+    }
+    if (uh == NULL || uh->idle_sum >= max_idle_per_host ||
+        idle_total >= UPOOL_MAX_IDLE ||
+        (ic = malloc(sizeof(idle_conn_t))) == NULL) {
+        pthread_mutex_unlock(&mutex);
+        close(fd);
+        return;
+    }
+    ic->fd = fd;
+    ic->since = time(NULL);
+    ic->next = uh->idle;
+    uh->idle = ic;
+    uh->idle_sum++;
+    idle_total++;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,21 @@
+/*
+ * upool.h - pool of idle connections to upstream servers
+ *
+ * Connections whose response left them reusable are parked per
+ * (host, port) and handed to the next request for the same server,
+ * saving a TCP handshake. Idle connections expire after a timeout and
+ * each server keeps at most a fixed number of them.
+ */
+#ifndef __UPOOL_H__
+#define __UPOOL_H__
+
+#define UPOOL_MAX_IDLE_PER_HOST 8
+#define UPOOL_MAX_IDLE 256
+#define UPOOL_IDLE_TIMEOUT 30      /* seconds */
+
+void upool_init(int max_idle_per_host, int idle_timeout);
+void upool_set_timeout(int idle_timeout);
+int upool_get(char *host, int port, int *reused);
+void upool_put(const char *host, int port, int fd);
+
+#endif /* __UPOOL_H__ */